@@ -0,0 +1,159 @@
+/* alloc.c: Allocator hooks and allocation accounting
+ *
+ * Every allocation made by the library (and, once smq_set_allocator has been
+ * called, by libcurl) goes through the hooks below.  When accounting is
+ * enabled each call is also counted against the path of the calling thread,
+ * so a benchmark can check how many allocations each message costs.
+ **/
+
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+/* Default Allocator */
+
+static void * alloc_libc_malloc(size_t size, void *user) {
+    return malloc(size);
+}
+
+static void * alloc_libc_calloc(size_t n, size_t size, void *user) {
+    return calloc(n, size);
+}
+
+static void * alloc_libc_realloc(void *p, size_t size, void *user) {
+    return realloc(p, size);
+}
+
+static void * alloc_libc_aligned_alloc(size_t alignment, size_t size, void *user) {
+    // aligned_alloc requires size to be a multiple of alignment
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+static void alloc_libc_free(void *p, void *user) {
+    free(p);
+}
+
+/* Internal Globals */
+
+static const SMQAllocator LibcAllocator = {
+    .malloc         = alloc_libc_malloc,
+    .calloc         = alloc_libc_calloc,
+    .realloc        = alloc_libc_realloc,
+    .aligned_alloc  = alloc_libc_aligned_alloc,
+    .free           = alloc_libc_free,
+    .user           = NULL,
+};
+
+static SMQAllocator Allocator = LibcAllocator;
+static bool         CurlHooked = false;     // Whether libcurl allocates through smq_*
+
+static atomic_bool                  Accounting = false;
+static atomic_uint_fast64_t         Allocs[ALLOC_NPATHS];
+static atomic_uint_fast64_t         Frees[ALLOC_NPATHS];
+static atomic_uint_fast64_t         Bytes[ALLOC_NPATHS];
+static _Thread_local AllocPath      Path = ALLOC_PATH_OTHER;
+
+/* Internal Functions */
+
+static inline void alloc_count(atomic_uint_fast64_t *counter, size_t bytes) {
+    if (atomic_load_explicit(&Accounting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&counter[Path], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&Bytes[Path], bytes, memory_order_relaxed);
+    }
+}
+
+/* Functions */
+
+/**
+ * Replace the allocator used by the library and by libcurl.
+ *
+ * Note: this must be called before any SMQ is created and before libcurl is
+ * used elsewhere in the process (see curl_global_init_mem).  libcurl's hooks
+ * are installed by the first call only and route through the smq_* functions,
+ * so later calls also change what libcurl uses; memory must not outlive the
+ * allocator that returned it.
+ *
+ * @param   allocator   Allocator hooks (NULL restores the C library allocator).
+ **/
+void smq_set_allocator(const SMQAllocator *allocator) {
+    Allocator = allocator ? *allocator : LibcAllocator;
+
+    if (!CurlHooked) {
+        curl_global_init_mem(CURL_GLOBAL_DEFAULT, smq_malloc, smq_free, smq_realloc, smq_strdup, smq_calloc);
+        CurlHooked = true;
+    }
+}
+
+/**
+ * Enable or disable counting of allocations (disabled by default).
+ * @param   enabled     Whether or not to count allocations.
+ **/
+void smq_alloc_accounting(bool enabled) {
+    atomic_store(&Accounting, enabled);
+}
+
+/**
+ * Read allocation counters (cumulative since process start).
+ * @param   out         Snapshot to fill in.
+ **/
+void smq_alloc_stats(SMQAllocStats *out) {
+    for (int p = 0; p < ALLOC_NPATHS; p++) {
+        out->allocs[p] = atomic_load_explicit(&Allocs[p], memory_order_relaxed);
+        out->frees[p]  = atomic_load_explicit(&Frees[p], memory_order_relaxed);
+        out->bytes[p]  = atomic_load_explicit(&Bytes[p], memory_order_relaxed);
+    }
+}
+
+/**
+ * Set the path the calling thread's allocations are counted against.
+ * @param   path        New path.
+ * @return  Previous path (to restore when leaving).
+ **/
+AllocPath alloc_path(AllocPath path) {
+    AllocPath previous = Path;
+    Path = path;
+    return previous;
+}
+
+void * smq_malloc(size_t size) {
+    alloc_count(Allocs, size);
+    return Allocator.malloc(size, Allocator.user);
+}
+
+void * smq_calloc(size_t n, size_t size) {
+    alloc_count(Allocs, n * size);
+    return Allocator.calloc(n, size, Allocator.user);
+}
+
+void * smq_realloc(void *p, size_t size) {
+    alloc_count(Allocs, size);
+    return Allocator.realloc(p, size, Allocator.user);
+}
+
+void * smq_aligned_alloc(size_t alignment, size_t size) {
+    alloc_count(Allocs, size);
+    return Allocator.aligned_alloc(alignment, size, Allocator.user);
+}
+
+char * smq_strdup(const char *s) {
+    size_t length = strlen(s) + 1;
+    char  *copy   = smq_malloc(length);
+    if (copy) {
+        memcpy(copy, s, length);
+    }
+    return copy;
+}
+
+void smq_free(void *p) {
+    if (p) {
+        alloc_count(Frees, 0);
+        Allocator.free(p, Allocator.user);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
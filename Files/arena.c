@@ -0,0 +1,208 @@
+/* arena.c: Segmented arena for queued messages
+ *
+ * Allocations are bumped sequentially out of large segments, so the messages
+ * of a backlog sit next to each other in memory in the order they will be
+ * consumed.  Each segment counts its live allocations; once every one of
+ * them has been released (and the segment is no longer being filled) the
+ * whole segment is recycled at once.  Nothing is ever freed individually.
+ *
+ * Segments are mapped directly (optionally with huge pages) and so do not go
+ * through the allocator hooks.
+ **/
+
+#include "smq/arena.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+/* Internal Constants */
+
+#define ARENA_HUGE_PAGE     (2<<20)
+
+/* Internal Structures */
+
+typedef struct {
+    ArenaSegment   *segment;    // Segment allocation belongs to
+    size_t          padding;    // Keeps allocation aligned to ARENA_ALIGN
+} ArenaHeader;
+
+/* Internal Functions */
+
+static size_t arena_round(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+/**
+ * Map segment with room for at least size bytes (huge pages if requested and
+ * available, transparent huge pages otherwise).
+ **/
+static ArenaSegment * arena_map(Arena *a, size_t size) {
+    size_t  mapped = arena_round(sizeof(ArenaSegment) + size, a->huge ? ARENA_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE));
+    void   *memory = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (a->huge) {
+        memory = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            error("Unable to map arena segment of %zu bytes: %s", mapped, strerror(errno));
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (a->huge) {
+            madvise(memory, mapped, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    ArenaSegment *s = memory;
+    s->arena  = a;
+    s->mapped = mapped;
+    s->size   = mapped - sizeof(ArenaSegment);
+    atomic_fetch_add(&a->segments, 1);
+    return s;
+}
+
+static void arena_unmap(ArenaSegment *s) {
+    atomic_fetch_sub(&s->arena->segments, 1);
+    munmap(s, s->mapped);
+}
+
+/**
+ * Recycle segment that has no live allocations left (arena must be locked).
+ **/
+static void arena_recycle(Arena *a, ArenaSegment *s) {
+    if (s->mapped == a->segment && a->nspares < ARENA_SPARES) {
+        s->next   = a->spares;
+        a->spares = s;
+        a->nspares++;
+    } else {
+        arena_unmap(s);
+    }
+}
+
+/**
+ * Drop reference the arena holds on its current segment (arena must be
+ * locked).
+ **/
+static void arena_retire(Arena *a) {
+    ArenaSegment *s = a->current;
+    a->current = NULL;
+    if (s && atomic_fetch_sub(&s->live, 1) == 1) {
+        arena_recycle(a, s);
+    }
+}
+
+/* Functions */
+
+/**
+ * Create arena.
+ * @param   segment     Segment size (bytes, 0 = ARENA_SEGMENT_SIZE).
+ * @param   huge        Whether to back segments with huge pages.
+ * @return  Newly allocated Arena structure (NULL on failure).
+ **/
+Arena * arena_create(size_t segment, bool huge) {
+    Arena *a = smq_calloc(1, sizeof(Arena));
+    if (!a) {
+        return NULL;
+    }
+
+    a->huge    = huge;
+    a->segment = arena_round(segment ? segment : ARENA_SEGMENT_SIZE, huge ? ARENA_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE));
+    atomic_init(&a->segments, 0);
+    mutex_init(&a->lock, NULL);
+    return a;
+}
+
+/**
+ * Delete arena and unmap all of its segments.
+ *
+ * Note: every allocation must have been released (or be abandoned) first.
+ *
+ * @param   a           Arena structure.
+ **/
+void arena_delete(Arena *a) {
+    if (!a) {
+        return;
+    }
+
+    mutex_lock(&a->lock);
+    arena_retire(a);
+    while (a->spares) {
+        ArenaSegment *s = a->spares;
+        a->spares = s->next;
+        arena_unmap(s);
+    }
+    mutex_unlock(&a->lock);
+
+    size_t leaked = atomic_load(&a->segments);
+    if (leaked) {
+        error("Arena deleted with %zu segments still in use", leaked);
+    }
+    smq_free(a);
+}
+
+/**
+ * Allocate size bytes from arena (aligned to ARENA_ALIGN).
+ * @param   a           Arena structure.
+ * @param   size        Number of bytes.
+ * @return  Pointer to memory (release with arena_release), NULL on failure.
+ **/
+void * arena_alloc(Arena *a, size_t size) {
+    size_t need = arena_round(sizeof(ArenaHeader) + size, ARENA_ALIGN);
+
+    mutex_lock(&a->lock);
+    ArenaSegment *s = a->current;
+    if (!s || s->used + need > s->size) {
+        arena_retire(a);
+
+        // Oversized allocations get a segment of their own
+        if (sizeof(ArenaSegment) + need <= a->segment && a->spares) {
+            s = a->spares;
+            a->spares = s->next;
+            a->nspares--;
+        } else if (!(s = arena_map(a, need > a->segment - sizeof(ArenaSegment) ? need : a->segment - sizeof(ArenaSegment)))) {
+            mutex_unlock(&a->lock);
+            return NULL;
+        }
+
+        s->used = 0;
+        atomic_store(&s->live, 1);
+        a->current = s;
+    }
+
+    ArenaHeader *h = (ArenaHeader *)(s->data + s->used);
+    s->used += need;
+    atomic_fetch_add_explicit(&s->live, 1, memory_order_relaxed);
+    mutex_unlock(&a->lock);
+
+    h->segment = s;
+    return h + 1;
+}
+
+/**
+ * Release allocation; its segment is recycled once all of its allocations
+ * have been released.
+ * @param   p           Pointer returned by arena_alloc (NULL is ignored).
+ **/
+void arena_release(void *p) {
+    if (!p) {
+        return;
+    }
+
+    ArenaSegment *s = ((ArenaHeader *)p - 1)->segment;
+    if (atomic_fetch_sub_explicit(&s->live, 1, memory_order_acq_rel) == 1) {
+        Arena *a = s->arena;
+        mutex_lock(&a->lock);
+        arena_recycle(a, s);
+        mutex_unlock(&a->lock);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
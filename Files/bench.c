@@ -0,0 +1,592 @@
+/* bench.c
+ * Benchmark harness for the SMQ queue and request code.
+ *
+ * Each scenario is timed with the monotonic clock and, where permitted, with
+ * hardware performance counters, and the results are reported per message.
+ **/
+
+#include "smq/alloc.h"
+#include "smq/client.h"
+#include "smq/frame.h"
+#include "smq/perf.h"
+#include "smq/queue.h"
+#include "smq/recorder.h"
+#include "smq/request.h"
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_BODY  "The quick brown fox jumps over the lazy dog"
+#define BENCH_URL   "localhost:9620/topic/bench"
+#define BENCH_HOST  "localhost"
+#define BENCH_PORT  "9620"
+
+#define BENCH_INSTANCES 256         // Maximum SMQ instances in memory scenario
+#define BENCH_ROUNDTRIP 1000        // Maximum messages in roundtrip scenario
+#define BENCH_STARTUP   20          // Maximum SMQ instances in startup scenario
+#define BENCH_IDLE      8           // Maximum SMQ instances in idle scenario
+#define BENCH_IDLE_SECONDS 10       // Time instances are left idle in idle scenario
+#define BENCH_CHUNK     16384       // Response chunk size in parse scenario (CURL_MAX_WRITE_SIZE)
+
+size_t NMessages = 1<<18;
+char   Note[BUFSIZ];                // Extra result reported by scenario (if any)
+
+/* Structures */
+
+typedef struct {
+    const char *name;                   // Name of scenario
+    const char *description;            // Description of scenario
+    size_t    (*run)(size_t n);         // Run scenario, return number of messages
+} Scenario;
+
+void usage(int status) {
+    fprintf(stderr, "Usage: ./bench [options] [scenario ...]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -n        Number of messages per scenario\n");
+    fprintf(stderr, "    -l        List scenarios\n");
+    exit(status);
+}
+
+/* Scenarios */
+
+size_t bench_request(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        request_delete(request_create("PUT", BENCH_URL, BENCH_BODY));
+    }
+    return n;
+}
+
+size_t bench_queue(size_t n) {
+    Queue *q = queue_create();
+
+    for (size_t i = 0; i < n; i++) {
+        queue_push(q, request_create("PUT", BENCH_URL, BENCH_BODY));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        request_delete(queue_pop(q, 1000));
+    }
+
+    queue_delete(q);
+    return n;
+}
+
+size_t bench_queue_arena(size_t n) {
+    Queue *q = queue_create_arena(0, false);
+
+    for (size_t i = 0; i < n; i++) {
+        queue_push(q, queue_request(q, "PUT", BENCH_URL, BENCH_BODY));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        request_delete(queue_pop(q, 1000));
+    }
+
+    queue_delete(q);
+    return n;
+}
+
+typedef struct {
+    Queue  *queue;
+    size_t  n;
+} QueueProducer;
+
+void *bench_queue_producer(void *arg) {
+    QueueProducer *p = (QueueProducer *)arg;
+    for (size_t i = 0; i < p->n; i++) {
+        queue_push(p->queue, queue_request(p->queue, "PUT", BENCH_URL, BENCH_BODY));
+    }
+    return NULL;
+}
+
+size_t bench_queue_mt_run(Queue *q, size_t n) {
+    QueueProducer producer = {q, n};
+    Thread thread;
+
+    thread_create(&thread, NULL, bench_queue_producer, &producer);
+    for (size_t i = 0; i < n; i++) {
+        Request *r;
+        while (!(r = queue_pop(producer.queue, 1000)));
+        request_delete(r);
+    }
+    thread_join(thread, NULL);
+
+    queue_delete(producer.queue);
+    return n;
+}
+
+size_t bench_queue_mt(size_t n) {
+    return bench_queue_mt_run(queue_create(), n);
+}
+
+size_t bench_queue_mt_arena(size_t n) {
+    return bench_queue_mt_run(queue_create_arena(0, false), n);
+}
+
+size_t bench_recorder_run(RecorderRingId ring, size_t n) {
+    Recorder *r = recorder_create(RECORDER_EVENTS);
+
+    for (size_t i = 0; i < n; i++) {
+        recorder_record(r, ring, RECORDER_ENQUEUE, 0, i);
+    }
+
+    recorder_delete(r);
+    return n;
+}
+
+size_t bench_recorder(size_t n) {
+    return bench_recorder_run(RECORDER_RING_PUSHER, n);
+}
+
+size_t bench_recorder_shared(size_t n) {
+    return bench_recorder_run(RECORDER_RING_APP, n);
+}
+
+/**
+ * Return resident and virtual memory of process (kilobytes).
+ **/
+void bench_memory_usage(size_t *rss, size_t *vsz) {
+    unsigned long pages = 0, resident = 0;
+    FILE *fs = fopen("/proc/self/statm", "r");
+    if (fs) {
+        if (fscanf(fs, "%lu %lu", &pages, &resident) != 2) {
+            pages = resident = 0;
+        }
+        fclose(fs);
+    }
+    *vsz = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    *rss = resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+size_t bench_memory(size_t n) {
+    size_t instances = min(n, BENCH_INSTANCES);
+    SMQ  **smqs      = calloc(instances, sizeof(SMQ *));
+    size_t rss[3], vsz[3];
+
+    SMQOptions options;
+    smq_options_compact(&options);
+
+    // Subscribe one extra queue so the broker accepts the tenants' publishes
+    // (publishes to a topic without subscribers are rejected)
+    static const char *topics[] = {"bench-memory", NULL};
+    SMQOptions sink_options;
+    smq_options_init(&sink_options);
+    sink_options.eager  = true;
+    sink_options.topics = topics;
+    SMQ *sink = smq_create_with("bench-memory", BENCH_HOST, BENCH_PORT, &sink_options);
+
+    bench_memory_usage(&rss[0], &vsz[0]);
+    for (size_t i = 0; i < instances; i++) {
+        char name[BUFSIZ];
+        snprintf(name, sizeof(name), "bench-tenant-%zu", i);
+        smqs[i] = smq_create_with(name, BENCH_HOST, BENCH_PORT, &options);
+    }
+    bench_memory_usage(&rss[1], &vsz[1]);
+
+    // First publish starts the pusher thread and creates the outgoing queue
+    for (size_t i = 0; i < instances; i++) {
+        smq_publish(smqs[i], "bench-memory", BENCH_BODY);
+    }
+    bench_memory_usage(&rss[2], &vsz[2]);
+
+    for (size_t i = 0; i < instances; i++) {
+        smq_shutdown(smqs[i]);
+        smq_delete(smqs[i]);
+    }
+    free(smqs);
+    smq_shutdown(sink);
+    smq_delete(sink);
+
+    snprintf(Note, sizeof(Note), "per instance: idle %.1f KB RSS / %.1f KB VSZ, active %.1f KB RSS / %.1f KB VSZ",
+        (double)(rss[1] - rss[0]) / instances, (double)(vsz[1] - vsz[0]) / instances,
+        (double)(rss[2] - rss[0]) / instances, (double)(vsz[2] - vsz[0]) / instances);
+    return instances;
+}
+
+/**
+ * Leave idle SMQ instances running and return the long-polls they made per
+ * minute (each).
+ **/
+double bench_idle_rate(size_t instances, bool adaptive) {
+    SMQ    **smqs = calloc(instances, sizeof(SMQ *));
+    uint64_t requests = 0;
+
+    SMQOptions options;
+    smq_options_init(&options);
+    options.eager = true;
+    if (!adaptive) {
+        options.poll_wait_max = options.poll_wait;
+    }
+
+    for (size_t i = 0; i < instances; i++) {
+        char name[BUFSIZ];
+        snprintf(name, sizeof(name), "bench-idle-%zu", i);
+        const char *topics[] = {name, NULL};
+        options.topics = topics;
+        smqs[i] = smq_create_with(name, BENCH_HOST, BENCH_PORT, &options);
+    }
+
+    sleep(BENCH_IDLE_SECONDS);
+
+    for (size_t i = 0; i < instances; i++) {
+        if (smqs[i]) {
+            SMQStats stats;
+            smq_stats(smqs[i], &stats);
+            requests += stats.counters[STATS_REQUESTS] - stats.counters[STATS_FAILURES];
+            smq_shutdown(smqs[i]);
+            smq_delete(smqs[i]);
+        }
+    }
+    free(smqs);
+
+    // Requests include the initial subscription of each instance
+    return (double)(requests - instances) / instances * 60 / BENCH_IDLE_SECONDS;
+}
+
+size_t bench_idle(size_t n) {
+    size_t instances = min(n, BENCH_IDLE);
+    double fixed     = bench_idle_rate(instances, false);
+    double adaptive  = bench_idle_rate(instances, true);
+
+    snprintf(Note, sizeof(Note), "idle long-polls/min per instance: fixed %.1f, adaptive %.1f", fixed, adaptive);
+    return 2 * instances;
+}
+
+size_t bench_roundtrip(size_t n) {
+    size_t messages = min(n, BENCH_ROUNDTRIP);
+    SMQ   *smq      = smq_create("bench-roundtrip", BENCH_HOST, BENCH_PORT);
+    size_t received = 0;
+
+    smq_subscribe(smq, "bench-roundtrip");
+    while (atomic_load(&smq->pending)) {
+        usleep(1000);
+    }
+
+    SMQAllocStats before, after;
+    smq_alloc_stats(&before);
+    for (size_t i = 0; i < messages; i++) {
+        smq_publish(smq, "bench-roundtrip", BENCH_BODY);
+    }
+    while (received < messages) {
+        char *message = smq_retrieve(smq);
+        if (!message) {
+            break;
+        }
+        smq_free(message);
+        received++;
+    }
+    smq_alloc_stats(&after);
+
+    smq_shutdown(smq);
+    smq_delete(smq);
+
+    static const char *paths[ALLOC_NPATHS] = {"other", "publish", "retrieve", "push", "pull"};
+    size_t length = snprintf(Note, sizeof(Note), "allocs/msg:");
+    for (int p = 0; p < ALLOC_NPATHS && received; p++) {
+        length += snprintf(Note + length, sizeof(Note) - length, " %s %.1f", paths[p],
+            (double)(after.allocs[p] - before.allocs[p]) / received);
+    }
+    return received;
+}
+
+void bench_frame(const char *data, size_t length, void *user) {
+    *(size_t *)user += length;
+}
+
+size_t bench_parse(size_t n) {
+    size_t body   = strlen(BENCH_BODY);
+    size_t size   = n * (body + 1);
+    char  *buffer = malloc(size);
+    for (size_t i = 0; i < n; i++) {
+        memcpy(buffer + i * (body + 1), BENCH_BODY, body);
+        buffer[i * (body + 1) + body] = FRAME_DELIMITER;
+    }
+
+    static const char *scanners[] = {"scalar", "sse2", "avx2", NULL};
+    const char *selected = frame_scanner();
+    size_t      length   = snprintf(Note, sizeof(Note), "GB/s:");
+    size_t      frames   = 0;
+
+    for (const char **name = scanners; *name; name++) {
+        if (!frame_use(*name)) {
+            continue;
+        }
+
+        size_t      bytes = 0;
+        FrameParser parser;
+        frame_init(&parser, bench_frame, &bytes);
+        frame_reset(&parser);
+        parser.framed = true;
+
+        uint64_t start = monotonic_ns();
+        for (size_t offset = 0; offset < size; offset += BENCH_CHUNK) {
+            frame_feed(&parser, buffer + offset, min(BENCH_CHUNK, size - offset));
+        }
+        uint64_t stop  = monotonic_ns();
+
+        frames  = parser.frames;
+        length += snprintf(Note + length, sizeof(Note) - length, " %s %.2f", *name, (double)size / (stop - start));
+        frame_free(&parser);
+    }
+
+    frame_use(selected);
+    free(buffer);
+    return frames;
+}
+
+/**
+ * Create SMQ, publish one message and return time until it was delivered
+ * (nanoseconds), accumulating the startup phases of the SMQ.
+ **/
+uint64_t bench_first_publish(bool eager, uint64_t *create, uint64_t phases[STATS_NPHASES]) {
+    static const char *topics[] = {"bench-startup", NULL};
+
+    SMQOptions options;
+    smq_options_init(&options);
+    options.eager  = eager;
+    options.topics = topics;
+
+    uint64_t started = monotonic_ns();
+    SMQ *smq = smq_create_with("bench-startup", BENCH_HOST, BENCH_PORT, &options);
+    if (!smq) {
+        return 0;
+    }
+    *create += monotonic_ns() - started;
+
+    started = monotonic_ns();
+    smq_publish(smq, "bench-startup", BENCH_BODY);
+    while (atomic_load(&smq->pending)) {
+        sched_yield();
+    }
+    uint64_t delivered = monotonic_ns() - started;
+
+    SMQStats stats;
+    smq_stats(smq, &stats);
+    for (int p = 0; p < STATS_NPHASES; p++) {
+        phases[p] += stats.phases[p];
+    }
+
+    smq_shutdown(smq);
+    smq_delete(smq);
+    return delivered;
+}
+
+size_t bench_startup(size_t n) {
+    size_t   instances = min(n, BENCH_STARTUP);
+    uint64_t first[2]  = {0, 0};
+    uint64_t create[2] = {0, 0};
+    uint64_t phases[2][STATS_NPHASES] = {{0}};
+
+    for (size_t i = 0; i < instances; i++) {
+        for (int eager = 0; eager < 2; eager++) {
+            first[eager] += bench_first_publish(eager, &create[eager], phases[eager]);
+        }
+    }
+
+    snprintf(Note, sizeof(Note),
+        "first publish: lazy %.2f ms, eager %.2f ms (create %.2f ms: resolve %.3f connect %.3f subscribe %.3f ready %.3f)",
+        first[0] / 1e6 / instances, first[1] / 1e6 / instances, create[1] / 1e6 / instances,
+        phases[1][STATS_PHASE_RESOLVE] / 1e6 / instances, phases[1][STATS_PHASE_CONNECT] / 1e6 / instances,
+        phases[1][STATS_PHASE_SUBSCRIBE] / 1e6 / instances, phases[1][STATS_PHASE_READY] / 1e6 / instances);
+    return instances;
+}
+
+/**
+ * Publish and retrieve messages through SMQ using transport profile,
+ * accumulating time until all were acknowledged and all were received
+ * (nanoseconds).
+ * @return  Number of messages received.
+ **/
+size_t bench_profile(const char *profile, size_t messages, uint64_t *published, uint64_t *received) {
+    SMQOptions options;
+    smq_options_init(&options);
+    options.transport = connection_profile(profile);
+    options.eager     = true;
+
+    // Separate queue and topic per profile, so a previous SMQ's pending
+    // long-poll cannot take messages meant for this one
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "bench-%s", profile);
+
+    SMQ *smq = smq_create_with(name, BENCH_HOST, BENCH_PORT, &options);
+    if (!smq) {
+        return 0;
+    }
+    smq_subscribe(smq, name);
+    while (atomic_load(&smq->pending)) {
+        usleep(1000);
+    }
+
+    uint64_t started = monotonic_ns();
+    for (size_t i = 0; i < messages; i++) {
+        smq_publish(smq, name, BENCH_BODY);
+    }
+    while (atomic_load(&smq->pending)) {
+        sched_yield();
+    }
+    *published += monotonic_ns() - started;
+
+    size_t count = 0;
+    while (count < messages) {
+        char *message = smq_retrieve(smq);
+        if (!message) {
+            break;
+        }
+        smq_free(message);
+        count++;
+    }
+    *received += monotonic_ns() - started;
+
+    smq_shutdown(smq);
+    smq_delete(smq);
+    return count;
+}
+
+size_t bench_transport(size_t n) {
+    size_t messages = min(n, BENCH_ROUNDTRIP);
+    size_t total    = 0;
+    size_t length   = snprintf(Note, sizeof(Note), "publish/roundtrip ms/msg:");
+
+    for (size_t i = 0; connection_profile_name(i); i++) {
+        const char *profile   = connection_profile_name(i);
+        uint64_t    published = 0;
+        uint64_t    received  = 0;
+        size_t      count     = bench_profile(profile, messages, &published, &received);
+
+        total  += count;
+        length += snprintf(Note + length, sizeof(Note) - length, " %s %.3f/%.3f", profile,
+            count ? published / 1e6 / count : 0.0, count ? received / 1e6 / count : 0.0);
+    }
+    return total;
+}
+
+Scenario Scenarios[] = {
+    {"request",     "request_create + request_delete",              bench_request},
+    {"queue",       "queue_push N then queue_pop N (one thread)",   bench_queue},
+    {"queue-mt",    "one producer thread, one consumer thread",     bench_queue_mt},
+    {"queue-arena", "queue with requests in arena segments",        bench_queue_arena},
+    {"queue-mt-arena", "queue-mt with requests in arena segments",  bench_queue_mt_arena},
+    {"recorder",    "flight recorder event (library thread ring)",  bench_recorder},
+    {"recorder-shared", "flight recorder event (application ring)", bench_recorder_shared},
+    {"parse",       "split batched response into messages (each scanner)", bench_parse},
+    {"roundtrip",   "publish and retrieve through broker (needs server)", bench_roundtrip},
+    {"transport",   "roundtrip with each transport profile (needs server)", bench_transport},
+    {"startup",     "first publish with and without eager connect (needs server)", bench_startup},
+    {"idle",        "long-polls made by idle SMQs, fixed and adaptive wait (needs server)", bench_idle},
+    {"memory",      "compact SMQ instances, idle then after first publish (needs server)", bench_memory},
+    {NULL, NULL, NULL},
+};
+
+/* Functions */
+
+void bench_header(bool counters) {
+    printf("%-16s %10s %10s %10s", "scenario", "messages", "ns/msg", "allocs/msg");
+    for (int c = 0; counters && c < PERF_NCOUNTERS; c++) {
+        printf(" %16s", perf_name(c));
+    }
+    putchar('\n');
+}
+
+void bench_run(Scenario *s, PerfCounters *perf, bool counters) {
+    SMQAllocStats before, after;
+    uint64_t      allocs = 0;
+
+    Note[0] = 0;
+    smq_alloc_stats(&before);
+    uint64_t start = monotonic_ns();
+    perf_start(perf);
+    size_t n = s->run(NMessages);
+    perf_stop(perf);
+    uint64_t stop  = monotonic_ns();
+    smq_alloc_stats(&after);
+
+    for (int p = 0; p < ALLOC_NPATHS; p++) {
+        allocs += after.allocs[p] - before.allocs[p];
+    }
+
+    n = n ? n : 1;
+    printf("%-16s %10zu %10.1f %10.2f", s->name, n, (double)(stop - start) / n, (double)allocs / n);
+    for (int c = 0; counters && c < PERF_NCOUNTERS; c++) {
+        if (perf_available(perf, c)) {
+            printf(" %16.2f", (double)perf->values[c] / n);
+        } else {
+            printf(" %16s", "n/a");
+        }
+    }
+    if (Note[0]) {
+        printf("  %s", Note);
+    }
+    putchar('\n');
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (streq(arg, "-n") && argind < argc) {
+            NMessages = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-l")) {
+            for (Scenario *s = Scenarios; s->name; s++) {
+                printf("%-16s %s\n", s->name, s->description);
+            }
+            return EXIT_SUCCESS;
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (NMessages == 0) {
+        usage(EXIT_FAILURE);
+    }
+
+    for (int i = argind; i < argc; i++) {
+        Scenario *s = Scenarios;
+        while (s->name && !streq(argv[i], s->name)) {
+            s++;
+        }
+        if (!s->name) {
+            error("Unknown scenario: %s", argv[i]);
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    // Route library and libcurl allocations through the counting hooks
+    smq_set_allocator(NULL);
+    smq_alloc_accounting(true);
+
+    PerfCounters perf;
+    bool counters = perf_open(&perf);
+    if (!counters) {
+        info("Performance counters are not permitted (see perf_event_paranoid); reporting wall-clock only");
+    }
+
+    bench_header(counters);
+    for (Scenario *s = Scenarios; s->name; s++) {
+        bool selected = argind == argc;
+        for (int i = argind; i < argc && !selected; i++) {
+            selected = streq(argv[i], s->name);
+        }
+
+        if (selected) {
+            bench_run(s, &perf, counters);
+        }
+    }
+
+    perf_close(&perf);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
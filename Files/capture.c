@@ -0,0 +1,221 @@
+/* capture.c: Traffic capture (compact binary trace of client operations) */
+
+#include "smq/capture.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+/*
+ * Trace format:
+ *
+ *      magic   "SMQCAP1\0"
+ *      record  type    (1 byte)
+ *              delta   (varint, nanoseconds since previous record)
+ *              topic   (varint length + 1, 0 if NULL; followed by bytes)
+ *              body    (varint length + 1, 0 if NULL; followed by bytes)
+ *      ...
+ */
+
+/* Encoding (shared with dead-letter files) */
+
+void capture_write_varint(FILE *fs, uint64_t value) {
+    unsigned char buffer[10];
+    size_t        n = 0;
+
+    do {
+        buffer[n] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            buffer[n] |= 0x80;
+        }
+        n++;
+    } while (value);
+
+    fwrite(buffer, 1, n, fs);
+}
+
+bool capture_read_varint(FILE *fs, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(fs);
+        if (c == EOF) {
+            return false;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void capture_write_string(FILE *fs, const char *s) {
+    if (!s) {
+        capture_write_varint(fs, 0);
+        return;
+    }
+
+    size_t length = strlen(s);
+    capture_write_varint(fs, length + 1);
+    fwrite(s, 1, length, fs);
+}
+
+bool capture_read_string(FILE *fs, char **s) {
+    uint64_t length;
+    *s = NULL;
+
+    if (!capture_read_varint(fs, &length)) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+
+    if (!(*s = smq_malloc(length))) {
+        return false;
+    }
+    if (fread(*s, 1, length - 1, fs) != length - 1) {
+        smq_free(*s);
+        *s = NULL;
+        return false;
+    }
+    (*s)[length - 1] = 0;
+    return true;
+}
+
+/* Internal Functions */
+
+static Capture * capture_allocate(FILE *fs) {
+    Capture *c = smq_calloc(1, sizeof(Capture));
+    if (!c) {
+        fclose(fs);
+        return NULL;
+    }
+
+    c->stream = fs;
+    mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/* Functions */
+
+/**
+ * Create capture file for recording.
+ * @param   path        Path to trace file.
+ * @return  Newly allocated Capture structure (NULL on failure).
+ **/
+Capture * capture_create(const char *path) {
+    FILE *fs = fopen(path, "w");
+    if (!fs) {
+        error("Unable to create capture %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), fs);
+    return capture_allocate(fs);
+}
+
+/**
+ * Open capture file for reading.
+ * @param   path        Path to trace file.
+ * @return  Newly allocated Capture structure (NULL on failure).
+ **/
+Capture * capture_open(const char *path) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        error("Unable to open capture %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    char magic[sizeof(CAPTURE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), fs) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+        error("Not a capture file: %s", path);
+        fclose(fs);
+        return NULL;
+    }
+
+    return capture_allocate(fs);
+}
+
+/**
+ * Close capture file (flushing any buffered records) and free structure.
+ * @param   c           Capture structure.
+ **/
+void capture_close(Capture *c) {
+    if (!c) {
+        return;
+    }
+
+    mutex_lock(&c->lock);
+    fclose(c->stream);
+    c->stream = NULL;
+    mutex_unlock(&c->lock);
+    smq_free(c);
+}
+
+/**
+ * Append record to capture.
+ * @param   c           Capture structure.
+ * @param   type        Type of operation.
+ * @param   topic       Topic string (may be NULL).
+ * @param   body        Body string (may be NULL).
+ **/
+void capture_record(Capture *c, CaptureType type, const char *topic, const char *body) {
+    uint64_t now = monotonic_ns();
+
+    mutex_lock(&c->lock);
+    if (!c->started) {
+        c->started = now;
+    }
+
+    uint64_t timestamp = now - c->started;
+    if (timestamp < c->last) {      // Another thread recorded a later time first
+        timestamp = c->last;
+    }
+
+    fputc(type, c->stream);
+    capture_write_varint(c->stream, timestamp - c->last);
+    capture_write_string(c->stream, topic);
+    capture_write_string(c->stream, body);
+    c->last = timestamp;
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Read next record from capture.
+ * @param   c           Capture structure.
+ * @param   record      Record to fill in (release with capture_record_clear).
+ * @return  Whether or not a record was read.
+ **/
+bool capture_next(Capture *c, CaptureRecord *record) {
+    uint64_t delta;
+    int      type = fgetc(c->stream);
+
+    memset(record, 0, sizeof(CaptureRecord));
+    if (type == EOF || !capture_read_varint(c->stream, &delta)) {
+        return false;
+    }
+
+    if (!capture_read_string(c->stream, &record->topic) ||
+        !capture_read_string(c->stream, &record->body)) {
+        capture_record_clear(record);
+        return false;
+    }
+
+    c->last          += delta;
+    record->type      = type;
+    record->timestamp = c->last;
+    return true;
+}
+
+/**
+ * Release strings in record.
+ * @param   record      Record structure.
+ **/
+void capture_record_clear(CaptureRecord *record) {
+    smq_free(record->topic);
+    smq_free(record->body);
+    record->topic = NULL;
+    record->body  = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
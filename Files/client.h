@@ -1,16 +1,112 @@
 /* client.c: Simple Request Queue Client */
 
+#define _GNU_SOURCE
+
 #include "smq/client.h"
 
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
 /* Internal Prototypes */
 
 void * smq_pusher(void *);
 void * smq_puller(void *);
+void * smq_exporter(void *);
+
+static bool smq_transition(SMQ *smq, SMQState state);
+static bool smq_enqueue(SMQ *smq, Request *r);
+static void smq_delivered(SMQ *smq);
+static void smq_thread_setup(SMQ *smq, const char *name);
+static bool smq_start(SMQ *smq, int which);
+static void smq_fail(SMQ *smq);
+static void smq_thread_attr(SMQ *smq, pthread_attr_t *attr);
+static size_t smq_depth(SMQ *smq, int which);
+static bool smq_wait_ready(SMQ *smq, int which, time_t timeout);
+static char ** smq_copy_topics(const char * const *topics);
+static bool smq_stopped(void *arg);
+static long smq_transfer_time(const Request *r);
+static void smq_dead_letter(SMQ *smq, Request *r, DeadLetterReason reason, bool pusher);
+static void smq_notify(SMQ *smq);
+static bool smq_put(SMQ *smq, const char *url, const char *body, size_t messages);
+
+/* Internal Constants */
+
+#define SMQ_SAMPLE_NS   100000000   // Queue depth sampling interval (100 ms)
+#define SMQ_RETRY_US    100000      // Delay between initial subscription attempts (100 ms)
+
+enum {
+    SMQ_PUSHER = 1<<0,              // Outgoing queue and pusher thread
+    SMQ_PULLER = 1<<1,              // Incoming queue and puller thread
+};
+
+/* Internal Structures */
+
+typedef struct {
+    SMQ         *smq;           // SMQ being pulled for
+    FrameParser *parser;        // Parser of long-poll responses (see FrameParser.trace)
+    uint64_t     started;       // Monotonic time current long-poll started (ns)
+} SMQPoll;
+
+/* Internal Globals */
+
+static atomic_uint DumpRequests = 0;  // Incremented by smq_dump_on_signal handler
 
 /* External Functions */
 
+/**
+ * Initialize options with defaults (library threads inherit everything from
+ * the creating thread).
+ * @param   options     Options structure.
+ **/
+void smq_options_init(SMQOptions *options) {
+    memset(options, 0, sizeof(SMQOptions));
+    options->threads.policy   = -1;
+    options->batch            = SMQ_BATCH;
+    options->poll_wait        = SMQ_POLL_WAIT;
+    options->poll_wait_max    = SMQ_POLL_WAIT_MAX;
+    options->hedge_percentile = SMQ_HEDGE_PERCENTILE;
+    options->hedge_budget     = SMQ_HEDGE_BUDGET;
+}
+
+/**
+ * Initialize options for compact mode, for processes with thousands of SMQs:
+ * small thread stacks, a small flight recorder and threads and queues that
+ * are only created on first use.
+ * @param   options     Options structure.
+ **/
+void smq_options_compact(SMQOptions *options) {
+    smq_options_init(options);
+    options->stack_size      = SMQ_COMPACT_STACK;
+    options->recorder_events = SMQ_COMPACT_EVENTS;
+    options->segment_size    = SMQ_COMPACT_SEGMENT;
+    options->lazy            = true;
+}
+
 /**
  * Create Simple Request Queue with specified name, host, and port.
+ * @param   name        Name of client's queue.
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @return  Newly allocated Simple Request Queue structure.
+ **/
+SMQ * smq_create(const char *name, const char *host, const char *port) {
+    SMQOptions options;
+    smq_options_init(&options);
+    return smq_create_with(name, host, port, &options);
+}
+
+/**
+ * Create Simple Request Queue with specified name, host, port and options.
  *
  * - Initialize values.
  * - Create internal queues.
@@ -19,51 +115,93 @@ void * smq_puller(void *);
  * @param   name        Name of client's queue.
  * @param   host        Address of server.
  * @param   port        Port of server.
+ * @param   options     Creation options (see smq_options_init).
  * @return  Newly allocated Simple Request Queue structure.
  **/
-SMQ * smq_create(const char *name, const char *host, const char *port) {
-    SMQ *smq = malloc(sizeof(SMQ));
+SMQ * smq_create_with(const char *name, const char *host, const char *port, const SMQOptions *options) {
+    SMQ *smq = smq_calloc(1, sizeof(SMQ));
     if(!smq) {
         fprintf(stderr, "Memory allocation failure\n");
         return NULL;
     }
+    smq->created = monotonic_ns();
 
-    strcpy(smq->name, name);
+    smq->options = *options;
+    smq->options.topics         = (const char * const *)smq_copy_topics(options->topics);
+    smq->options.threads.cpus   = options->threads.cpus   ? smq_strdup(options->threads.cpus)   : NULL;
+    smq->options.threads.cgroup = options->threads.cgroup ? smq_strdup(options->threads.cgroup) : NULL;
+    smq->options.dead_letter    = options->dead_letter    ? smq_strdup(options->dead_letter)    : NULL;
+    smq->transport              = options->transport ? *options->transport : *connection_profile(CONNECTION_DEFAULT);
+    smq->options.transport      = &smq->transport;
 
-    // Create server URL
-    char url[1<<8];
-    snprintf(url, sizeof(url), "%s:%s", host, port);
-    strcpy(smq->server_url, url);
-    // set timeout and running
+    // Copy name and create server URL
+    size_t length = strlen(host) + strlen(port) + 2;
+    smq->name       = smq_strdup(name);
+    smq->server_url = smq_malloc(length);
+    if (smq->server_url) {
+        snprintf(smq->server_url, length, "%s:%s", host, port);
+    }
+    // set timeout and state
     smq->timeout = 2000; // 2 seconds
-    smq->running = true;
+    rtt_init(&smq->rtt, SMQ_RTO_INITIAL, SMQ_RTO_MIN, SMQ_RTO_MAX);
+    if (!smq->options.poll_wait) {
+        smq->options.poll_wait = SMQ_POLL_WAIT;
+    }
+    if (!smq->options.poll_wait_max) {
+        smq->options.poll_wait_max = SMQ_POLL_WAIT_MAX;
+    }
+    if (smq->options.poll_wait_max < smq->options.poll_wait) {
+        smq->options.poll_wait_max = smq->options.poll_wait;
+    }
+    atomic_init(&smq->poll_wait, smq->options.poll_wait);
 
-    // Create queues
-    smq->outgoing = queue_create();
-    if (!smq->outgoing) {
-        fprintf(stderr, "Failure in outgoing queue creation");
-        free(smq);
+    // Tag publishes so the broker can drop duplicates (retries and hedges)
+    if (getrandom(&smq->producer, sizeof(smq->producer), 0) != sizeof(smq->producer)) {
+        smq->producer = monotonic_ns() ^ ((uint64_t)getpid() << 32);
+    }
+    atomic_init(&smq->sequence, 0);
+    atomic_init(&smq->state, SMQ_STARTING);
+    atomic_init(&smq->pending, 0);
+    atomic_init(&smq->pending_waiters, 0);
+    atomic_init(&smq->started, 0);
+    atomic_init(&smq->ready, 0);
+    atomic_init(&smq->dumped, 0);
+    atomic_init(&smq->notify_fd, -1);
+    atomic_init(&smq->notified, false);
+    smq->exporter_fd = -1;
+
+    smq->recorder = recorder_create(options->recorder_events ? options->recorder_events : RECORDER_EVENTS);
+    smq->stats    = smq_aligned_alloc(64, sizeof(Stats));
+    if (options->dead_letter && !(smq->dead_letters = deadletter_create(options->dead_letter))) {
+        smq_delete(smq);
         return NULL;
     }
-    smq->incoming = queue_create();
-    if (!smq->incoming) {
-        fprintf(stderr, "Failure in incoming queue creation");
-        free(smq);
+    if (!smq->name || !smq->server_url || !smq->recorder || !smq->stats) {
+        fprintf(stderr, "Failure in SMQ creation\n");
+        smq_delete(smq);
         return NULL;
     }
+    memset(smq->stats, 0, sizeof(Stats));
 
-    // Initialize mutex
+    // Initialize mutex and condition variable
     mutex_init(&(smq->lock), NULL);
+    cond_init(&(smq->cond), NULL);
 
-    // Create pusher and puller threads
-    pthread_t pusher;
-    pthread_t puller;
-    thread_create(&pusher, NULL, smq_pusher, smq);
-    thread_create(&puller, NULL, smq_puller, smq);
+    smq_transition(smq, SMQ_RUNNING);
 
-    smq->pusher = pusher;
-    smq->puller = puller;
+    // Create queues, pusher and puller threads (unless deferred to first use)
+    if ((!options->lazy || options->eager) && !smq_start(smq, SMQ_PUSHER | SMQ_PULLER)) {
+        smq_delete(smq);
+        return NULL;
+    }
 
+    // Wait for connections and initial subscriptions
+    if (options->eager && !smq_ready(smq, options->connect_timeout ? options->connect_timeout : smq->timeout)) {
+        error("Unable to connect %s to %s", smq->name, smq->server_url);
+        smq_fail(smq);
+        smq_delete(smq);
+        return NULL;
+    }
     return smq;
 }
 
@@ -76,9 +214,43 @@ void smq_delete(SMQ *smq) {
     if (!smq) {
         return;
     }
+    size_t undelivered = smq_depth(smq, SMQ_PUSHER);
+    if (undelivered && !smq->dead_letters) {
+        error("Discarding %zu undelivered requests of %s (see smq_shutdown_drain)", undelivered, smq->name);
+    }
+    if (undelivered && smq->dead_letters) {
+        // One sync for the whole queue rather than one per request
+        queue_shutdown(smq->outgoing);
+        deadletter_defer(smq->dead_letters);
+        for (Request *r; (r = queue_pop(smq->outgoing, 0)); ) {
+            smq_dead_letter(smq, r, DEADLETTER_SHUTDOWN, false);
+        }
+        deadletter_sync(smq->dead_letters);
+    }
+
     queue_delete(smq->outgoing);
     queue_delete(smq->incoming);
-    free(smq);
+    capture_close(smq->capture);
+    recorder_delete(smq->recorder);
+    tracer_delete(smq->tracer);
+    deadletter_close(smq->dead_letters);
+    if (atomic_load(&smq->notify_fd) >= 0) {
+        close(atomic_load(&smq->notify_fd));
+    }
+    connection_delete(smq->push_connection);
+    connection_delete(smq->pull_connection);
+    hedge_delete(smq->hedge);
+    for (size_t t = 0; smq->options.topics && smq->options.topics[t]; t++) {
+        smq_free((char *)smq->options.topics[t]);
+    }
+    smq_free((char **)smq->options.topics);
+    smq_free(smq->name);
+    smq_free(smq->server_url);
+    smq_free((char *)smq->options.threads.cpus);
+    smq_free((char *)smq->options.threads.cgroup);
+    smq_free((char *)smq->options.dead_letter);
+    smq_free(smq->stats);
+    smq_free(smq);
 }
 
 /**
@@ -88,16 +260,70 @@ void smq_delete(SMQ *smq) {
  * @param   body    Request body to publish.
  **/
 void smq_publish(SMQ *smq, const char *topic, const char *body) {
-    // If the SMQ is not running, return
-    if (!smq->running) {
-        return;
-    }
-
     // Create the URL
     char url[BUFSIZ];
     sprintf(url, "%s/topic/%s", smq->server_url, topic);
-    Request *r = request_create("PUT", url, body); // Create the request
-    queue_push(smq->outgoing, r); // Push the request to the outgoing queue
+
+    if (smq_put(smq, url, body, 1) && smq->capture) {
+        capture_record(smq->capture, CAPTURE_PUBLISH, topic, body);
+    }
+}
+
+/**
+ * Publish several messages to topic in one request.
+ *
+ * The messages are sent framed like batched long-poll responses: each is
+ * terminated by a record separator, and the broker publishes them one by one,
+ * in order.  A message containing the separator itself is published on its
+ * own (still in order).  The batch is retried, deduplicated and dead-lettered
+ * as a whole.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   bodies  Messages to publish.
+ * @param   n       Number of messages.
+ **/
+void smq_publish_batch(SMQ *smq, const char *topic, const char * const *bodies, size_t n) {
+    char url[BUFSIZ];
+    sprintf(url, "%s/topic/%s?framing=%s", smq->server_url, topic, FRAME_HEADER_VALUE);
+
+    size_t start = 0;
+    while (start < n) {
+        // Gather the longest run of messages that can be framed
+        size_t end    = start;
+        size_t length = 0;
+        while (end < n && !strchr(bodies[end], FRAME_DELIMITER)) {
+            length += strlen(bodies[end]) + 1;
+            end++;
+        }
+        if (end - start < 2) {
+            smq_publish(smq, topic, bodies[start++]);
+            continue;
+        }
+
+        // Without memory for the framed body, publish the messages one by one
+        char *body = smq_malloc(length + 1);
+        if (!body) {
+            while (start < end) {
+                smq_publish(smq, topic, bodies[start++]);
+            }
+            continue;
+        }
+        char *cursor = body;
+        for (size_t i = start; i < end; i++) {
+            cursor    = stpcpy(cursor, bodies[i]);
+            *cursor++ = FRAME_DELIMITER;
+        }
+        *cursor = 0;
+
+        if (smq_put(smq, url, body, end - start) && smq->capture) {
+            for (size_t i = start; i < end; i++) {
+                capture_record(smq->capture, CAPTURE_PUBLISH, topic, bodies[i]);
+            }
+        }
+        smq_free(body);
+        start = end;
+    }
 }
 
 /**
@@ -106,40 +332,131 @@ void smq_publish(SMQ *smq, const char *topic, const char *body) {
  * Note: if the SMQ is not longer running, this will return NULL.
  *
  * @param   smq     Simple Request Queue structure.
- * @return  Newly allocated message body (must be freed).
+ * @return  Newly allocated message body (must be freed with smq_free).
  **/
 char * smq_retrieve(SMQ *smq) {
+    return smq_retrieve_timeout(smq, smq->timeout);
+}
+
+/**
+ * Retrieve one message, waiting at most timeout for one to arrive.
+ *
+ * With a timeout of 0 this never blocks; together with smq_fd it lets an
+ * event loop take every waiting message whenever the descriptor is readable.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   timeout Maximum time to wait (milliseconds).
+ * @return  Newly allocated message body (must be freed with smq_free, NULL
+ *          if none arrived in time).
+ **/
+char * smq_retrieve_timeout(SMQ *smq, time_t timeout) {
     // If the SMQ is not running, return NULL
-    if (!smq_running(smq)) {
+    if (!smq_running(smq) || !smq_start(smq, SMQ_PULLER)) {
         return NULL;
     }
 
     // Pop a request from the incoming queue
-    Request *r = queue_pop(smq->incoming, smq->timeout);
+    Request *r = queue_pop(smq->incoming, timeout);
     if (!r) {
+        int fd = atomic_load(&smq->notify_fd);
+        uint64_t count;
+
+        // Queue is empty: reset the descriptor, then re-arm it if a message
+        // slipped in before the flag was cleared
+        if (fd >= 0 && atomic_exchange(&smq->notified, false)) {
+            if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                error("Unable to reset notification of %s: %s", smq->name, strerror(errno));
+            }
+            if (queue_size(smq->incoming)) {
+                smq_notify(smq);
+            }
+        }
         return NULL;
     }
+    recorder_record(smq->recorder, RECORDER_RING_APP, RECORDER_DEQUEUE, 1, 0);
+    AllocPath path = alloc_path(ALLOC_PATH_RETRIEVE);
 
-    // Extract the message from the request
-    char *message = r->body; 
-    r->body = NULL;
+    if (r->trace) {
+        trace_stamp(r->trace, TRACE_RETRIEVE);
+        tracer_finish(smq->tracer, r->trace);
+        r->trace = NULL;
+    }
+
+    // Copy the message out of the request (which lives in the queue's arena)
+    char *message = r->body ? smq_strdup(r->body) : NULL;
     request_delete(r);
+    alloc_path(path);
+
+    stats_add(smq->stats, STATS_SHARD_APP, STATS_RECEIVED, 1);
+    stats_add(smq->stats, STATS_SHARD_APP, STATS_RECEIVED_BYTES, message ? strlen(message) : 0);
+
+    if (smq->capture) {
+        capture_record(smq->capture, CAPTURE_RETRIEVE, NULL, message);
+    }
     return message;
 }
 
+/**
+ * Return descriptor that is readable while messages wait to be retrieved or
+ * once the SMQ stops (for poll, select or epoll).
+ *
+ * After it becomes readable, call smq_retrieve_timeout with a timeout of 0
+ * until it returns NULL; that also resets the descriptor.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @return  File descriptor owned by the SMQ (-1 on failure).
+ **/
+int smq_fd(SMQ *smq) {
+    int fd = atomic_load(&smq->notify_fd);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        error("Unable to create notification of %s: %s", smq->name, strerror(errno));
+        return -1;
+    }
+
+    int none = -1;
+    if (!atomic_compare_exchange_strong(&smq->notify_fd, &none, fd)) {
+        close(fd);
+        return none;
+    }
+
+    // Report messages that arrived before the descriptor existed
+    if (!smq_running(smq) || (smq_start(smq, SMQ_PULLER) && queue_size(smq->incoming))) {
+        smq_notify(smq);
+    }
+    return fd;
+}
+
 /**
  * Subscribe to specified topic.
  * @param   smq     Simple Request Queue structure.
  * @param   topic   Topic string to subscribe to.
  **/
 void smq_subscribe(SMQ *smq, const char *topic) {
-    // body = smq_retrieve(smq); --> No Good
+    // Start pulling messages
+    if (!smq_start(smq, SMQ_PUSHER | SMQ_PULLER)) {
+        return;
+    }
+
     char url[BUFSIZ];
     sprintf(url, "%s/subscription/%s/%s", smq->server_url, smq->name, topic);
 
-    Request *r = request_create("PUT", url, NULL);
+    AllocPath path = alloc_path(ALLOC_PATH_PUBLISH);
+    Request  *r    = queue_request(smq->outgoing, "PUT", url, NULL);
     // Push the request to the outgoing queue
-    queue_push(smq->outgoing, r);
+    bool queued = smq_enqueue(smq, r);
+    alloc_path(path);
+    if (!queued) {
+        return;
+    }
+    recorder_record(smq->recorder, RECORDER_RING_APP, RECORDER_ENQUEUE, 0, 0);
+
+    if (smq->capture) {
+        capture_record(smq->capture, CAPTURE_SUBSCRIBE, topic, NULL);
+    }
     return;
     
 }
@@ -150,57 +467,816 @@ void smq_subscribe(SMQ *smq, const char *topic) {
  * @param   topic   Topic string to unsubscribe from.
  **/
 void smq_unsubscribe(SMQ *smq, const char *topic) {
+    if (!smq_start(smq, SMQ_PUSHER)) {
+        return;
+    }
+
     char url[BUFSIZ];
     sprintf(url, "%s/subscription/%s/%s", smq->server_url, smq->name, topic);
 
-    Request *r = request_create("DELETE", url, NULL);
+    AllocPath path = alloc_path(ALLOC_PATH_PUBLISH);
+    Request  *r    = queue_request(smq->outgoing, "DELETE", url, NULL);
     // Push the request to the outgoing queue
-    queue_push(smq->outgoing, r);
+    bool queued = smq_enqueue(smq, r);
+    alloc_path(path);
+    if (!queued) {
+        return;
+    }
+    recorder_record(smq->recorder, RECORDER_RING_APP, RECORDER_ENQUEUE, 0, 0);
+
+    if (smq->capture) {
+        capture_record(smq->capture, CAPTURE_UNSUBSCRIBE, topic, NULL);
+    }
     return;
 }
 
 /**
  * Shutdown the Simple Request Queue by:
  *
- * 1. Shutting down the internal queues.
- * 2. Setting the internal running attribute.
+ * 1. Setting the internal state (waking up anyone waiting on it).
+ * 2. Shutting down the internal queues.
  * 3. Joining internal threads.
  *
+ * Calling this more than once has no further effect.
+ *
  * @param   smq      Simple Request Queue structure.
  */
 void smq_shutdown(SMQ *smq) {
     // If the SMQ is not running, return
-    if (!smq) {
+    if (!smq || !smq_transition(smq, SMQ_STOPPED)) {
         return;
     }
-    
-    // Shutdown the queues
-    queue_shutdown(smq->outgoing);
-    queue_shutdown(smq->incoming);
 
-    // Set the running attribute to false
-    smq->running = false;
+    // Wake up event loops waiting on smq_fd
+    atomic_store(&smq->notified, false);
+    smq_notify(smq);
+
+    // No thread can be started once stopped (see smq_start)
+    int started = atomic_load(&smq->started);
+
+    // Shutdown the queues and join the threads
+    if (started & SMQ_PUSHER) {
+        queue_shutdown(smq->outgoing);
+        thread_join(smq->pusher, NULL);
+    }
+    if (started & SMQ_PULLER) {
+        queue_shutdown(smq->incoming);
+        connection_interrupt(smq->pull_connection);
+        thread_join(smq->puller, NULL);
+    }
 
-    // Join the threads
-    thread_join(smq->pusher, NULL);
-    thread_join(smq->puller, NULL);
+    if (smq->exporter_fd >= 0) {
+        shutdown(smq->exporter_fd, SHUT_RDWR);  // Wake exporter out of poll
+        thread_join(smq->exporter, NULL);
+        close(smq->exporter_fd);
+        unlink(smq->exporter_path);
+        smq_free(smq->exporter_path);
+        smq->exporter_fd = -1;
+    }
 
     return;
 }
 
 /**
- * Returns whether or not the Simple Request Queue is running.
+ * Drain and then shutdown the Simple Request Queue:
+ *
+ * 1. Stop accepting publishes.
+ * 2. Keep pushing outstanding publishes and subscription changes until they
+ *    are all delivered or the deadline passes.
+ * 3. Shutdown (see smq_shutdown).
+ *
+ * @param   smq      Simple Request Queue structure.
+ * @param   deadline Maximum time to spend draining (milliseconds).
+ * @return  Number of outgoing requests that were not delivered.
+ */
+size_t smq_shutdown_drain(SMQ *smq, time_t deadline) {
+    if (!smq) {
+        return 0;
+    }
+
+    if (smq_transition(smq, SMQ_DRAINING)) {
+        struct timespec ts;
+        compute_stoptime(ts, deadline);
+
+        mutex_lock(&smq->lock);
+        // Stop at the deadline, and on any other error rather than spin
+        while (atomic_load(&smq->pending) > 0) {
+            if (pthread_cond_timedwait(&smq->cond, &smq->lock, &ts) != 0) {
+                break;
+            }
+        }
+        mutex_unlock(&smq->lock);
+    }
+
+    smq_shutdown(smq);
+
+    // Threads are joined: whatever is still pending was not delivered
+    size_t undelivered = atomic_load(&smq->pending);
+    if (undelivered) {
+        info("Drain of %s left %zu requests undelivered", smq->name, undelivered);
+    }
+    return undelivered;
+}
+
+/**
+ * Returns whether or not the Simple Request Queue is running (or draining).
+ *
+ * This is a single relaxed load, so it is cheap enough for every loop
+ * iteration of the internal and consumer threads.
+ *
  * @param   smq     Simple Request Queue structure.
  **/
 bool smq_running(SMQ *smq) {
-    mutex_lock(&(smq->lock));
-    bool status = smq->running;
-    mutex_unlock(&(smq->lock));
-    return status;
+    int state = atomic_load_explicit(&smq->state, memory_order_relaxed);
+    return state == SMQ_RUNNING || state == SMQ_DRAINING;
+}
+
+/**
+ * Returns current lifecycle state of the Simple Request Queue.
+ * @param   smq     Simple Request Queue structure.
+ **/
+SMQState smq_state(SMQ *smq) {
+    return atomic_load_explicit(&smq->state, memory_order_relaxed);
+}
+
+/**
+ * Wait until the Simple Request Queue reaches (or passes) the given state.
+ * @param   smq     Simple Request Queue structure.
+ * @param   state   State to wait for (states only move forward, so waiting
+ *                  for SMQ_STOPPED also returns once SMQ_FAILED).
+ * @param   timeout Maximum time to wait (milliseconds, negative = forever).
+ * @return  Whether or not the state was reached.
+ **/
+bool smq_wait(SMQ *smq, SMQState state, time_t timeout) {
+    struct timespec ts;
+    if (timeout >= 0) {
+        compute_stoptime(ts, timeout);
+    }
+
+    mutex_lock(&smq->lock);
+    while (smq_state(smq) < state) {
+        if (timeout < 0) {
+            cond_wait(&smq->cond, &smq->lock);
+        } else if (pthread_cond_timedwait(&smq->cond, &smq->lock, &ts) != 0) {
+            break;
+        }
+    }
+    bool reached = smq_state(smq) >= state;
+    mutex_unlock(&smq->lock);
+    return reached;
+}
+
+/**
+ * Wait until the Simple Request Queue is ready: the pusher and puller have
+ * each connected to the server and the initial subscriptions (see
+ * SMQOptions.topics) are confirmed.  Starts the threads if they are lazy.
+ * @param   smq     Simple Request Queue structure.
+ * @param   timeout Maximum time to wait (milliseconds, negative = forever).
+ * @return  Whether or not the SMQ is ready.
+ **/
+bool smq_ready(SMQ *smq, time_t timeout) {
+    if (!smq_start(smq, SMQ_PUSHER | SMQ_PULLER)) {
+        return false;
+    }
+    return smq_wait_ready(smq, SMQ_PUSHER | SMQ_PULLER, timeout);
+}
+
+/**
+ * Wait until fewer than limit outgoing requests are queued or in flight (for
+ * producers that bound how far they run ahead of the pusher).
+ * @param   smq     Simple Request Queue structure.
+ * @param   limit   Number of pending requests to wait to drop below.
+ * @param   timeout Maximum time to wait (milliseconds, negative = forever).
+ * @return  Whether or not pending requests dropped below limit (false if
+ *          timed out or the SMQ stopped running).
+ **/
+bool smq_wait_pending(SMQ *smq, size_t limit, time_t timeout) {
+    if (atomic_load(&smq->pending) < limit) {
+        return true;
+    }
+
+    struct timespec ts;
+    if (timeout >= 0) {
+        compute_stoptime(ts, timeout);
+    }
+
+    // Registered before checking, so smq_delivered cannot miss the waiter
+    mutex_lock(&smq->lock);
+    atomic_fetch_add(&smq->pending_waiters, 1);
+    while (atomic_load(&smq->pending) >= limit && smq_running(smq)) {
+        if (timeout < 0) {
+            cond_wait(&smq->cond, &smq->lock);
+        } else if (pthread_cond_timedwait(&smq->cond, &smq->lock, &ts) != 0) {
+            break;
+        }
+    }
+    atomic_fetch_sub(&smq->pending_waiters, 1);
+    bool below = atomic_load(&smq->pending) < limit;
+    mutex_unlock(&smq->lock);
+    return below;
+}
+
+/**
+ * Record publishes, retrieves and subscription changes to a capture file
+ * (see smq-replay).  Recording continues until the SMQ is deleted.
+ *
+ * Note: this should be called before the SMQ is shared with other threads.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   path    Path to capture file.
+ * @return  Whether or not recording was started.
+ **/
+bool smq_record(SMQ *smq, const char *path) {
+    if (smq->capture) {
+        return false;
+    }
+
+    smq->capture = capture_create(path);
+    return smq->capture != NULL;
+}
+
+/**
+ * Dump flight recorder of recent events.
+ * @param   smq     Simple Request Queue structure.
+ * @param   stream  Stream to write to.
+ **/
+void smq_dump(SMQ *smq, FILE *stream) {
+    fprintf(stream, "SMQ %s (%s)\n", smq->name, smq->server_url);
+    recorder_dump(smq->recorder, stream);
+}
+
+static void smq_dump_handler(int signum) {
+    atomic_fetch_add(&DumpRequests, 1);
+}
+
+/**
+ * Dump the flight recorder of every SMQ to stderr when signum is received.
+ *
+ * The signal handler only flags the request; the pusher or puller thread of
+ * each SMQ performs the dump on its next loop iteration.  A lazy SMQ (see
+ * SMQOptions.lazy) dumps nothing until its first publish or subscribe starts
+ * one of them.  The statistics exporter (smq_stats_serve) has its own thread
+ * and serves a lazy SMQ from the start.
+ *
+ * @param   signum  Signal number (e.g. SIGUSR1).
+ **/
+void smq_dump_on_signal(int signum) {
+    struct sigaction action = {.sa_handler = smq_dump_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, NULL);
+}
+
+/**
+ * Trace a sample of published and received messages through each stage of
+ * the client (publish, outgoing queue, request, long-poll, incoming queue,
+ * retrieve).
+ *
+ * Note: this should be called before the SMQ is shared with other threads.
+ *
+ * @param   smq         Simple Request Queue structure.
+ * @param   period      Trace one in every period messages (1 = all).
+ * @param   path        Path of Chrome trace-event JSON file (NULL for none).
+ * @param   callback    Function called with each finished trace (NULL for none).
+ * @param   user        User data passed to callback.
+ * @return  Whether or not tracing was started.
+ **/
+bool smq_trace(SMQ *smq, unsigned period, const char *path, TraceCallback callback, void *user) {
+    if (smq->tracer) {
+        return false;
+    }
+
+    smq->tracer = tracer_create(period, path, callback, user);
+    return smq->tracer != NULL;
+}
+
+/**
+ * Collect statistics snapshot (counters are aggregated only on read).
+ * @param   smq     Simple Request Queue structure.
+ * @param   out     Snapshot to fill in.
+ **/
+void smq_stats(SMQ *smq, SMQStats *out) {
+    stats_collect(smq->stats, out);
+    out->outgoing  = smq_depth(smq, SMQ_PUSHER);
+    out->incoming  = smq_depth(smq, SMQ_PULLER);
+    out->srtt      = atomic_load_explicit(&smq->rtt.srtt, memory_order_relaxed);
+    out->rto       = atomic_load_explicit(&smq->rtt.rto, memory_order_relaxed);
+    out->poll_wait = (uint64_t)atomic_load_explicit(&smq->poll_wait, memory_order_relaxed) * 1000000;
+}
+
+/**
+ * Write statistics in Prometheus text format to file (replaced atomically).
+ * @param   smq     Simple Request Queue structure.
+ * @param   path    Path of file to write.
+ * @return  Whether or not the file was written.
+ **/
+bool smq_stats_write(SMQ *smq, const char *path) {
+    char temporary[BUFSIZ];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    FILE *fs = fopen(temporary, "w");
+    if (!fs) {
+        error("Unable to open %s: %s", temporary, strerror(errno));
+        return false;
+    }
+
+    SMQStats stats;
+    smq_stats(smq, &stats);
+    stats_format(&stats, smq->name, fs);
+
+    if (fclose(fs) != 0 || rename(temporary, path) < 0) {
+        error("Unable to write %s: %s", path, strerror(errno));
+        unlink(temporary);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Serve statistics in Prometheus text format on a Unix socket, e.g.:
+ *
+ *      curl --unix-socket /run/smq.sock http://localhost/metrics
+ *
+ * The exporter thread stops when the SMQ is shutdown.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   path    Path of Unix socket to create.
+ * @return  Whether or not the exporter was started.
+ **/
+bool smq_stats_serve(SMQ *smq, const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (smq->exporter_fd >= 0 || strlen(path) >= sizeof(address.sun_path)) {
+        return false;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        error("Unable to serve statistics on %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    smq->exporter_fd   = fd;
+    smq->exporter_path = smq_strdup(path);
+    pthread_attr_t attr;
+    smq_thread_attr(smq, &attr);
+    thread_create(&smq->exporter, &attr, smq_exporter, smq);
+    pthread_attr_destroy(&attr);
+    return true;
 }
 
 /* Internal Functions */
 
+/**
+ * Move to a later lifecycle state and wake up anyone waiting on the state.
+ * @return  Whether or not the transition happened (states only move forward).
+ **/
+static bool smq_transition(SMQ *smq, SMQState state) {
+    mutex_lock(&smq->lock);
+    bool forward = smq_state(smq) < state;
+    if (forward) {
+        atomic_store(&smq->state, state);
+        cond_broadcast(&smq->cond);
+    }
+    mutex_unlock(&smq->lock);
+    return forward;
+}
+
+/**
+ * Initialize attributes for library threads (stack size from options).
+ **/
+static void smq_thread_attr(SMQ *smq, pthread_attr_t *attr) {
+    pthread_attr_init(attr);
+    if (smq->options.stack_size) {
+        size_t size = smq->options.stack_size < (size_t)PTHREAD_STACK_MIN ? (size_t)PTHREAD_STACK_MIN : smq->options.stack_size;
+        pthread_attr_setstacksize(attr, size);
+    }
+}
+
+/**
+ * Create queue and start thread for the given directions (SMQ_PUSHER,
+ * SMQ_PULLER) unless already started.
+ *
+ * In lazy mode this is deferred until the first publish, retrieve or
+ * subscription, so an idle SMQ costs no threads and no queues.  If a queue or
+ * thread cannot be created, the SMQ is shut down as SMQ_FAILED (application
+ * threads only call this, so joining the library threads is safe).
+ *
+ * @return  Whether or not all requested directions are running.
+ **/
+static bool smq_start(SMQ *smq, int which) {
+    if ((atomic_load_explicit(&smq->started, memory_order_acquire) & which) == which) {
+        return true;
+    }
+
+    mutex_lock(&smq->lock);
+    int  started = atomic_load_explicit(&smq->started, memory_order_relaxed);
+    bool running = smq_running(smq);
+
+    pthread_attr_t attr;
+    smq_thread_attr(smq, &attr);
+
+    if (running && (which & SMQ_PUSHER) && !(started & SMQ_PUSHER)) {
+        smq->push_connection = connection_create(&smq->transport);
+        if (smq->options.hedge) {
+            smq->hedge = hedge_create(&smq->transport, smq->options.hedge_percentile, smq->options.hedge_budget);
+        }
+        if ((smq->outgoing = queue_create_arena(smq->options.segment_size, smq->options.huge_pages)) && smq->push_connection &&
+            (smq->hedge || !smq->options.hedge) && pthread_create(&smq->pusher, &attr, smq_pusher, smq) == 0) {
+            started |= SMQ_PUSHER;
+        } else {
+            fprintf(stderr, "Failure in outgoing queue creation\n");
+            queue_delete(smq->outgoing);
+            connection_delete(smq->push_connection);
+            hedge_delete(smq->hedge);
+            smq->outgoing        = NULL;
+            smq->push_connection = NULL;
+            smq->hedge           = NULL;
+        }
+    }
+    if (running && (which & SMQ_PULLER) && !(started & SMQ_PULLER)) {
+        smq->pull_connection = connection_create(&smq->transport);
+        if (smq->pull_connection) {
+            connection_cancel_on(smq->pull_connection, smq_stopped, smq);
+        }
+        if ((smq->incoming = queue_create_arena(smq->options.segment_size, smq->options.huge_pages)) && smq->pull_connection &&
+            pthread_create(&smq->puller, &attr, smq_puller, smq) == 0) {
+            started |= SMQ_PULLER;
+        } else {
+            fprintf(stderr, "Failure in incoming queue creation\n");
+            queue_delete(smq->incoming);
+            connection_delete(smq->pull_connection);
+            smq->incoming        = NULL;
+            smq->pull_connection = NULL;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    atomic_store_explicit(&smq->started, started, memory_order_release);
+    mutex_unlock(&smq->lock);
+
+    if (running && (started & which) != which) {
+        smq_fail(smq);
+    }
+    return (started & which) == which;
+}
+
+/**
+ * Shut down an SMQ that cannot recover and mark it SMQ_FAILED (waking up
+ * anyone in smq_wait).
+ **/
+static void smq_fail(SMQ *smq) {
+    smq_shutdown(smq);
+    smq_transition(smq, SMQ_FAILED);
+}
+
+/**
+ * Return depth of queue for direction (0 if not created yet).
+ **/
+static size_t smq_depth(SMQ *smq, int which) {
+    if (!(atomic_load_explicit(&smq->started, memory_order_acquire) & which)) {
+        return 0;
+    }
+    return queue_size(which == SMQ_PUSHER ? smq->outgoing : smq->incoming);
+}
+
+/**
+ * Copy NULL-terminated list of topics.
+ * @return  Newly allocated list (NULL if topics is NULL).
+ **/
+static char ** smq_copy_topics(const char * const *topics) {
+    if (!topics) {
+        return NULL;
+    }
+
+    size_t count = 0;
+    while (topics[count]) {
+        count++;
+    }
+
+    char **copy = smq_calloc(count + 1, sizeof(char *));
+    for (size_t t = 0; copy && t < count; t++) {
+        copy[t] = smq_strdup(topics[t]);
+    }
+    return copy;
+}
+
+/**
+ * Mark internal thread as connected (and, for the pusher, subscribed),
+ * recording the time to readiness once both are.
+ **/
+static void smq_mark_ready(SMQ *smq, int which) {
+    if (atomic_load_explicit(&smq->ready, memory_order_relaxed) & which) {
+        return;
+    }
+
+    mutex_lock(&smq->lock);
+    int ready = atomic_fetch_or(&smq->ready, which) | which;
+    if (ready == (SMQ_PUSHER | SMQ_PULLER)) {
+        atomic_store(&smq->stats->phases[STATS_PHASE_READY], monotonic_ns() - smq->created);
+    }
+    cond_broadcast(&smq->cond);
+    mutex_unlock(&smq->lock);
+}
+
+/**
+ * Wait until internal threads are ready (or the SMQ is stopped).
+ * @return  Whether or not the threads are ready.
+ **/
+static bool smq_wait_ready(SMQ *smq, int which, time_t timeout) {
+    struct timespec ts;
+    if (timeout >= 0) {
+        compute_stoptime(ts, timeout);
+    }
+
+    mutex_lock(&smq->lock);
+    while ((atomic_load(&smq->ready) & which) != which && smq_state(smq) < SMQ_STOPPED) {
+        if (timeout < 0) {
+            cond_wait(&smq->cond, &smq->lock);
+        } else if (pthread_cond_timedwait(&smq->cond, &smq->lock, &ts) != 0) {
+            break;
+        }
+    }
+    bool ready = (atomic_load(&smq->ready) & which) == which;
+    mutex_unlock(&smq->lock);
+    return ready;
+}
+
+/**
+ * Cancel predicate of the puller's connection: abort long-polls on shutdown.
+ **/
+static bool smq_stopped(void *arg) {
+    return smq_state((SMQ *)arg) >= SMQ_STOPPED;
+}
+
+/**
+ * Time allowed for sending the body of an outgoing request, on top of the
+ * RTT-based timeout: the estimate is learned mostly from small publishes, so
+ * a framed batch (up to hundreds of KiB) must not time out just for its size.
+ * @return  Allowance (milliseconds, SMQ_RTO_RATE bytes per millisecond).
+ **/
+static long smq_transfer_time(const Request *r) {
+    return r->body ? (long)(strlen(r->body) / SMQ_RTO_RATE) : 0;
+}
+
+/**
+ * Connect to server ahead of the first request.
+ * @param   c       Connection to warm.
+ * @param   hedge   Hedge whose connections are warmed instead (NULL = none).
+ * @param   record  Whether to record the timing of the startup phases.
+ * @return  Whether or not the server was reached.
+ **/
+static bool smq_connect(SMQ *smq, Connection *c, Hedge *hedge, bool record) {
+    char url[BUFSIZ];
+    snprintf(url, sizeof(url), "%s/", smq->server_url);
+
+    ConnectionTiming timing;
+    if (!(hedge ? hedge_warm(hedge, url, smq->timeout, &timing) : connection_warm(c, url, smq->timeout, &timing))) {
+        return false;
+    }
+
+    if (record) {
+        atomic_store(&smq->stats->phases[STATS_PHASE_RESOLVE], timing.resolve);
+        atomic_store(&smq->stats->phases[STATS_PHASE_CONNECT], timing.connect);
+        atomic_store(&smq->stats->phases[STATS_PHASE_TLS], timing.tls);
+    }
+    return true;
+}
+
+/**
+ * Subscribe to initial topics (see SMQOptions.topics), retrying each until it
+ * is confirmed or the SMQ stops.
+ * @return  Whether or not all subscriptions were confirmed.
+ **/
+static bool smq_subscribe_initial(SMQ *smq) {
+    uint64_t started = monotonic_ns();
+
+    for (size_t t = 0; smq->options.topics && smq->options.topics[t]; t++) {
+        char url[BUFSIZ];
+        snprintf(url, sizeof(url), "%s/subscription/%s/%s", smq->server_url, smq->name, smq->options.topics[t]);
+        Request r = {"PUT", url, NULL};
+
+        char *response;
+        while (!(response = request_perform(&r, rtt_timeout(&smq->rtt), smq->push_connection))) {
+            if (!smq_running(smq)) {
+                return false;
+            }
+            if (!r.status) {
+                rtt_backoff(&smq->rtt);
+            }
+            usleep(SMQ_RETRY_US);
+        }
+        smq_free(response);
+    }
+
+    atomic_store(&smq->stats->phases[STATS_PHASE_SUBSCRIBE], monotonic_ns() - started);
+    return true;
+}
+
+/**
+ * Queue PUT of body to url (one publish, or a framed batch of messages).
+ * @return  Whether the request was queued (otherwise it was dead-lettered).
+ **/
+static bool smq_put(SMQ *smq, const char *url, const char *body, size_t messages) {
+    // If the SMQ is not accepting publishes, dead-letter the message
+    if (smq_state(smq) != SMQ_RUNNING || !smq_start(smq, SMQ_PUSHER)) {
+        Request *r = request_create("PUT", url, body);
+        if (r) {
+            smq_dead_letter(smq, r, DEADLETTER_CLOSED, false);
+        }
+        return false;
+    }
+
+    AllocPath path  = alloc_path(ALLOC_PATH_PUBLISH);
+    Trace    *trace = tracer_sample(smq->tracer, false);
+    trace_stamp(trace, TRACE_PUBLISH);
+    Request *r = queue_request(smq->outgoing, "PUT", url, body); // Create the request
+    if (r) {
+        r->trace    = trace;
+        r->producer = smq->producer;
+        r->sequence = atomic_fetch_add_explicit(&smq->sequence, 1, memory_order_relaxed) + 1;
+    } else {
+        smq_free(trace);
+    }
+    trace_stamp(trace, TRACE_ENQUEUE);
+    bool queued = smq_enqueue(smq, r); // Push the request to the outgoing queue
+    alloc_path(path);
+    if (!queued) {
+        return false;
+    }
+    recorder_record(smq->recorder, RECORDER_RING_APP, RECORDER_ENQUEUE, 0, 0);
+    stats_add(smq->stats, STATS_SHARD_APP, STATS_PUBLISHED, messages);
+    stats_add(smq->stats, STATS_SHARD_APP, STATS_PUBLISHED_BYTES, body ? strlen(body) - (messages > 1 ? messages : 0) : 0);
+    return true;
+}
+
+/**
+ * Push request on outgoing queue, counting it as pending until delivered.
+ * @return  Whether or not the request was queued (it is deleted if not).
+ **/
+static bool smq_enqueue(SMQ *smq, Request *r) {
+    if (!r) {
+        return false;
+    }
+
+    atomic_fetch_add(&smq->pending, 1);
+    if (!queue_push(smq->outgoing, r)) {
+        atomic_fetch_sub(&smq->pending, 1);
+        smq_dead_letter(smq, r, DEADLETTER_CLOSED, false);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Signal notification descriptor (see smq_fd), unless already signaled since
+ * the incoming queue was last found empty.
+ **/
+static void smq_notify(SMQ *smq) {
+    int      fd  = atomic_load_explicit(&smq->notify_fd, memory_order_acquire);
+    uint64_t one = 1;
+
+    if (fd >= 0 && !atomic_exchange(&smq->notified, true) && write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        error("Unable to signal notification of %s: %s", smq->name, strerror(errno));
+    }
+}
+
+/**
+ * Give up on outgoing request: append it to the dead-letter file (or log it if
+ * there is none), then delete it.
+ *
+ * The caller's thread picks the recorder ring and stats shard: the pusher's
+ * are single-writer, so application threads (including smq_delete draining
+ * leftovers) must use the application ones.
+ **/
+static void smq_dead_letter(SMQ *smq, Request *r, DeadLetterReason reason, bool pusher) {
+    if (!smq->dead_letters || !deadletter_write(smq->dead_letters, reason, r)) {
+        error("Dropping %s %s of %s (%s, status %ld, %u attempts)",
+            r->method, r->url, smq->name, deadletter_reason_name(reason), r->status, r->attempts);
+    }
+    recorder_record(smq->recorder, pusher ? RECORDER_RING_PUSHER : RECORDER_RING_APP, RECORDER_DEAD_LETTER, reason, r->status);
+    stats_add(smq->stats, pusher ? STATS_SHARD_PUSHER : STATS_SHARD_APP, STATS_DEAD_LETTERS, 1);
+
+    if (r->trace) {
+        tracer_finish(smq->tracer, r->trace);
+        r->trace = NULL;
+    }
+    request_delete(r);
+}
+
+/**
+ * Count one outgoing request as delivered, waking up a drain waiting for the
+ * last one (or any smq_wait_pending).
+ **/
+static void smq_delivered(SMQ *smq) {
+    bool last = atomic_fetch_sub(&smq->pending, 1) == 1;
+    if ((last && smq_state(smq) == SMQ_DRAINING) || atomic_load(&smq->pending_waiters)) {
+        mutex_lock(&smq->lock);
+        cond_broadcast(&smq->cond);
+        mutex_unlock(&smq->lock);
+    }
+}
+
+/**
+ * Parse CPU list (e.g. "0,2-3") into CPU set.
+ * @return  Whether or not the list was valid and non-empty.
+ **/
+static bool smq_parse_cpus(const char *cpus, cpu_set_t *set) {
+    CPU_ZERO(set);
+
+    for (const char *s = cpus; *s; ) {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last  = first;
+        if (end == s || first < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            s    = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        s = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') {
+            return false;
+        }
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Apply thread options to the calling library thread: name, cgroup, CPU
+ * affinity, scheduling policy and nice value.  The log writer is shared by
+ * all SMQs and is left out (see log.c).
+ *
+ * Failures (e.g. missing CAP_SYS_NICE for SCHED_FIFO) are logged and the
+ * thread continues with whatever it inherited.
+ **/
+static void smq_thread_setup(SMQ *smq, const char *name) {
+    SMQThreadOptions *options = &smq->options.threads;
+    pid_t tid = syscall(SYS_gettid);
+    int   status;
+
+    pthread_setname_np(pthread_self(), name);
+
+    if (options->cgroup) {
+        char path[BUFSIZ];
+        snprintf(path, sizeof(path), "%s/cgroup.threads", options->cgroup);
+        FILE *fs = fopen(path, "w");
+        bool moved = fs && fprintf(fs, "%d\n", tid) > 0;
+        if (fs && fclose(fs) != 0) {
+            moved = false;
+        }
+        if (!moved) {
+            error("Unable to move %s into %s: %s", name, options->cgroup, strerror(errno));
+        }
+    }
+
+    if (options->cpus) {
+        cpu_set_t set;
+        if (!smq_parse_cpus(options->cpus, &set)) {
+            error("Invalid CPU list for %s: %s", name, options->cpus);
+        } else if ((status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+            error("Unable to set CPU affinity of %s: %s", name, strerror(status));
+        }
+    }
+
+    if (options->policy >= 0) {
+        struct sched_param param = {.sched_priority = options->priority};
+        if ((status = pthread_setschedparam(pthread_self(), options->policy, &param)) != 0) {
+            error("Unable to set scheduling policy of %s: %s", name, strerror(status));
+        }
+    }
+
+    if (options->nice && setpriority(PRIO_PROCESS, tid, options->nice) < 0) {
+        error("Unable to set nice value of %s: %s", name, strerror(errno));
+    }
+}
+
+/**
+ * Dump flight recorder if a dump was requested by signal since the last one.
+ **/
+static void smq_check_dump(SMQ *smq) {
+    unsigned requested = atomic_load_explicit(&DumpRequests, memory_order_relaxed);
+    unsigned dumped    = atomic_load_explicit(&smq->dumped, memory_order_relaxed);
+
+    if (requested != dumped && atomic_compare_exchange_strong(&smq->dumped, &dumped, requested)) {
+        smq_dump(smq, stderr);
+    }
+}
+
 /**
  * Pusher thread takes messages from outgoing queue and sends them to server.
  **/
@@ -210,50 +1286,262 @@ void * smq_pusher(void *arg) {
     if (!smq) {
         return NULL;
     }
+    uint64_t sampled = 0;
+    smq_thread_setup(smq, "smq-push");
+    alloc_path(ALLOC_PATH_PUSH);
+    smq_wait(smq, SMQ_RUNNING, -1);
+
+    // Connect and subscribe before taking the first request (if the server
+    // cannot be reached yet, the first successful request marks readiness)
+    // With hedging, publishes only use the hedge's connections
+    bool connected = smq_connect(smq, smq->push_connection, smq->hedge, true);
+    if (smq_subscribe_initial(smq) && (connected || smq->options.topics)) {
+        smq_mark_ready(smq, SMQ_PUSHER);
+    }
+
     // While the SMQ is running
     while (smq_running(smq)) {
+        smq_check_dump(smq);
+        stats_cpu(smq->stats, STATS_SHARD_PUSHER);
+
+        uint64_t now = monotonic_ns();
+        if (now - sampled > SMQ_SAMPLE_NS) {
+            recorder_record(smq->recorder, RECORDER_RING_PUSHER, RECORDER_DEPTH, smq_depth(smq, SMQ_PUSHER), smq_depth(smq, SMQ_PULLER));
+            sampled = now;
+        }
+
         // Pop a request from the outgoing queue
         Request *r = queue_pop(smq->outgoing, smq->timeout);
         if (!r) {
             continue;
         }
+        recorder_record(smq->recorder, RECORDER_RING_PUSHER, RECORDER_DEQUEUE, 0, 0);
+        trace_stamp(r->trace, TRACE_DEQUEUE);
+
         // Perform the request
-        char *response = request_perform(r, smq->timeout);
+        recorder_record(smq->recorder, RECORDER_RING_PUSHER, RECORDER_REQUEST_START, r->method[0], 0);
+        r->attempts++;
+        if (r->trace) {
+            r->trace->attempts++;
+        }
+        trace_stamp(r->trace, TRACE_SEND);
+        stats_add(smq->stats, STATS_SHARD_PUSHER, STATS_REQUESTS, 1);
+        HedgeOutcome hedged = HEDGE_NONE;
+        long     transfer = smq_transfer_time(r);
+        long     timeout  = rtt_timeout(&smq->rtt) + transfer;
+        uint64_t started  = monotonic_ns();
+        char    *response = smq->hedge ?
+            request_hedge(r, timeout, smq->hedge, &hedged) :
+            request_perform(r, timeout, smq->push_connection);
+        uint64_t duration = monotonic_ns() - started;
+        recorder_record(smq->recorder, RECORDER_RING_PUSHER, RECORDER_REQUEST_END, response != NULL, duration);
+        stats_add(smq->stats, STATS_SHARD_PUSHER, STATS_COMPLETED, 1);
+        stats_observe(smq->stats, STATS_SHARD_PUSHER, STATS_LATENCY_PUSH, duration);
+
+        // Back off only when the server did not answer; time only requests
+        // answered on their first attempt (a retry's or hedge's answer may
+        // be to another attempt), without the allowance for their size
+        if (!response && !r->status) {
+            rtt_backoff(&smq->rtt);
+        } else if (response && r->attempts == 1 && hedged == HEDGE_NONE) {
+            uint64_t allowance = (uint64_t)transfer * 1000000;
+            rtt_observe(&smq->rtt, duration > allowance ? duration - allowance : 0);
+        }
+        if (smq->hedge && response) {
+            hedge_observe(smq->hedge, duration);
+        }
+        if (hedged != HEDGE_NONE) {
+            stats_add(smq->stats, STATS_SHARD_PUSHER, STATS_HEDGES, 1);
+            stats_add(smq->stats, STATS_SHARD_PUSHER, STATS_HEDGE_WINS, hedged == HEDGE_WON);
+        }
+
+        // Give up on requests the broker refused or that failed too often;
+        // retry the rest
+        DeadLetterReason reason = 0;
+        if (!response && r->status >= 400 && r->status < 500 && r->status != 408 && r->status != 429) {
+            reason = DEADLETTER_REJECTED;
+        } else if (!response && smq->options.max_attempts && r->attempts >= smq->options.max_attempts) {
+            reason = DEADLETTER_EXHAUSTED;
+        }
+
         if (!response) {
-            queue_push(smq->outgoing, r);
+            stats_add(smq->stats, STATS_SHARD_PUSHER, STATS_FAILURES, 1);
+            if (reason) {
+                smq_dead_letter(smq, r, reason, true);
+                smq_delivered(smq);
+            } else if (!queue_push(smq->outgoing, r)) {
+                smq_dead_letter(smq, r, DEADLETTER_SHUTDOWN, true);
+            } else {
+                recorder_record(smq->recorder, RECORDER_RING_PUSHER, RECORDER_RETRY, 0, 0);
+                stats_add(smq->stats, STATS_SHARD_PUSHER, STATS_RETRIES, 1);
+            }
         } else {
+            if (r->trace) {
+                trace_stamp(r->trace, TRACE_ACK);
+                tracer_finish(smq->tracer, r->trace);
+                r->trace = NULL;
+            }
             request_delete(r);
-            free(response);
+            smq_free(response);
+            smq_delivered(smq);
+            smq_mark_ready(smq, SMQ_PUSHER);
         }
     }
+
+    stats_cpu(smq->stats, STATS_SHARD_PUSHER);
     return NULL;
 }
 
+/**
+ * Deliver one message of a long-poll response to the incoming queue (frame
+ * callback of the puller).
+ **/
+static void smq_deliver(const char *data, size_t length, void *user) {
+    SMQPoll *longpoll = (SMQPoll *)user;
+    SMQ     *smq      = longpoll->smq;
+    Request *message  = queue_message(smq->incoming, data, length);
+    if (!message) {
+        return;
+    }
+
+    // A message whose publish was traced is always traced, under its id
+    uint64_t id = longpoll->parser->trace;
+    longpoll->parser->trace = 0;
+    if ((message->trace = id ? tracer_continue(smq->tracer, id) : tracer_sample(smq->tracer, true))) {
+        message->trace->stamps[TRACE_POLL] = longpoll->started;
+        trace_stamp(message->trace, TRACE_RESPONSE);
+        trace_stamp(message->trace, TRACE_DELIVER);
+    }
+    if (!queue_push(smq->incoming, message)) {
+        request_delete(message);
+    }
+    recorder_record(smq->recorder, RECORDER_RING_PULLER, RECORDER_ENQUEUE, 1, 0);
+    smq_notify(smq);
+}
+
 /**
  * Puller thread requests new messages from server and then puts them in
  * incoming queue.
+ *
+ * Each long-poll asks for up to options.batch messages; a batched response
+ * is split into messages as it arrives (see frame.c).  The server holds a
+ * long-poll for the requested wait and then answers with no messages, so its
+ * timeout only needs to cover that wait plus a round trip.
+ *
+ * The wait starts at options.poll_wait and doubles after each empty answer up
+ * to options.poll_wait_max, so idle queues cost the broker only an occasional
+ * request; any message (or failure) brings it back down.
  **/
 void * smq_puller(void *arg) {
     // Cast the argument to a SMQ
     SMQ *smq = (SMQ *)arg;
     char url[BUFSIZ];
-    sprintf(url, "%s/queue/%s", smq->server_url, smq->name);
     Request r = {"GET", url, NULL};
-    
+    smq_thread_setup(smq, "smq-pull");
+    alloc_path(ALLOC_PATH_PULL);
+
+    FrameParser parser;
+    SMQPoll     longpoll = {.smq = smq, .parser = &parser};
+    frame_init(&parser, smq_deliver, &longpoll);
+    smq_wait(smq, SMQ_RUNNING, -1);
+
+    // Connect, then wait for initial subscriptions so the first poll finds the queue
+    bool connected = smq_connect(smq, smq->pull_connection, NULL, false);
+    if (smq->options.topics) {
+        smq_wait_ready(smq, SMQ_PUSHER, -1);
+    }
+    if (connected) {
+        smq_mark_ready(smq, SMQ_PULLER);
+    }
+
     // While the SMQ is running
     while (smq_running(smq)) {
-        // Perform the request
-        char *response = request_perform(&r, smq->timeout);
-        if (!response) {
-            continue;
+        smq_check_dump(smq);
+        stats_cpu(smq->stats, STATS_SHARD_PULLER);
+
+        long wait   = atomic_load_explicit(&smq->poll_wait, memory_order_relaxed);
+        int  length = snprintf(url, sizeof(url), "%s/queue/%s?wait=%ld", smq->server_url, smq->name, wait);
+        if (smq->options.batch > 1) {
+            snprintf(url + length, sizeof(url) - length, "&batch=%zu", smq->options.batch);
+        }
+
+        // Perform the request (messages are delivered as they are parsed)
+        recorder_record(smq->recorder, RECORDER_RING_PULLER, RECORDER_REQUEST_START, 'G', 0);
+        stats_add(smq->stats, STATS_SHARD_PULLER, STATS_REQUESTS, 1);
+        longpoll.started  = monotonic_ns();
+        bool     success  = request_stream(&r, wait + rtt_timeout(&smq->rtt), &parser, smq->pull_connection);
+        uint64_t duration = monotonic_ns() - longpoll.started;
+        recorder_record(smq->recorder, RECORDER_RING_PULLER, RECORDER_REQUEST_END, success, duration);
+        stats_add(smq->stats, STATS_SHARD_PULLER, STATS_COMPLETED, 1);
+        stats_observe(smq->stats, STATS_SHARD_PULLER, STATS_LATENCY_PULL, duration);
+        if (!success) {
+            stats_add(smq->stats, STATS_SHARD_PULLER, STATS_FAILURES, 1);
+        } else {
+            smq_mark_ready(smq, SMQ_PULLER);
+        }
+
+        if (success && !parser.frames) {
+            wait = min(2 * wait, (long)smq->options.poll_wait_max);
+        } else {
+            wait = smq->options.poll_wait;
         }
-        Request *message = request_create(NULL, NULL, response);
-        queue_push(smq->incoming, message);
-        free(response);
+        atomic_store_explicit(&smq->poll_wait, wait, memory_order_relaxed);
     }
 
+    frame_free(&parser);
+    stats_cpu(smq->stats, STATS_SHARD_PULLER);
     return NULL;
     
 }
 
+/**
+ * Exporter thread answers each connection on the statistics socket with the
+ * current statistics (as a minimal HTTP response) and closes it.
+ **/
+void * smq_exporter(void *arg) {
+    SMQ *smq = (SMQ *)arg;
+    smq_thread_setup(smq, "smq-stats");
+
+    while (smq_running(smq)) {
+        struct pollfd pfd = {.fd = smq->exporter_fd, .events = POLLIN};
+        if (poll(&pfd, 1, smq->timeout) <= 0) {
+            continue;
+        }
+
+        int client = accept(smq->exporter_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        // Discard request (if any) without waiting for it
+        char request[BUFSIZ];
+        struct pollfd cfd = {.fd = client, .events = POLLIN};
+        if (poll(&cfd, 1, 100) > 0) {
+            if (read(client, request, sizeof(request)) < 0) {
+                debug("Unable to read exporter request: %s", strerror(errno));
+            }
+        }
+
+        char  *body = NULL;
+        size_t size = 0;
+        FILE  *fs   = open_memstream(&body, &size);
+        SMQStats stats;
+        smq_stats(smq, &stats);
+        stats_format(&stats, smq->name, fs);
+        fclose(fs);
+
+        char header[BUFSIZ];
+        int  length = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+        if (send(client, header, length, MSG_NOSIGNAL) < 0 || send(client, body, size, MSG_NOSIGNAL) < 0) {
+            debug("Unable to write exporter response: %s", strerror(errno));
+        }
+
+        free(body);
+        close(client);
+    }
+
+    return NULL;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,339 @@
+/* connection.c: Persistent HTTP connection (reused curl handle)
+ *
+ * Reusing one easy handle per thread keeps its connection open (HTTP/1.1
+ * keep-alive) and its DNS cache warm, so only the first request pays for
+ * name lookup and connection setup.  connection_warm pays that cost up front.
+ *
+ * Each connection also carries a transport profile: socket options (Nagle,
+ * buffer sizes, keepalive, busy-poll) and transfer limits tuned for a kind of
+ * link.  Profiles are applied whenever the handle is acquired, since
+ * curl_easy_reset forgets them.
+ **/
+
+#include "smq/connection.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* Internal Constants */
+
+static const struct {
+    const char         *name;
+    ConnectionProfile   profile;
+} ConnectionProfiles[] = {
+    // curl defaults: Nagle disabled, system buffers, no keepalive
+    {CONNECTION_DEFAULT, {
+        .nodelay = true,
+    }},
+    // Small messages on a local network: send immediately, fail fast, spin on receive
+    {"low-latency", {
+        .nodelay         = true,
+        .keepidle        = 30,
+        .keepintvl       = 10,
+        .connect_timeout = 1000,
+        .busy_poll       = 50,
+    }},
+    // Large or many messages: let Nagle coalesce writes and use large buffers
+    {"bulk", {
+        .nodelay         = false,
+        .sndbuf          = 4 * 1024 * 1024,
+        .rcvbuf          = 4 * 1024 * 1024,
+        .keepidle        = 60,
+        .keepintvl       = 20,
+        .connect_timeout = 5000,
+    }},
+    // High latency, lossy links: buffers for the bandwidth-delay product,
+    // keepalive to survive NAT timeouts and abort stalled transfers early
+    {"wan", {
+        .nodelay         = true,
+        .sndbuf          = 1024 * 1024,
+        .rcvbuf          = 1024 * 1024,
+        .keepidle        = 15,
+        .keepintvl       = 5,
+        .connect_timeout = 10000,
+        .low_speed_limit = 1024,
+        .low_speed_time  = 15,
+    }},
+    {NULL, {0}},
+};
+
+/* Internal Functions */
+
+static size_t connection_discard(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    return size * nmemb;
+}
+
+/**
+ * Set socket options that curl has no option for (called by curl before the
+ * socket is connected, so buffer sizes can still affect window scaling).
+ **/
+static int connection_sockopt(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+    const ConnectionProfile *p = clientp;
+
+    if (purpose != CURLSOCKTYPE_IPCXN) {
+        return CURL_SOCKOPT_OK;
+    }
+
+    if (p->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &p->sndbuf, sizeof(p->sndbuf)) < 0) {
+        debug("Unable to set SO_SNDBUF: %s", strerror(errno));
+    }
+    if (p->rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &p->rcvbuf, sizeof(p->rcvbuf)) < 0) {
+        debug("Unable to set SO_RCVBUF: %s", strerror(errno));
+    }
+#ifdef SO_BUSY_POLL
+    // Raising busy-poll above net.core.busy_read needs CAP_NET_ADMIN
+    if (p->busy_poll && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &p->busy_poll, sizeof(p->busy_poll)) < 0) {
+        debug("Unable to set SO_BUSY_POLL: %s", strerror(errno));
+    }
+#endif
+    return CURL_SOCKOPT_OK;
+}
+
+/**
+ * Progress function: abort transfer once the cancel predicate holds (curl
+ * calls this about once a second even while no data arrives).
+ **/
+static int connection_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    Connection *c = clientp;
+    return c->cancel(c->cancel_user) ? 1 : 0;
+}
+
+/**
+ * Open socket of cancelable connection, remembering it for
+ * connection_interrupt.
+ **/
+static curl_socket_t connection_open(void *clientp, curlsocktype purpose, struct curl_sockaddr *address) {
+    Connection   *c  = clientp;
+    curl_socket_t fd = socket(address->family, address->socktype | SOCK_CLOEXEC, address->protocol);
+
+    if (fd != CURL_SOCKET_BAD && purpose == CURLSOCKTYPE_IPCXN) {
+        mutex_lock(&c->lock);
+        c->socket = fd;
+        mutex_unlock(&c->lock);
+    }
+    return fd;
+}
+
+/**
+ * Close socket of cancelable connection (under the lock, so an interrupt
+ * never reaches a descriptor number that was reused).
+ **/
+static int connection_close(void *clientp, curl_socket_t fd) {
+    Connection *c = clientp;
+
+    mutex_lock(&c->lock);
+    if (c->socket == fd) {
+        c->socket = CURL_SOCKET_BAD;
+    }
+    int status = close(fd);
+    mutex_unlock(&c->lock);
+    return status;
+}
+
+/**
+ * Apply transport profile to handle.
+ **/
+static void connection_tune(CURL *curl, const ConnectionProfile *p) {
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, p->nodelay ? 1L : 0L);
+
+    if (p->keepidle) {
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, p->keepidle);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, p->keepintvl ? p->keepintvl : p->keepidle);
+    }
+    if (p->connect_timeout) {
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, p->connect_timeout);
+    }
+    if (p->low_speed_limit) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, p->low_speed_limit);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, p->low_speed_time);
+    }
+    if (p->sndbuf || p->rcvbuf || p->busy_poll) {
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, connection_sockopt);
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, (void *)p);
+    }
+}
+
+/* Functions */
+
+/**
+ * Look up transport profile by name.
+ * @param   name        Name of profile ("default", "low-latency", "bulk", "wan").
+ * @return  Profile (NULL if there is no such profile).
+ **/
+const ConnectionProfile * connection_profile(const char *name) {
+    for (size_t i = 0; ConnectionProfiles[i].name; i++) {
+        if (streq(ConnectionProfiles[i].name, name)) {
+            return &ConnectionProfiles[i].profile;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Enumerate transport profiles.
+ * @param   index       Index of profile.
+ * @return  Name of profile (NULL past the last one).
+ **/
+const char * connection_profile_name(size_t index) {
+    if (index >= sizeof(ConnectionProfiles) / sizeof(ConnectionProfiles[0])) {
+        return NULL;
+    }
+    return ConnectionProfiles[index].name;
+}
+
+/**
+ * Create connection (nothing is opened until the first request).
+ * @param   profile     Transport profile (copied, NULL = default).
+ * @return  Newly allocated Connection structure (NULL on failure).
+ **/
+Connection * connection_create(const ConnectionProfile *profile) {
+    Connection *c = smq_calloc(1, sizeof(Connection));
+    if (c && !(c->curl = curl_easy_init())) {
+        smq_free(c);
+        return NULL;
+    }
+    if (c) {
+        c->profile = profile ? *profile : *connection_profile(CONNECTION_DEFAULT);
+        c->socket  = CURL_SOCKET_BAD;
+        mutex_init(&c->lock, NULL);
+    }
+    return c;
+}
+
+/**
+ * Delete connection (closing it).
+ * @param   c           Connection structure.
+ **/
+void connection_delete(Connection *c) {
+    if (c) {
+        curl_easy_cleanup(c->curl);
+        smq_free(c);
+    }
+}
+
+/**
+ * Set predicate that aborts requests in progress on connection (for example
+ * long-polls that would otherwise outlive a shutdown).
+ * @param   c           Connection structure.
+ * @param   cancel      Predicate (NULL = never abort).
+ * @param   user        User data passed to predicate.
+ **/
+void connection_cancel_on(Connection *c, ConnectionCancel cancel, void *user) {
+    c->cancel      = cancel;
+    c->cancel_user = user;
+}
+
+/**
+ * Abort request in progress on cancelable connection right away (from any
+ * thread), instead of when curl next polls the cancel predicate.
+ * @param   c           Connection structure (may be NULL).
+ **/
+void connection_interrupt(Connection *c) {
+    if (!c || !c->cancel) {
+        return;
+    }
+
+    mutex_lock(&c->lock);
+    if (c->socket != CURL_SOCKET_BAD) {
+        shutdown(c->socket, SHUT_RDWR);
+    }
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Get handle for next request, with all options reset to the transport
+ * profile.
+ * @param   c           Connection structure (NULL = new one-shot handle).
+ * @return  curl easy handle (NULL on failure).
+ **/
+CURL * connection_acquire(Connection *c) {
+    if (!c) {
+        return curl_easy_init();
+    }
+
+    curl_easy_reset(c->curl);
+    connection_tune(c->curl, &c->profile);
+    if (c->cancel) {
+        curl_easy_setopt(c->curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(c->curl, CURLOPT_XFERINFOFUNCTION, connection_progress);
+        curl_easy_setopt(c->curl, CURLOPT_XFERINFODATA, c);
+        curl_easy_setopt(c->curl, CURLOPT_OPENSOCKETFUNCTION, connection_open);
+        curl_easy_setopt(c->curl, CURLOPT_OPENSOCKETDATA, c);
+        curl_easy_setopt(c->curl, CURLOPT_CLOSESOCKETFUNCTION, connection_close);
+        curl_easy_setopt(c->curl, CURLOPT_CLOSESOCKETDATA, c);
+    }
+    return c->curl;
+}
+
+/**
+ * Finish request performed with handle from connection_acquire.
+ * @param   c           Connection structure (NULL = clean up one-shot handle).
+ * @param   curl        curl easy handle.
+ **/
+void connection_release(Connection *c, CURL *curl) {
+    if (!c) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+
+    long connects = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+        c->connects += connects;
+    }
+    c->requests++;
+}
+
+/**
+ * Open connection to server ahead of the first request by performing a HEAD
+ * request (any HTTP response counts as success).
+ * @param   c           Connection structure.
+ * @param   url         URL of server.
+ * @param   timeout     Maximum time (milliseconds).
+ * @param   timing      Time spent in each phase (may be NULL).
+ * @return  Whether or not the server was reached.
+ **/
+bool connection_warm(Connection *c, const char *url, long timeout, ConnectionTiming *timing) {
+    CURL *curl = connection_acquire(c);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, connection_discard);
+
+    CURLcode status = curl_easy_perform(curl);
+    if (status != CURLE_OK) {
+        debug("Unable to connect to %s: %s", url, curl_easy_strerror(status));
+    }
+
+    if (timing) {
+        connection_timing(curl, timing);
+    }
+
+    connection_release(c, curl);
+    return status == CURLE_OK;
+}
+
+/**
+ * Time spent in each phase of the last transfer of a handle.
+ * @param   curl        Handle (see connection_acquire).
+ * @param   timing      Time spent in each phase.
+ **/
+void connection_timing(CURL *curl, ConnectionTiming *timing) {
+    curl_off_t resolve = 0, connect = 0, tls = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &resolve);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    // curl reports microseconds since the start of the request
+    timing->resolve = resolve * 1000;
+    timing->connect = connect > resolve ? (connect - resolve) * 1000 : 0;
+    timing->tls     = tls > connect ? (tls - connect) * 1000 : 0;
+    timing->total   = total * 1000;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
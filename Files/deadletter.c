@@ -0,0 +1,426 @@
+/* deadletter.c: Dead-letter file (undeliverable requests with reasons)
+ *
+ * Requests the pusher gives up on are appended here instead of being retried
+ * forever or dropped; smq-dlq lists them and re-injects them.  The file is
+ * only ever appended to and each record is flushed to disk before the request
+ * is released.  Records carry their length and a checksum, so a record torn
+ * by a crash is recognized: deadletter_create cuts it off before appending
+ * (so a crash loses at most the record being written) and readers count
+ * damaged records instead of taking them for the end of the file.  Records of
+ * a whole queue given up at once are synced together (see deadletter_defer).
+ *
+ * Publishes keep their producer and sequence tags, so a re-injected publish
+ * that the broker did receive after all is deduplicated there.
+ **/
+
+#include "smq/deadletter.h"
+#include "smq/alloc.h"
+#include "smq/capture.h"
+#include "smq/utils.h"
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/*
+ * File format:
+ *
+ *      magic   "SMQDLQ3\0"
+ *      record  length      (4 bytes, little-endian, bytes of payload)
+ *              checksum    (4 bytes, little-endian, FNV-1a of payload)
+ *              payload:
+ *              reason      (1 byte)
+ *              time        (varint, nanoseconds since epoch)
+ *              status      (varint)
+ *              attempts    (varint)
+ *              producer    (varint)
+ *              sequence    (varint, 0 if untagged)
+ *              method      (varint length + 1, 0 if NULL; followed by bytes)
+ *              url         (same)
+ *              body        (same)
+ *      ...
+ */
+
+/* Internal Constants */
+
+#define DEADLETTER_HEADER   8           // Bytes of length and checksum
+#define DEADLETTER_MAX      (1U<<30)    // Largest payload written
+
+typedef enum {
+    DEADLETTER_READ_OK,                 // Complete record with valid checksum
+    DEADLETTER_READ_END,                // End of file
+    DEADLETTER_READ_TORN,               // Record cut short (end of file)
+    DEADLETTER_READ_CORRUPT,            // Complete record with bad checksum
+} DeadLetterRead;
+
+static const char *DeadLetterReasons[DEADLETTER_NREASONS] = {
+    [DEADLETTER_REJECTED]  = "rejected",
+    [DEADLETTER_EXHAUSTED] = "exhausted",
+    [DEADLETTER_SHUTDOWN]  = "shutdown",
+    [DEADLETTER_CLOSED]    = "closed",
+};
+
+/* Internal Functions */
+
+static uint32_t deadletter_checksum(const char *data, size_t length) {
+    uint32_t hash = 2166136261U;    // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void deadletter_put32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t deadletter_get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Read the payload of the next record (allocated, to be freed by caller on
+ * DEADLETTER_READ_OK and DEADLETTER_READ_CORRUPT).
+ **/
+static DeadLetterRead deadletter_read(FILE *fs, char **payload, size_t *length) {
+    unsigned char header[DEADLETTER_HEADER];
+    size_t        n = fread(header, 1, sizeof(header), fs);
+
+    *payload = NULL;
+    if (n == 0) {
+        return DEADLETTER_READ_END;
+    }
+    if (n < sizeof(header)) {
+        return DEADLETTER_READ_TORN;
+    }
+
+    // A record longer than the rest of the file was cut short
+    struct stat st;
+    off_t       offset = ftello(fs);
+    *length = deadletter_get32(header);
+    if (*length == 0 || fstat(fileno(fs), &st) < 0 || offset < 0 || (off_t)*length > st.st_size - offset) {
+        return DEADLETTER_READ_TORN;
+    }
+    if (!(*payload = smq_malloc(*length))) {
+        fseeko(fs, *length, SEEK_CUR);  // Complete, but cannot be checked
+        return DEADLETTER_READ_CORRUPT;
+    }
+    if (fread(*payload, 1, *length, fs) != *length) {
+        smq_free(*payload);
+        *payload = NULL;
+        return DEADLETTER_READ_TORN;
+    }
+    return deadletter_checksum(*payload, *length) == deadletter_get32(header + 4) ?
+        DEADLETTER_READ_OK : DEADLETTER_READ_CORRUPT;
+}
+
+/**
+ * Decode payload of record.
+ **/
+static bool deadletter_decode(char *payload, size_t length, DeadLetter *letter) {
+    FILE *fs = fmemopen(payload, length, "r");
+    if (!fs) {
+        return false;
+    }
+
+    uint64_t status, attempts;
+    int      reason = fgetc(fs);
+    bool     valid  = reason > 0 && reason < DEADLETTER_NREASONS &&
+        capture_read_varint(fs, &letter->time) &&
+        capture_read_varint(fs, &status) &&
+        capture_read_varint(fs, &attempts) &&
+        capture_read_varint(fs, &letter->producer) &&
+        capture_read_varint(fs, &letter->sequence) &&
+        capture_read_string(fs, &letter->method) &&
+        capture_read_string(fs, &letter->url) &&
+        capture_read_string(fs, &letter->body);
+    fclose(fs);
+
+    if (!valid) {
+        deadletter_clear(letter);
+        return false;
+    }
+    letter->reason   = reason;
+    letter->status   = (long)status;
+    letter->attempts = (unsigned)attempts;
+    return true;
+}
+
+/**
+ * Cut off a record torn by a crash at the end of a file opened for
+ * appending, so new records are not appended behind it.
+ **/
+static bool deadletter_repair(FILE *fs, const char *path) {
+    off_t          valid = ftello(fs);
+    char          *payload;
+    size_t         length;
+    DeadLetterRead read;
+
+    while ((read = deadletter_read(fs, &payload, &length)) == DEADLETTER_READ_OK || read == DEADLETTER_READ_CORRUPT) {
+        smq_free(payload);
+        valid = ftello(fs);
+    }
+    if (read == DEADLETTER_READ_TORN) {
+        error("Dropping torn record at end of dead-letter file %s (offset %lld)", path, (long long)valid);
+        if (fflush(fs) != 0 || ftruncate(fileno(fs), valid) != 0) {
+            error("Unable to truncate dead-letter file %s: %s", path, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+static DeadLetters * deadletter_allocate(FILE *fs) {
+    DeadLetters *d = smq_calloc(1, sizeof(DeadLetters));
+    if (!d) {
+        fclose(fs);
+        return NULL;
+    }
+
+    d->stream = fs;
+    mutex_init(&d->lock, NULL);
+    return d;
+}
+
+/* Functions */
+
+/**
+ * Open dead-letter file for appending (creating it if necessary).
+ * @param   path        Path to dead-letter file.
+ * @return  Newly allocated DeadLetters structure (NULL on failure).
+ **/
+DeadLetters * deadletter_create(const char *path) {
+    FILE *fs = fopen(path, "a+");
+    if (!fs) {
+        error("Unable to open dead-letter file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    // New files get the magic; existing ones must already have it
+    char magic[sizeof(DEADLETTER_MAGIC)];
+    fseek(fs, 0, SEEK_END);
+    if (ftell(fs) == 0) {
+        fwrite(DEADLETTER_MAGIC, 1, sizeof(DEADLETTER_MAGIC), fs);
+        fflush(fs);
+    } else if (fseek(fs, 0, SEEK_SET) != 0 || fread(magic, 1, sizeof(magic), fs) != sizeof(magic) ||
+               memcmp(magic, DEADLETTER_MAGIC, sizeof(magic))) {
+        error("Not a dead-letter file: %s", path);
+        fclose(fs);
+        return NULL;
+    } else if (!deadletter_repair(fs, path)) {
+        fclose(fs);
+        return NULL;
+    }
+
+    // Switch from reading to appending (ISO C requires a seek in between)
+    fseek(fs, 0, SEEK_END);
+    return deadletter_allocate(fs);
+}
+
+/**
+ * Open dead-letter file for reading.
+ * @param   path        Path to dead-letter file.
+ * @return  Newly allocated DeadLetters structure (NULL on failure).
+ **/
+DeadLetters * deadletter_open(const char *path) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        error("Unable to open dead-letter file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    char magic[sizeof(DEADLETTER_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), fs) != sizeof(magic) || memcmp(magic, DEADLETTER_MAGIC, sizeof(magic))) {
+        error("Not a dead-letter file: %s", path);
+        fclose(fs);
+        return NULL;
+    }
+    return deadletter_allocate(fs);
+}
+
+/**
+ * Close dead-letter file and free structure.
+ * @param   d           DeadLetters structure.
+ **/
+void deadletter_close(DeadLetters *d) {
+    if (!d) {
+        return;
+    }
+
+    mutex_lock(&d->lock);
+    fclose(d->stream);
+    d->stream = NULL;
+    mutex_unlock(&d->lock);
+    smq_free(d);
+}
+
+/**
+ * Append record and flush it to disk (unless deferred).
+ * @param   d           DeadLetters structure.
+ * @param   letter      Record to append.
+ * @return  Whether or not the record was written.
+ **/
+bool deadletter_append(DeadLetters *d, const DeadLetter *letter) {
+    // Encode payload first, so the record goes out with its length and checksum
+    char  *payload = NULL;
+    size_t length  = 0;
+    FILE  *fs      = open_memstream(&payload, &length);
+    if (!fs) {
+        error("Unable to encode dead letter: %s", strerror(errno));
+        return false;
+    }
+    fputc(letter->reason, fs);
+    capture_write_varint(fs, letter->time);
+    capture_write_varint(fs, (uint64_t)letter->status);
+    capture_write_varint(fs, letter->attempts);
+    capture_write_varint(fs, letter->producer);
+    capture_write_varint(fs, letter->sequence);
+    capture_write_string(fs, letter->method);
+    capture_write_string(fs, letter->url);
+    capture_write_string(fs, letter->body);
+    bool encoded = fclose(fs) == 0 && length <= DEADLETTER_MAX;
+
+    unsigned char header[DEADLETTER_HEADER];
+    deadletter_put32(header, length);
+    deadletter_put32(header + 4, deadletter_checksum(payload, length));
+
+    mutex_lock(&d->lock);
+    bool written = encoded &&
+        fwrite(header, 1, sizeof(header), d->stream) == sizeof(header) &&
+        fwrite(payload, 1, length, d->stream) == length &&
+        (d->deferred ? !ferror(d->stream) : fflush(d->stream) == 0 && fdatasync(fileno(d->stream)) == 0);
+    if (written) {
+        d->written++;
+    } else {
+        error("Unable to write dead letter: %s", strerror(errno));
+    }
+    mutex_unlock(&d->lock);
+    free(payload);      // Allocated by open_memstream
+    return written;
+}
+
+/**
+ * Append request that could not be delivered.
+ * @param   d           DeadLetters structure.
+ * @param   reason      Why request was not delivered.
+ * @param   r           Request structure.
+ * @return  Whether or not the record was written.
+ **/
+bool deadletter_write(DeadLetters *d, DeadLetterReason reason, const Request *r) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    DeadLetter letter = {
+        .reason   = reason,
+        .time     = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+        .status   = r->status,
+        .attempts = r->attempts,
+        .producer = r->producer,
+        .sequence = r->sequence,
+        .method   = r->method,
+        .url      = r->url,
+        .body     = r->body,
+    };
+    return deadletter_append(d, &letter);
+}
+
+/**
+ * Read next record, skipping damaged ones (see DeadLetters.damaged).
+ * @param   d           DeadLetters structure.
+ * @param   letter      Record to fill in (release with deadletter_clear).
+ * @return  Whether or not a record was read.
+ **/
+bool deadletter_next(DeadLetters *d, DeadLetter *letter) {
+    while (true) {
+        char          *payload;
+        size_t         length;
+        DeadLetterRead read = deadletter_read(d->stream, &payload, &length);
+
+        memset(letter, 0, sizeof(DeadLetter));
+        if (read == DEADLETTER_READ_END) {
+            return false;
+        }
+        if (read == DEADLETTER_READ_TORN) {
+            d->damaged++;
+            return false;
+        }
+
+        bool decoded = read == DEADLETTER_READ_OK && deadletter_decode(payload, length, letter);
+        smq_free(payload);
+        if (decoded) {
+            return true;
+        }
+        d->damaged++;
+    }
+}
+
+/**
+ * Defer syncing records until deadletter_sync (when many are written at once,
+ * e.g. a whole queue at teardown).
+ * @param   d           DeadLetters structure.
+ **/
+void deadletter_defer(DeadLetters *d) {
+    mutex_lock(&d->lock);
+    d->deferred = true;
+    mutex_unlock(&d->lock);
+}
+
+/**
+ * Flush deferred records to disk with one sync and stop deferring.
+ * @param   d           DeadLetters structure.
+ * @return  Whether or not the records reached the disk.
+ **/
+bool deadletter_sync(DeadLetters *d) {
+    mutex_lock(&d->lock);
+    bool synced = fflush(d->stream) == 0 && fdatasync(fileno(d->stream)) == 0;
+    if (!synced) {
+        error("Unable to write dead letters: %s", strerror(errno));
+    }
+    d->deferred = false;
+    mutex_unlock(&d->lock);
+    return synced;
+}
+
+/**
+ * Release strings in record.
+ * @param   letter      DeadLetter structure.
+ **/
+void deadletter_clear(DeadLetter *letter) {
+    smq_free(letter->method);
+    smq_free(letter->url);
+    smq_free(letter->body);
+    letter->method = NULL;
+    letter->url    = NULL;
+    letter->body   = NULL;
+}
+
+/**
+ * Return name of reason.
+ * @param   reason      Reason code.
+ * @return  Name ("unknown" if not a reason).
+ **/
+const char * deadletter_reason_name(DeadLetterReason reason) {
+    if (reason <= 0 || reason >= DEADLETTER_NREASONS) {
+        return "unknown";
+    }
+    return DeadLetterReasons[reason];
+}
+
+/**
+ * Look up reason by name.
+ * @param   name        Name of reason.
+ * @return  Reason code (0 if there is no such reason).
+ **/
+DeadLetterReason deadletter_reason(const char *name) {
+    for (int reason = 1; reason < DEADLETTER_NREASONS; reason++) {
+        if (streq(DeadLetterReasons[reason], name)) {
+            return reason;
+        }
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
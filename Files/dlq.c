@@ -0,0 +1,210 @@
+/* dlq.c
+ * smq-dlq: Inspect a dead-letter file (see SMQOptions.dead_letter) and
+ * re-inject its requests into a broker.
+ *
+ * Re-injected requests are sent once each, in file order; those that still
+ * fail can be written to another dead-letter file (-o) so that nothing is
+ * lost between runs.
+ **/
+
+#include "smq/alloc.h"
+#include "smq/connection.h"
+#include "smq/deadletter.h"
+#include "smq/request.h"
+#include "smq/utils.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define PREVIEW     40          // Body characters shown by list
+
+/* Globals */
+
+char            *Host    = NULL;    // Rewrite URLs to this host (NULL = keep)
+char            *Port    = NULL;    // Rewrite URLs to this port (NULL = keep)
+char            *Output  = NULL;    // Dead-letter file for requests that still fail
+long             Timeout = 10000;   // Request timeout (ms)
+DeadLetterReason Reason  = 0;       // Only records with this reason (0 = all)
+
+void usage(int status) {
+    fprintf(stderr, "Usage: ./smq-dlq [options] list|inject file\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "    list      Show records\n");
+    fprintf(stderr, "    inject    Send requests again\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -r        Only records with reason (rejected, exhausted, shutdown, closed)\n");
+    fprintf(stderr, "    -s        Send to host (default: recorded host)\n");
+    fprintf(stderr, "    -p        Send to port (default: recorded port)\n");
+    fprintf(stderr, "    -t        Request timeout in seconds (default: %ld)\n", Timeout / 1000);
+    fprintf(stderr, "    -o        Append requests that still fail to this dead-letter file\n");
+    exit(status);
+}
+
+/* Functions */
+
+/**
+ * Rewrite host and port of URL (as given by -s and -p).
+ * @param   url         Recorded URL ([scheme://]host[:port]/path).
+ * @param   buffer      Buffer for rewritten URL.
+ * @param   size        Size of buffer.
+ * @return  Rewritten URL (or url itself if nothing to rewrite).
+ **/
+const char * rewrite_url(const char *url, char *buffer, size_t size) {
+    if (!Host && !Port) {
+        return url;
+    }
+    const char *authority = strstr(url, "://");
+    authority = authority ? authority + 3 : url;
+
+    // Split recorded authority into host and port
+    const char *path = authority + strcspn(authority, "/");
+    const char *port = memchr(authority, ':', path - authority);
+    char        host[BUFSIZ];
+    char        number[16] = "";
+    snprintf(host, sizeof(host), "%.*s", (int)((port ? port : path) - authority), authority);
+    if (port) {
+        snprintf(number, sizeof(number), "%.*s", (int)(path - port - 1), port + 1);
+    }
+
+    snprintf(buffer, size, "%.*s%s%s%s%s", (int)(authority - url), url,
+        Host ? Host : host, (Port || port) ? ":" : "", Port ? Port : number, path);
+    return buffer;
+}
+
+void list_letter(const DeadLetter *letter) {
+    char      when[32];
+    time_t    seconds = letter->time / 1000000000ULL;
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+
+    printf("%-9s %s %3ld %3u %-6s %s", deadletter_reason_name(letter->reason), when,
+        letter->status, letter->attempts, letter->method, letter->url);
+
+    if (letter->body) {
+        size_t length = strlen(letter->body);
+        fputs(" \"", stdout);
+        for (size_t i = 0; i < length && i < PREVIEW; i++) {
+            unsigned char c = letter->body[i];
+            putchar(c >= ' ' && c != 0x7f ? c : '.');
+        }
+        fputs(length > PREVIEW ? "...\"" : "\"", stdout);
+    }
+    putchar('\n');
+}
+
+bool inject_letter(const DeadLetter *letter, Connection *connection, DeadLetters *output) {
+    char     buffer[BUFSIZ];
+    Request *r = request_create(letter->method, rewrite_url(letter->url, buffer, sizeof(buffer)), letter->body);
+    if (!r) {
+        return false;
+    }
+
+    // Keep the publish's tags, so the broker drops it if it was delivered
+    r->attempts = letter->attempts + 1;
+    r->producer = letter->producer;
+    r->sequence = letter->sequence;
+    char *response = request_perform(r, Timeout, connection);
+    bool  sent     = response != NULL;
+    if (!sent) {
+        error("Unable to %s %s (status %ld)", r->method, r->url, r->status);
+        if (output && !deadletter_write(output, letter->reason, r)) {
+            error("Unable to keep %s %s in %s", r->method, r->url, Output);
+        }
+    }
+
+    smq_free(response);
+    request_delete(r);
+    return sent;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (argind == argc) {
+            usage(EXIT_FAILURE);
+        } else if (streq(arg, "-r")) {
+            if (!(Reason = deadletter_reason(argv[argind++]))) {
+                usage(EXIT_FAILURE);
+            }
+        } else if (streq(arg, "-s")) {
+            Host = argv[argind++];
+        } else if (streq(arg, "-p")) {
+            Port = argv[argind++];
+        } else if (streq(arg, "-t")) {
+            Timeout = (long)(strtod(argv[argind++], NULL) * 1000);
+        } else if (streq(arg, "-o")) {
+            Output = argv[argind++];
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (argind + 2 != argc) {
+        usage(EXIT_FAILURE);
+    }
+    char *command = argv[argind];
+    char *path    = argv[argind + 1];
+    bool  inject  = streq(command, "inject");
+    if (!inject && !streq(command, "list")) {
+        usage(EXIT_FAILURE);
+    }
+    if (Output && streq(Output, path)) {
+        error("Output must differ from %s (it is read while injecting)", path);
+        return EXIT_FAILURE;
+    }
+
+    DeadLetters *input = deadletter_open(path);
+    if (!input) {
+        return EXIT_FAILURE;
+    }
+
+    DeadLetters *output     = inject && Output ? deadletter_create(Output) : NULL;
+    Connection  *connection = inject ? connection_create(NULL) : NULL;
+    if ((inject && Output && !output) || (inject && !connection)) {
+        deadletter_close(input);
+        deadletter_close(output);
+        connection_delete(connection);
+        return EXIT_FAILURE;
+    }
+
+    size_t     records = 0;
+    size_t     failed  = 0;
+    DeadLetter letter;
+    while (deadletter_next(input, &letter)) {
+        if (!Reason || letter.reason == Reason) {
+            records++;
+            if (!inject) {
+                list_letter(&letter);
+            } else if (!inject_letter(&letter, connection, output)) {
+                failed++;
+            }
+        }
+        deadletter_clear(&letter);
+    }
+
+    if (inject) {
+        info("Injected %zu of %zu requests from %s", records - failed, records, path);
+    }
+    if (input->damaged) {
+        error("Skipped %lu damaged record(s) in %s (torn by a crash or corrupt)", (unsigned long)input->damaged, path);
+    }
+    bool damaged = input->damaged > 0;
+
+    deadletter_close(input);
+    deadletter_close(output);
+    connection_delete(connection);
+    return failed || damaged ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
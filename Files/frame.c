@@ -0,0 +1,267 @@
+/* frame.c: Incremental parser for framed multi-message responses
+ *
+ * Batched responses carry several messages, each terminated by a record
+ * separator.  frame_feed is handed the chunks libcurl delivers and scans them
+ * in place: frames that lie entirely within a chunk are passed on as views
+ * into that chunk, and only a frame split across chunks is copied (into the
+ * carry buffer).  Scanning for the delimiter uses AVX2 or SSE2 when the CPU
+ * has it and a byte loop otherwise.
+ **/
+
+#include "smq/frame.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_X86
+#endif
+
+/* Scanners */
+
+static size_t frame_scan_scalar(const char *data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] == FRAME_DELIMITER) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#ifdef FRAME_X86
+__attribute__((target("sse2")))
+static size_t frame_scan_sse2(const char *data, size_t n) {
+    const __m128i delimiter = _mm_set1_epi8(FRAME_DELIMITER);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, delimiter));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + frame_scan_scalar(data + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t frame_scan_avx2(const char *data, size_t n) {
+    const __m256i delimiter = _mm256_set1_epi8(FRAME_DELIMITER);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, delimiter));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + frame_scan_sse2(data + i, n - i);
+}
+#endif
+
+static const struct {
+    const char *name;
+    size_t    (*scan)(const char *data, size_t n);
+} FrameScanners[] = {
+#ifdef FRAME_X86
+    {"avx2",    frame_scan_avx2},
+    {"sse2",    frame_scan_sse2},
+#endif
+    {"scalar",  frame_scan_scalar},
+    {NULL,      NULL},
+};
+
+/* Internal Globals */
+
+static int FrameScanner = -1;       // Index into FrameScanners (-1 = not selected yet)
+
+/* Internal Functions */
+
+static bool frame_supported(const char *name) {
+#ifdef FRAME_X86
+    if (streq(name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (streq(name, "sse2")) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return streq(name, "scalar");
+}
+
+/**
+ * Select best supported scanner (or the one named by SMQ_FRAME_SCAN).
+ **/
+static int frame_select(void) {
+    const char *forced = getenv("SMQ_FRAME_SCAN");
+    if (forced && !frame_use(forced)) {
+        error("Unsupported SMQ_FRAME_SCAN: %s", forced);
+    }
+
+    for (int s = 0; FrameScanner < 0 && FrameScanners[s].name; s++) {
+        if (frame_supported(FrameScanners[s].name)) {
+            FrameScanner = s;
+        }
+    }
+    return FrameScanner;
+}
+
+static inline int frame_current(void) {
+    return FrameScanner < 0 ? frame_select() : FrameScanner;
+}
+
+static bool frame_carry(FrameParser *p, const char *data, size_t n) {
+    if (p->length + n > p->capacity) {
+        size_t capacity = p->capacity ? p->capacity : BUFSIZ;
+        while (capacity < p->length + n) {
+            capacity *= 2;
+        }
+
+        char *carry = smq_realloc(p->carry, capacity);
+        if (!carry) {
+            return false;
+        }
+        p->carry    = carry;
+        p->capacity = capacity;
+    }
+
+    memcpy(p->carry + p->length, data, n);
+    p->length += n;
+    return true;
+}
+
+static void frame_emit(FrameParser *p, const char *data, size_t length) {
+    p->callback(data, length, p->user);
+    p->frames++;
+}
+
+/* Functions */
+
+/**
+ * Initialize parser.
+ * @param   p           Parser structure.
+ * @param   callback    Function called with each frame.
+ * @param   user        User data passed to callback.
+ **/
+void frame_init(FrameParser *p, FrameCallback callback, void *user) {
+    memset(p, 0, sizeof(FrameParser));
+    p->callback = callback;
+    p->user     = user;
+}
+
+/**
+ * Free resources of parser.
+ * @param   p           Parser structure.
+ **/
+void frame_free(FrameParser *p) {
+    smq_free(p->carry);
+    p->carry    = NULL;
+    p->capacity = 0;
+    p->length   = 0;
+}
+
+/**
+ * Prepare parser for next response (unframed until announced otherwise),
+ * discarding any partial frame.
+ * @param   p           Parser structure.
+ **/
+void frame_reset(FrameParser *p) {
+    p->framed = false;
+    p->trace  = 0;
+    p->length = 0;
+    p->frames = 0;
+}
+
+/**
+ * Feed chunk of response to parser, emitting every frame it completes.
+ * @param   p           Parser structure.
+ * @param   data        Chunk of response.
+ * @param   n           Length of chunk.
+ * @return  Whether or not the chunk was consumed (false if out of memory).
+ **/
+bool frame_feed(FrameParser *p, const char *data, size_t n) {
+    if (!p->framed) {
+        return frame_carry(p, data, n);
+    }
+
+    size_t (*scan)(const char *, size_t) = FrameScanners[frame_current()].scan;
+    size_t offset = 0;
+
+    while (offset < n) {
+        size_t end = offset + scan(data + offset, n - offset);
+        if (end == n) {
+            return frame_carry(p, data + offset, n - offset);
+        }
+
+        if (p->length) {
+            // Frame started in an earlier chunk
+            if (!frame_carry(p, data + offset, end - offset)) {
+                return false;
+            }
+            frame_emit(p, p->carry, p->length);
+            p->length = 0;
+        } else {
+            frame_emit(p, data + offset, end - offset);
+        }
+        offset = end + 1;
+    }
+    return true;
+}
+
+/**
+ * Finish response: an unframed response is emitted as one message, while a
+ * framed response must not end in the middle of a frame.
+ * @param   p           Parser structure.
+ * @return  Whether or not the response ended cleanly.
+ **/
+bool frame_finish(FrameParser *p) {
+    bool clean = true;
+
+    if (!p->framed && p->length) {
+        frame_emit(p, p->carry, p->length);
+    } else if (p->framed && p->length) {
+        error("Discarding truncated frame of %zu bytes", p->length);
+        clean = false;
+    }
+
+    p->length = 0;
+    return clean;
+}
+
+/**
+ * Find first delimiter in data.
+ * @param   data        Data to scan.
+ * @param   n           Length of data.
+ * @return  Offset of delimiter (n if there is none).
+ **/
+size_t frame_scan(const char *data, size_t n) {
+    return FrameScanners[frame_current()].scan(data, n);
+}
+
+/**
+ * Return name of selected scanner ("avx2", "sse2" or "scalar").
+ **/
+const char * frame_scanner(void) {
+    return FrameScanners[frame_current()].name;
+}
+
+/**
+ * Use named scanner (e.g. to compare them).
+ * @param   name        Name of scanner.
+ * @return  Whether or not the scanner is supported.
+ **/
+bool frame_use(const char *name) {
+    for (int s = 0; FrameScanners[s].name; s++) {
+        if (streq(FrameScanners[s].name, name) && frame_supported(name)) {
+            FrameScanner = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,175 @@
+/* hedge.c: Hedged requests (duplicate slow requests on a spare connection)
+ *
+ * A request that has not finished after the chosen percentile of recent
+ * latencies is sent again on a second connection and whichever attempt
+ * succeeds first is used (see request_hedge).  Hedges are paid for from a
+ * budget that accrues a fraction of a hedge per request, so a slow broker
+ * sees at most that fraction of extra load.
+ **/
+
+#include "smq/hedge.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+/* Internal Functions */
+
+static int hedge_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static size_t hedge_discard(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    return size * nmemb;
+}
+
+/* Functions */
+
+/**
+ * Create hedge.
+ * @param   profile     Transport profile of both connections (NULL = default).
+ * @param   percentile  Hedge requests slower than this percentile (0.0 - 1.0).
+ * @param   budget      Fraction of requests that may be hedged (0.0 - 1.0).
+ * @return  Newly allocated Hedge structure (NULL on failure).
+ **/
+Hedge * hedge_create(const ConnectionProfile *profile, double percentile, double budget) {
+    Hedge *h = smq_calloc(1, sizeof(Hedge));
+    if (!h) {
+        return NULL;
+    }
+
+    h->multi      = curl_multi_init();
+    h->primary    = connection_create(profile);
+    h->spare      = connection_create(profile);
+    h->percentile = percentile;
+    h->budget     = budget;
+    h->tokens     = 1.0;
+    if (!h->multi || !h->primary || !h->spare) {
+        hedge_delete(h);
+        return NULL;
+    }
+    return h;
+}
+
+/**
+ * Delete hedge (closing its connections).
+ * @param   h           Hedge structure.
+ **/
+void hedge_delete(Hedge *h) {
+    if (!h) {
+        return;
+    }
+
+    connection_delete(h->primary);
+    connection_delete(h->spare);
+    if (h->multi) {
+        curl_multi_cleanup(h->multi);
+    }
+    smq_free(h);
+}
+
+/**
+ * Record latency of a finished request and earn its share of the budget.
+ * @param   h           Hedge structure.
+ * @param   latency     Duration of request (ns).
+ **/
+void hedge_observe(Hedge *h, uint64_t latency) {
+    h->window[h->samples++ % HEDGE_WINDOW] = latency;
+    h->tokens = min(h->tokens + h->budget, HEDGE_BURST);
+
+    // Recompute the percentile every eighth of a window (sorting a copy)
+    if (h->samples >= HEDGE_SAMPLES && h->samples % (HEDGE_WINDOW / 8) == 0) {
+        size_t   count = min(h->samples, HEDGE_WINDOW);
+        uint64_t sorted[HEDGE_WINDOW];
+        memcpy(sorted, h->window, count * sizeof(uint64_t));
+        qsort(sorted, count, sizeof(uint64_t), hedge_compare);
+        h->delay = sorted[(size_t)(h->percentile * (count - 1))];
+    }
+}
+
+/**
+ * Return how long to wait for the first attempt before hedging.
+ * @param   h           Hedge structure.
+ * @return  Delay (milliseconds, rounded up, 0 = do not hedge yet).
+ **/
+long hedge_delay(Hedge *h) {
+    return (long)((h->delay + 999999) / 1000000);
+}
+
+/**
+ * Spend one hedge from the budget.
+ * @param   h           Hedge structure.
+ * @return  Whether or not a hedge may be sent.
+ **/
+bool hedge_take(Hedge *h) {
+    if (h->tokens < 1.0) {
+        return false;
+    }
+    h->tokens -= 1.0;
+    return true;
+}
+
+/**
+ * Open both connections ahead of the first request by performing a HEAD
+ * request on each at the same time (any HTTP response counts as success).
+ *
+ * The requests run on the shared multi handle, so the connections land in
+ * the pool request_hedge draws from (warming each connection on its own
+ * would leave them in pools it never uses).
+ *
+ * @param   h           Hedge structure.
+ * @param   url         URL of server.
+ * @param   timeout     Maximum time (milliseconds).
+ * @param   timing      Time spent in each phase by the primary (may be NULL).
+ * @return  Whether or not the server was reached.
+ **/
+bool hedge_warm(Hedge *h, const char *url, long timeout, ConnectionTiming *timing) {
+    Connection *connections[2] = {h->primary, h->spare};
+    CURL       *handles[2]     = {NULL, NULL};
+    bool        reached        = false;
+
+    for (int i = 0; i < 2; i++) {
+        if (!(handles[i] = connection_acquire(connections[i]))) {
+            continue;
+        }
+        curl_easy_setopt(handles[i], CURLOPT_URL, url);
+        curl_easy_setopt(handles[i], CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_TIMEOUT_MS, timeout);
+        curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, hedge_discard);
+        curl_multi_add_handle(h->multi, handles[i]);
+    }
+
+    int running = 1;
+    while (running) {
+        curl_multi_perform(h->multi, &running);
+        if (running) {
+            curl_multi_poll(h->multi, NULL, 0, 1000, NULL);
+        }
+    }
+
+    CURLMsg *message;
+    int      left;
+    while ((message = curl_multi_info_read(h->multi, &left))) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+        if (message->data.result == CURLE_OK) {
+            reached = true;
+        } else {
+            debug("Unable to connect to %s: %s", url, curl_easy_strerror(message->data.result));
+        }
+    }
+
+    if (timing && handles[0]) {
+        connection_timing(handles[0], timing);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (handles[i]) {
+            curl_multi_remove_handle(h->multi, handles[i]);
+            connection_release(connections[i], handles[i]);
+        }
+    }
+    return reached;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,349 @@
+/* log.c: Asynchronous logging
+ *
+ * Each thread that logs gets its own single-producer ring of fixed size
+ * entries.  log_write formats the message into the next free entry and never
+ * blocks: if the ring is full the message is dropped and counted.  A
+ * background writer drains all rings into one buffer and writes it with a
+ * single system call; log_flush does the same synchronously (at exit).
+ *
+ * The writer sleeps on a futex until a message lands in an empty ring (only
+ * then do producers wake it), so a process that logs nothing pays nothing
+ * after its first message.
+ *
+ * The writer ("smq-log") is shared by the whole process and started by the
+ * first message, so the thread options of an SMQ (affinity, cgroup,
+ * scheduling) do not apply to it; it mostly sleeps and inherits the settings
+ * of the thread that logged first.
+ **/
+
+#define _GNU_SOURCE
+
+#include "smq/log.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* Internal Constants */
+
+#define LOG_SLOTS           128
+#define LOG_MESSAGE_SIZE    232
+#define LOG_BUFFER_SIZE     (1<<16)
+#define LOG_BUSY_NS         1000000     // Writer sleep between batches
+
+static const char *LogLevels[] = {"DEBUG", "INFO ", "ERROR"};
+
+/* Internal Structures */
+
+typedef struct {
+    LogSite    *site;                       // Call site of message
+    uint64_t    timestamp;                  // Realtime of message (ns)
+    uint64_t    thread;                     // Logging thread
+    uint32_t    suppressed;                 // Messages suppressed at site before this one
+    uint32_t    length;                     // Length of message
+    char        message[LOG_MESSAGE_SIZE];  // Formatted message
+} LogEntry;
+
+typedef struct LogRing LogRing;
+struct LogRing {
+    atomic_size_t   head;                   // Next entry to drain (writer)
+    atomic_size_t   tail;                   // Next entry to fill (owning thread)
+    atomic_size_t   dropped;                // Messages dropped because ring was full
+    atomic_bool     orphaned;               // Whether or not owning thread exited
+    LogRing        *next;                   // Next ring in Rings
+    LogEntry        entries[LOG_SLOTS];
+};
+
+typedef struct {
+    char    data[LOG_BUFFER_SIZE];
+    size_t  size;
+} LogBuffer;
+
+/* Internal Globals */
+
+static _Atomic(LogRing *)   Rings     = NULL;
+static __thread LogRing    *Ring      = NULL;
+static pthread_once_t       Once      = PTHREAD_ONCE_INIT;
+static pthread_key_t        Key;
+static pthread_mutex_t      DrainLock = PTHREAD_MUTEX_INITIALIZER;
+static LogBuffer            Buffer;
+static atomic_uint          Wakeups   = 0;    // Futex word of writer (bumped to wake it)
+static int                  Fd        = STDERR_FILENO;
+static LogFormat            Format    = LOG_FORMAT_TEXT;
+
+/* Internal Functions */
+
+static void log_output(LogBuffer *b) {
+    size_t offset = 0;
+    while (offset < b->size) {
+        ssize_t n = write(Fd, b->data + offset, b->size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+    b->size = 0;
+}
+
+static void log_append(LogBuffer *b, LogSite *site, int level, uint64_t timestamp, uint64_t thread,
+                       uint32_t suppressed, const char *message, uint32_t length) {
+    if (b->size + sizeof(LogRecord) + LOG_MESSAGE_SIZE + BUFSIZ > LOG_BUFFER_SIZE) {
+        log_output(b);
+    }
+
+    char  *p    = b->data + b->size;
+    size_t room = LOG_BUFFER_SIZE - b->size;
+
+    if (Format == LOG_FORMAT_BINARY) {
+        LogRecord record = {timestamp, thread, level, site ? site->line : 0, suppressed, length};
+        memcpy(p, &record, sizeof(record));
+        memcpy(p + sizeof(record), message, length);
+        b->size += sizeof(record) + length;
+        return;
+    }
+
+    int n;
+    if (level == LOG_DEBUG && site) {
+        n = snprintf(p, room, "[%09lu] DEBUG %s:%d:%s: %.*s", (unsigned long)thread,
+            site->file, site->line, site->func, (int)length, message);
+    } else {
+        n = snprintf(p, room, "[%09lu] %s %.*s", (unsigned long)thread, LogLevels[level], (int)length, message);
+    }
+    if (suppressed && n > 0) {
+        n += snprintf(p + n, room - n, " (suppressed %u similar messages)", suppressed);
+    }
+    if (n > 0 && (size_t)n < room - 1) {
+        p[n++] = '\n';
+        b->size += n;
+    }
+}
+
+/**
+ * Drain all rings into the output (caller must hold DrainLock).
+ * @return  Whether or not anything was written.
+ **/
+static bool log_drain(void) {
+    bool     wrote    = false;
+    LogRing *previous = NULL;
+    LogRing *ring     = atomic_load(&Rings);
+
+    while (ring) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head != tail; head++) {
+            LogEntry *e = &ring->entries[head % LOG_SLOTS];
+            log_append(&Buffer, e->site, e->site->level, e->timestamp, e->thread, e->suppressed, e->message, e->length);
+            wrote = true;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        size_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped) {
+            char message[BUFSIZ];
+            int  length = snprintf(message, sizeof(message), "Log ring full: dropped %zu messages", dropped);
+            log_append(&Buffer, NULL, LOG_ERROR, 0, 0, 0, message, length);
+            wrote = true;
+        }
+
+        // Unlink and free rings of exited threads once they are empty
+        LogRing *next = ring->next;
+        if (atomic_load(&ring->orphaned) && atomic_load(&ring->tail) == head) {
+            if (previous) {
+                previous->next = next;
+                free(ring);
+                ring = next;
+                continue;
+            }
+
+            LogRing *expected = ring;
+            if (atomic_compare_exchange_strong(&Rings, &expected, next)) {
+                free(ring);
+                ring = next;
+                continue;
+            }
+        }
+
+        previous = ring;
+        ring     = next;
+    }
+
+    log_output(&Buffer);
+    return wrote;
+}
+
+static void log_orphan(void *arg) {
+    LogRing *ring = (LogRing *)arg;
+    Ring = NULL;
+    atomic_store(&ring->orphaned, true);
+}
+
+/**
+ * Wake the writer after a message landed in an empty ring.
+ **/
+static void log_wake(void) {
+    atomic_fetch_add(&Wakeups, 1);
+    syscall(SYS_futex, &Wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *log_writer(void *arg) {
+    pthread_setname_np(pthread_self(), "smq-log");
+
+    while (true) {
+        // Read the futex word before draining, so a wake-up sent after the
+        // drain looked at a ring is not missed
+        unsigned wakeups = atomic_load(&Wakeups);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        pthread_mutex_lock(&DrainLock);
+        bool wrote = log_drain();
+        pthread_mutex_unlock(&DrainLock);
+
+        if (wrote) {
+            struct timespec ts = {0, LOG_BUSY_NS};  // Let a burst collect into one write
+            nanosleep(&ts, NULL);
+        } else {
+            syscall(SYS_futex, &Wakeups, FUTEX_WAIT_PRIVATE, wakeups, NULL, NULL, 0);
+        }
+    }
+    return NULL;
+}
+
+static void log_init(void) {
+    pthread_key_create(&Key, log_orphan);
+
+    char *path = getenv("SMQ_LOG_FILE");
+    if (path) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            Fd = fd;
+        }
+    }
+
+    char *format = getenv("SMQ_LOG_FORMAT");
+    if (format && streq(format, "binary")) {
+        Format = LOG_FORMAT_BINARY;
+    }
+
+    // The writer is detached and never stopped (it blocks while there is
+    // nothing to write); whatever it has not written yet is flushed at exit
+    atexit(log_flush);
+
+    pthread_t      thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, log_writer, NULL);   // Without a writer, messages are still flushed at exit
+    pthread_attr_destroy(&attr);
+}
+
+static LogRing *log_ring(void) {
+    if (Ring) {
+        return Ring;
+    }
+
+    pthread_once(&Once, log_init);
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        return NULL;
+    }
+
+    ring->next = atomic_load(&Rings);
+    while (!atomic_compare_exchange_weak(&Rings, &ring->next, ring));
+
+    pthread_setspecific(Key, ring);
+    return Ring = ring;
+}
+
+/* Functions */
+
+/**
+ * Log message from call site (see log_at).
+ *
+ * Messages beyond SMQ_LOG_RATE per second at one call site are suppressed
+ * and reported with the next message from that site that gets through.
+ *
+ * @param   site        Call site structure.
+ * @param   format      printf-style format string.
+ **/
+void log_write(LogSite *site, const char *format, ...) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t window = ts.tv_sec;
+    if (atomic_load_explicit(&site->window, memory_order_relaxed) != window) {
+        atomic_store_explicit(&site->window, window, memory_order_relaxed);
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= SMQ_LOG_RATE) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRing *ring = log_ring();
+    if (!ring) {
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOG_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogEntry *e = &ring->entries[tail % LOG_SLOTS];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(e->message, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+
+    e->site       = site;
+    e->timestamp  = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->thread     = (uint64_t)pthread_self();
+    e->length     = n < 0 ? 0 : min((uint32_t)n, LOG_MESSAGE_SIZE - 1);
+    e->suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    // Wake the writer if the ring was empty: either it sees this entry in
+    // its drain, or this sees that it had caught up (see log_writer)
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->head, memory_order_relaxed) == tail) {
+        log_wake();
+    }
+}
+
+/**
+ * Write out all pending messages synchronously.
+ **/
+void log_flush(void) {
+    pthread_mutex_lock(&DrainLock);
+    log_drain();
+    pthread_mutex_unlock(&DrainLock);
+}
+
+/**
+ * Set log output file descriptor and format.
+ * @param   fd          File descriptor to write messages to.
+ * @param   format      Output format.
+ **/
+void log_configure(int fd, LogFormat format) {
+    pthread_once(&Once, log_init);
+
+    pthread_mutex_lock(&DrainLock);
+    log_drain();
+    Fd     = fd;
+    Format = format;
+    pthread_mutex_unlock(&DrainLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
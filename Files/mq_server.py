@@ -4,9 +4,22 @@
 
 This Message Queue Server supports the following REST API:
 
-    PUT     /topic/$topic               Publish message to $topic.
+    PUT     /topic/$topic               Publish message to $topic (a publish whose
+                                        X-SMQ-Producer and X-SMQ-Sequence were
+                                        seen recently is acknowledged but dropped).
+    PUT     /topic/$topic?framing=rs    Publish each message of request body to $topic,
+                                        each terminated by a record separator (0x1E).
+                                        The X-SMQ-Trace of a publish is passed on with
+                                        its (first) message.
 
     GET     /queue/$queue               Retrieve one message from $queue.
+    GET     /queue/$queue?batch=$n      Retrieve up to $n messages from $queue, each
+                                        terminated by a record separator (0x1E).  A
+                                        traced message is sent on its own, with its
+                                        X-SMQ-Trace.
+    GET     /queue/$queue?wait=$ms      Retrieve one message from $queue, answering
+                                        204 No Content if none arrives within $ms
+                                        (at most --max_wait).
 
     PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
@@ -20,9 +33,32 @@ import sys
 import time
 
 import tornado.gen
+import tornado.locks
 import tornado.options
 import tornado.web
 
+# Constants
+
+FRAME_DELIMITER = b'\x1e'
+FRAME_HEADER    = 'X-SMQ-Framing'
+PRODUCER_HEADER = 'X-SMQ-Producer'
+SEQUENCE_HEADER = 'X-SMQ-Sequence'
+TRACE_HEADER    = 'X-SMQ-Trace'
+DEDUP_WINDOW    = 4096          # Sequence numbers remembered per producer
+DEDUP_PRODUCERS = 4096          # Producers remembered (least recently seen forgotten)
+
+# Traced Message
+
+class TracedMessage(bytes):
+    ''' Message whose publish was traced (carries the trace id to the subscriber). '''
+    def __new__(cls, message, trace):
+        self = super().__new__(cls, message)
+        self.trace = trace
+        return self
+
+def is_traced(message):
+    return isinstance(message, TracedMessage)
+
 # Base Handler
 
 class BaseHandler(tornado.web.RequestHandler):
@@ -42,17 +78,34 @@ class BaseHandler(tornado.web.RequestHandler):
 class TopicHandler(BaseHandler):
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
-        message     = self.request.body
+        framed      = self.get_argument('framing', None) == 'rs'
+        messages    = self.request.body.split(FRAME_DELIMITER)[:-1] if framed else [self.request.body]
         subscribers = 0
+        producer    = self.request.headers.get(PRODUCER_HEADER)
+        sequence    = self.request.headers.get(SEQUENCE_HEADER)
+        tag         = (producer, int(sequence)) if producer and sequence else None
+        trace       = self.request.headers.get(TRACE_HEADER)
+
+        # Retried and hedged publishes carry the tag of the original
+        if tag and self.application.is_duplicate(*tag):
+            self.write('Ignored duplicate message {} from {}\n'.format(tag[1], tag[0]))
+            return
+
+        if trace and messages:
+            messages[0] = TracedMessage(messages[0], trace)
 
         for queue, topics in self.application.subscriptions.items():
             if topic in topics:
-                self.application.queues[queue].append(message)
+                self.application.queues[queue].extend(messages)
+                self.application.waiters[queue].notify_all()
                 subscribers += 1
 
         if subscribers:
-            self.write('Published message ({} bytes) to {} subscribers of {}\n'.format(
-                len(message),
+            if tag:
+                self.application.remember(*tag)
+            self.write('Published {} ({} bytes) to {} subscribers of {}\n'.format(
+                '{} messages'.format(len(messages)) if framed else 'message',
+                sum(map(len, messages)),
                 subscribers,
                 topic,
             ))
@@ -62,6 +115,15 @@ class TopicHandler(BaseHandler):
 # Queue Handler
 
 class QueueHandler(BaseHandler):
+    def initialize(self):
+        self.queue = None
+        self.gone  = False
+
+    def on_connection_close(self):
+        self.gone = True
+        if self.queue is not None:
+            self.application.waiters[self.queue].notify_all()
+
     @tornado.gen.coroutine
     def get(self, queue):
         ''' Retrieve one message from queue (wait until one is available). '''
@@ -69,11 +131,38 @@ class QueueHandler(BaseHandler):
         if queue not in self.application.queues:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(0.1)
-
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].popleft())
+        # Waiters sleep until a message is published to the queue (or the
+        # client goes away), so idle long-polls cost nothing until they expire
+        self.queue = queue
+        wait       = self.get_argument('wait', None)
+        deadline   = None
+        if wait is not None:
+            wait     = min(int(wait), self.application.max_wait)
+            deadline = self.application.ioloop.time() + wait / 1000.0
+
+        while not self.application.queues[queue] and not self.gone:
+            if deadline is not None and self.application.ioloop.time() >= deadline:
+                self.set_status(204)
+                return
+            yield self.application.waiters[queue].wait(timeout=deadline)
+
+        messages = self.application.queues[queue]
+        batch    = max(1, int(self.get_argument('batch', '1')))
+
+        if messages and batch > 1 and FRAME_DELIMITER not in messages[0] and not is_traced(messages[0]):
+            # Messages containing the delimiter, and traced messages (whose
+            # trace id is a header of the response), are only ever sent on
+            # their own
+            count = 0
+            self.set_header(FRAME_HEADER, 'rs')
+            while messages and count < batch and FRAME_DELIMITER not in messages[0] and not is_traced(messages[0]):
+                self.write(messages.popleft() + FRAME_DELIMITER)
+                count += 1
+            self.application.logger.info('Sent {} messages from {}'.format(count, queue))
+        elif messages:
+            if is_traced(messages[0]):
+                self.set_header(TRACE_HEADER, messages[0].trace)
+            self.write_response(messages.popleft())
         else:
             raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
 
@@ -103,18 +192,22 @@ class SubscriptionHandler(BaseHandler):
 # Message Queue
 
 class MessageQueue(tornado.web.Application):
-    DEFAULT_ADDRESS = '0.0.0.0'
-    DEFAULT_PORT    = 9620
+    DEFAULT_ADDRESS  = '0.0.0.0'
+    DEFAULT_PORT     = 9620
+    DEFAULT_MAX_WAIT = 60000    # Longest long-poll wait granted (milliseconds)
 
     def __init__(self, **settings):
         tornado.web.Application.__init__(self, **settings)
 
         self.logger        = logging.getLogger()
-        self.address       = settings.get('address', self.DEFAULT_ADDRESS)
-        self.port          = settings.get('port'   , self.DEFAULT_PORT)
+        self.address       = settings.get('address' , self.DEFAULT_ADDRESS)
+        self.port          = settings.get('port'    , self.DEFAULT_PORT)
+        self.max_wait      = settings.get('max_wait', self.DEFAULT_MAX_WAIT)
         self.ioloop        = tornado.ioloop.IOLoop.instance()
         self.queues        = collections.defaultdict(collections.deque)
         self.subscriptions = collections.defaultdict(set)
+        self.waiters       = collections.defaultdict(tornado.locks.Condition)
+        self.producers     = collections.OrderedDict()
 
         self.add_handlers('.*', (
             ('.*/topic/(.*)'            , TopicHandler),
@@ -122,6 +215,25 @@ class MessageQueue(tornado.web.Application):
             ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
         ))
 
+    def is_duplicate(self, producer, sequence):
+        ''' Return whether publish with tag was already accepted recently. '''
+        seen = self.producers.get(producer)
+        return seen is not None and sequence in seen[1]
+
+    def remember(self, producer, sequence):
+        ''' Remember tag of accepted publish. '''
+        if producer not in self.producers:
+            self.producers[producer] = (collections.deque(), set())
+            if len(self.producers) > DEDUP_PRODUCERS:
+                self.producers.popitem(last=False)
+        self.producers.move_to_end(producer)
+
+        order, members = self.producers[producer]
+        order.append(sequence)
+        members.add(sequence)
+        if len(order) > DEDUP_WINDOW:
+            members.discard(order.popleft())
+
     def run(self):
         try:
             self.listen(self.port, self.address)
@@ -134,9 +246,10 @@ class MessageQueue(tornado.web.Application):
 # Main execution
 
 def main():
-    tornado.options.define('debug'  , default=False, help='Enable debugging mode')
-    tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
-    tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
+    tornado.options.define('debug'   , default=False, help='Enable debugging mode')
+    tornado.options.define('address' , default=MessageQueue.DEFAULT_ADDRESS , help='Address to listen on.')
+    tornado.options.define('port'    , default=MessageQueue.DEFAULT_PORT    , help='Port to listen on.')
+    tornado.options.define('max_wait', default=MessageQueue.DEFAULT_MAX_WAIT, help='Longest long-poll wait (milliseconds).')
     tornado.options.parse_command_line()
 
     signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
@@ -0,0 +1,595 @@
+/* netem.c
+ * smq-netem: TCP proxy that injects network faults between a client and the
+ * message queue server.
+ *
+ * Each accepted connection is forwarded to the upstream server by a reader
+ * and a writer thread per direction.  Readers timestamp chunks with a release
+ * time (latency + jitter) and writers deliver them no sooner than that,
+ * throttled to the bandwidth cap.  Stalls hold data back for the duration of
+ * a phase and resets abort both sides of a connection with a TCP RST.
+ *
+ * Impairments are read from a scripted profile: a sequence of phases, each
+ * starting at an offset (in seconds) from when the proxy started:
+ *
+ *      # start  settings (inherited from the previous phase)
+ *      0        latency=40 jitter=10 bandwidth=1250000
+ *      10       stall=1
+ *      12       stall=0 reset=0.05
+ *      20       reset=0
+ *
+ * Spikes delay single chunks (and everything behind them on that connection)
+ * by spike_delay with probability spike, like a lost segment or a pause of
+ * one broker worker.
+ **/
+
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define MAX_PHASES  64
+#define CHUNK_SIZE  (1<<14)
+
+/* Structures */
+
+typedef struct {
+    double  latency;        // One-way delay (milliseconds)
+    double  jitter;         // Uniform random extra delay (milliseconds)
+    double  bandwidth;      // Bandwidth cap per direction (bytes/second, 0 = none)
+    double  reset;          // Probability of resetting connection per chunk
+    double  spike;          // Probability of delaying a chunk by spike_delay
+    double  spike_delay;    // Extra delay of spiked chunks (milliseconds)
+    bool    stall;          // Whether or not to hold back all data
+} Impairment;
+
+typedef struct {
+    double      start;      // Start of phase (seconds since startup)
+    Impairment  impairment; // Impairment during phase
+} Phase;
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    uint64_t    release;    // Monotonic time when chunk may be delivered (ns)
+    size_t      size;       // Size of data
+    Chunk      *next;       // Next chunk in pipe
+    char        data[];     // Data to deliver
+};
+
+typedef struct Link Link;
+
+typedef struct {
+    int         src;        // Socket to read from
+    int         dst;        // Socket to write to
+    const char *label;      // Direction label for logging
+    Chunk      *head;       // First pending chunk
+    Chunk      *tail;       // Last pending chunk
+    bool        closed;     // Whether or not src has reached EOF
+    uint64_t    last;       // Release time of most recent chunk (keeps order)
+    size_t      bytes;      // Bytes delivered
+    unsigned    seed;       // Random seed for jitter and resets
+    Mutex       lock;
+    Cond        cond;
+    Link       *link;       // Owning link
+} Pipe;
+
+struct Link {
+    int         client;     // Accepted client socket
+    int         upstream;   // Socket connected to server
+    Pipe        up;         // client -> upstream
+    Pipe        down;       // upstream -> client
+    atomic_int  threads;    // Number of threads still using link
+    atomic_bool aborted;    // Whether or not link was reset
+};
+
+/* Globals */
+
+char *ListenPort = "9621";
+char *Host       = "localhost";
+char *Port       = "9620";
+
+Phase  Profile[MAX_PHASES] = {{0, {0}}};
+size_t NPhases   = 1;
+double Period    = 0;       // Loop profile every Period seconds (0 = no loop)
+uint64_t Started = 0;
+
+atomic_ulong NLinks = 0;
+
+void usage(int status) {
+    fprintf(stderr, "Usage: ./smq-netem [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -l        Port to listen on (default: %s)\n", ListenPort);
+    fprintf(stderr, "    -s        Upstream host (default: %s)\n", Host);
+    fprintf(stderr, "    -p        Upstream port (default: %s)\n", Port);
+    fprintf(stderr, "    -P        Profile: clean, wan, lossy, flaky, spiky or path to profile script\n");
+    fprintf(stderr, "    -r        Loop profile every N seconds\n");
+    fprintf(stderr, "    -L        Latency (ms)        \\\n");
+    fprintf(stderr, "    -J        Jitter (ms)          | override the first phase\n");
+    fprintf(stderr, "    -B        Bandwidth (bytes/s)  |\n");
+    fprintf(stderr, "    -R        Reset probability   /\n");
+    exit(status);
+}
+
+/* Profiles */
+
+static const struct {
+    const char *name;
+    const char *script;
+} Profiles[] = {
+    {"clean",   "0 latency=0 jitter=0 bandwidth=0 reset=0 stall=0\n"},
+    {"wan",     "0 latency=40 jitter=10 bandwidth=1250000\n"},
+    {"lossy",   "0 latency=80 jitter=40 bandwidth=250000 reset=0.002\n"},
+    {"flaky",   "0 latency=40 jitter=10\n"
+                "10 stall=1\n"
+                "12 stall=0 reset=0.05\n"
+                "15 reset=0\n"},
+    {"spiky",   "0 latency=1 jitter=1 spike=0.002 spike_delay=100\n"},
+    {NULL, NULL},
+};
+
+/**
+ * Parse one phase line ("<start> key=value ...") into phase, inheriting
+ * unspecified settings from the previous phase.
+ **/
+bool profile_parse_line(char *line, const Phase *previous, Phase *phase) {
+    char *saveptr = NULL;
+    char *token   = strtok_r(line, " \t\n", &saveptr);
+    if (!token || token[0] == '#') {
+        return false;
+    }
+
+    *phase = previous ? *previous : (Phase){0, {0}};
+    phase->start = strtod(token, NULL);
+
+    while ((token = strtok_r(NULL, " \t\n", &saveptr))) {
+        char *value = strchr(token, '=');
+        if (!value) {
+            error("Invalid setting: %s", token);
+            exit(EXIT_FAILURE);
+        }
+        *value++ = 0;
+
+        if (streq(token, "latency")) {
+            phase->impairment.latency = strtod(value, NULL);
+        } else if (streq(token, "jitter")) {
+            phase->impairment.jitter = strtod(value, NULL);
+        } else if (streq(token, "bandwidth")) {
+            phase->impairment.bandwidth = strtod(value, NULL);
+        } else if (streq(token, "reset")) {
+            phase->impairment.reset = strtod(value, NULL);
+        } else if (streq(token, "spike")) {
+            phase->impairment.spike = strtod(value, NULL);
+        } else if (streq(token, "spike_delay")) {
+            phase->impairment.spike_delay = strtod(value, NULL);
+        } else if (streq(token, "stall")) {
+            phase->impairment.stall = strtol(value, NULL, 10) != 0;
+        } else {
+            error("Unknown setting: %s", token);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Load profile from built-in name or script file.
+ **/
+void profile_load(const char *name) {
+    char  *script = NULL;
+    size_t size   = 0;
+
+    for (size_t i = 0; Profiles[i].name; i++) {
+        if (streq(Profiles[i].name, name)) {
+            script = strdup(Profiles[i].script);
+            size   = strlen(script);
+        }
+    }
+
+    if (!script) {
+        FILE *fs = fopen(name, "r");
+        if (!fs) {
+            error("Unable to open profile %s: %s", name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        FILE *ms = open_memstream(&script, &size);
+        char buffer[BUFSIZ];
+        while (fgets(buffer, sizeof(buffer), fs)) {
+            fputs(buffer, ms);
+        }
+        fclose(ms);
+        fclose(fs);
+    }
+
+    NPhases = 0;
+    char *saveptr = NULL;
+    for (char *line = strtok_r(script, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        Phase phase;
+        if (NPhases == MAX_PHASES) {
+            error("Too many phases in profile %s", name);
+            exit(EXIT_FAILURE);
+        }
+        if (profile_parse_line(line, NPhases ? &Profile[NPhases - 1] : NULL, &phase)) {
+            Profile[NPhases++] = phase;
+        }
+    }
+    free(script);
+
+    if (NPhases == 0) {
+        NPhases = 1;
+        Profile[0] = (Phase){0, {0}};
+    }
+}
+
+/**
+ * Return impairment of current phase.
+ **/
+Impairment profile_current() {
+    double elapsed = (monotonic_ns() - Started) / 1e9;
+    if (Period > 0) {
+        elapsed = fmod(elapsed, Period);
+    }
+
+    size_t p = 0;
+    while (p + 1 < NPhases && Profile[p + 1].start <= elapsed) {
+        p++;
+    }
+    return Profile[p].impairment;
+}
+
+/* Links */
+
+/**
+ * Abort link: make both sockets send RST and wake up all threads.
+ **/
+void link_abort(Link *link) {
+    if (atomic_exchange(&link->aborted, true)) {
+        return;
+    }
+
+    struct linger linger = {1, 0};
+    setsockopt(link->client,   SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    setsockopt(link->upstream, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    shutdown(link->client,   SHUT_RDWR);
+    shutdown(link->upstream, SHUT_RDWR);
+
+    Pipe *pipes[] = {&link->up, &link->down};
+    for (size_t i = 0; i < 2; i++) {
+        mutex_lock(&pipes[i]->lock);
+        pipes[i]->closed = true;
+        PTHREAD_CHECK(pthread_cond_broadcast(&pipes[i]->cond));
+        mutex_unlock(&pipes[i]->lock);
+    }
+}
+
+/**
+ * Release one thread's reference to link (last thread closes and frees it).
+ **/
+void link_release(Link *link) {
+    if (atomic_fetch_sub(&link->threads, 1) != 1) {
+        return;
+    }
+
+    info("Link closed: %zu bytes up, %zu bytes down%s",
+        link->up.bytes, link->down.bytes, link->aborted ? " (reset)" : "");
+
+    Pipe *pipes[] = {&link->up, &link->down};
+    for (size_t i = 0; i < 2; i++) {
+        while (pipes[i]->head) {
+            Chunk *c = pipes[i]->head;
+            pipes[i]->head = c->next;
+            free(c);
+        }
+    }
+
+    close(link->client);
+    close(link->upstream);
+    free(link);
+}
+
+/* Threads */
+
+void *pipe_reader(void *arg) {
+    Pipe *pipe = (Pipe *)arg;
+
+    while (true) {
+        Chunk *c = malloc(sizeof(Chunk) + CHUNK_SIZE);
+        if (!c) {
+            link_abort(pipe->link);
+            break;
+        }
+
+        ssize_t n = read(pipe->src, c->data, CHUNK_SIZE);
+        if (n <= 0) {
+            free(c);
+            break;
+        }
+
+        Impairment imp = profile_current();
+        double delay   = imp.latency + imp.jitter * ((double)rand_r(&pipe->seed) / RAND_MAX);
+        if (imp.spike > 0 && (double)rand_r(&pipe->seed) / RAND_MAX < imp.spike) {
+            delay += imp.spike_delay;
+        }
+
+        c->size    = n;
+        c->next    = NULL;
+        c->release = monotonic_ns() + (uint64_t)(delay * 1e6);
+
+        mutex_lock(&pipe->lock);
+        if (c->release < pipe->last) {      // Jitter must not reorder a stream
+            c->release = pipe->last;
+        }
+        pipe->last = c->release;
+
+        if (pipe->tail) {
+            pipe->tail->next = c;
+        } else {
+            pipe->head = c;
+        }
+        pipe->tail = c;
+        PTHREAD_CHECK(pthread_cond_broadcast(&pipe->cond));
+        mutex_unlock(&pipe->lock);
+    }
+
+    mutex_lock(&pipe->lock);
+    pipe->closed = true;
+    PTHREAD_CHECK(pthread_cond_broadcast(&pipe->cond));
+    mutex_unlock(&pipe->lock);
+
+    link_release(pipe->link);
+    return NULL;
+}
+
+void *pipe_writer(void *arg) {
+    Pipe *pipe = (Pipe *)arg;
+
+    while (true) {
+        mutex_lock(&pipe->lock);
+        while (!pipe->head && !pipe->closed) {
+            cond_wait(&pipe->cond, &pipe->lock);
+        }
+
+        Chunk *c = pipe->head;
+        if (!c || atomic_load(&pipe->link->aborted)) {
+            mutex_unlock(&pipe->lock);
+            break;
+        }
+        pipe->head = c->next;
+        if (!pipe->head) {
+            pipe->tail = NULL;
+        }
+        mutex_unlock(&pipe->lock);
+
+        // Wait until chunk is due and no stall is in effect
+        Impairment imp;
+        uint64_t   now;
+        while ((imp = profile_current()).stall || (now = monotonic_ns()) < c->release) {
+            uint64_t wait = imp.stall ? 10000000 : c->release - now;
+            struct timespec ts = {wait / 1000000000, wait % 1000000000};
+            nanosleep(&ts, NULL);
+        }
+
+        if (imp.reset > 0 && (double)rand_r(&pipe->seed) / RAND_MAX < imp.reset) {
+            info("Injecting reset on %s", pipe->label);
+            free(c);
+            link_abort(pipe->link);
+            break;
+        }
+
+        size_t offset = 0;
+        while (offset < c->size) {
+            ssize_t n = write(pipe->dst, c->data + offset, c->size - offset);
+            if (n <= 0) {
+                break;
+            }
+            offset += n;
+        }
+        pipe->bytes += offset;
+
+        if (offset < c->size) {
+            free(c);
+            link_abort(pipe->link);
+            break;
+        }
+
+        if (imp.bandwidth > 0) {
+            double seconds = c->size / imp.bandwidth;
+            struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+            nanosleep(&ts, NULL);
+        }
+        free(c);
+    }
+
+    shutdown(pipe->dst, SHUT_WR);
+    link_release(pipe->link);
+    return NULL;
+}
+
+/* Functions */
+
+int socket_listen(const char *port) {
+    struct addrinfo  hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+    struct addrinfo *results;
+    int status;
+
+    if ((status = getaddrinfo(NULL, port, &hints, &results)) != 0) {
+        error("getaddrinfo failed: %s", gai_strerror(status));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *p = results; p && fd < 0; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(results);
+    return fd;
+}
+
+int socket_dial(const char *host, const char *port) {
+    struct addrinfo  hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *results;
+    int status;
+
+    if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
+        error("getaddrinfo failed: %s", gai_strerror(status));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *p = results; p && fd < 0; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(results);
+    return fd;
+}
+
+void pipe_init(Pipe *pipe, Link *link, int src, int dst, const char *label) {
+    memset(pipe, 0, sizeof(Pipe));
+    pipe->src   = src;
+    pipe->dst   = dst;
+    pipe->label = label;
+    pipe->link  = link;
+    pipe->seed  = (unsigned)monotonic_ns() ^ (unsigned)(uintptr_t)pipe;
+    mutex_init(&pipe->lock, NULL);
+    cond_init(&pipe->cond, NULL);
+}
+
+void link_start(int client) {
+    int upstream = socket_dial(Host, Port);
+    if (upstream < 0) {
+        error("Unable to connect to %s:%s", Host, Port);
+        close(client);
+        return;
+    }
+
+    int on = 1;
+    setsockopt(client,   IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    Link *link = calloc(1, sizeof(Link));
+    if (!link) {
+        close(client);
+        close(upstream);
+        return;
+    }
+
+    link->client   = client;
+    link->upstream = upstream;
+    atomic_init(&link->threads, 4);
+    atomic_init(&link->aborted, false);
+    pipe_init(&link->up,   link, client, upstream, "client->server");
+    pipe_init(&link->down, link, upstream, client, "server->client");
+    info("Link %lu opened", atomic_fetch_add(&NLinks, 1) + 1);
+
+    Thread thread;
+    void *(*functions[])(void *) = {pipe_reader, pipe_writer, pipe_reader, pipe_writer};
+    Pipe *pipes[]                = {&link->up, &link->up, &link->down, &link->down};
+    for (size_t i = 0; i < 4; i++) {
+        thread_create(&thread, NULL, functions[i], pipes[i]);
+        thread_detach(thread);
+    }
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    double latency = -1, jitter = -1, bandwidth = -1, reset = -1;
+
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (argind == argc) {
+            usage(EXIT_FAILURE);
+        } else if (streq(arg, "-l")) {
+            ListenPort = argv[argind++];
+        } else if (streq(arg, "-s")) {
+            Host = argv[argind++];
+        } else if (streq(arg, "-p")) {
+            Port = argv[argind++];
+        } else if (streq(arg, "-P")) {
+            profile_load(argv[argind++]);
+        } else if (streq(arg, "-r")) {
+            Period = strtod(argv[argind++], NULL);
+        } else if (streq(arg, "-L")) {
+            latency = strtod(argv[argind++], NULL);
+        } else if (streq(arg, "-J")) {
+            jitter = strtod(argv[argind++], NULL);
+        } else if (streq(arg, "-B")) {
+            bandwidth = strtod(argv[argind++], NULL);
+        } else if (streq(arg, "-R")) {
+            reset = strtod(argv[argind++], NULL);
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (latency   >= 0) Profile[0].impairment.latency   = latency;
+    if (jitter    >= 0) Profile[0].impairment.jitter    = jitter;
+    if (bandwidth >= 0) Profile[0].impairment.bandwidth = bandwidth;
+    if (reset     >= 0) Profile[0].impairment.reset     = reset;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int server = socket_listen(ListenPort);
+    if (server < 0) {
+        error("Unable to listen on port %s: %s", ListenPort, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    info("Proxying :%s -> %s:%s (%zu phase%s%s)", ListenPort, Host, Port,
+        NPhases, NPhases == 1 ? "" : "s", Period > 0 ? ", looping" : "");
+    Started = monotonic_ns();
+
+    while (true) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("accept failed: %s", strerror(errno));
+            break;
+        }
+        link_start(client);
+    }
+
+    close(server);
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,157 @@
+/* perf.c: Hardware performance counters (perf_event_open) */
+
+#include "smq/perf.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+
+/* Internal Constants */
+
+static const struct {
+    const char *name;
+    uint32_t    type;
+    uint64_t    config;
+} PerfEvents[PERF_NCOUNTERS] = {
+    [PERF_CYCLES]           = {"cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS]     = {"instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_CACHE_MISSES]     = {"cache-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_CONTEXT_SWITCHES] = {"ctx-switches",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+/* Internal Functions */
+
+/**
+ * Open one counter for the calling process (and any threads it creates).
+ *
+ * If the kernel refuses to count kernel-mode events (perf_event_paranoid),
+ * then retry with user-mode only counting.
+ *
+ * @param   type        perf_event type.
+ * @param   config      perf_event config.
+ * @return  File descriptor of counter (-1 if unavailable).
+ **/
+static int perf_open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size        = sizeof(attr);
+    attr.type        = type;
+    attr.config      = config;
+    attr.disabled    = 1;
+    attr.inherit     = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return fd;
+}
+
+/* Functions */
+
+/**
+ * Open performance counters.
+ *
+ * Counters that are not supported or not permitted are simply marked as
+ * unavailable, so callers can always use the structure.
+ *
+ * @param   p           PerfCounters structure.
+ * @return  Whether or not at least one counter is available.
+ **/
+bool perf_open(PerfCounters *p) {
+    bool any = false;
+
+    for (int c = 0; c < PERF_NCOUNTERS; c++) {
+        p->fds[c]    = perf_open_counter(PerfEvents[c].type, PerfEvents[c].config);
+        p->values[c] = 0;
+        if (p->fds[c] >= 0) {
+            any = true;
+        } else {
+            debug("Unable to open %s counter: %s", PerfEvents[c].name, strerror(errno));
+        }
+    }
+
+    return any;
+}
+
+/**
+ * Close performance counters.
+ * @param   p           PerfCounters structure.
+ **/
+void perf_close(PerfCounters *p) {
+    for (int c = 0; c < PERF_NCOUNTERS; c++) {
+        if (p->fds[c] >= 0) {
+            close(p->fds[c]);
+            p->fds[c] = -1;
+        }
+    }
+}
+
+/**
+ * Reset and enable performance counters.
+ * @param   p           PerfCounters structure.
+ **/
+void perf_start(PerfCounters *p) {
+    for (int c = 0; c < PERF_NCOUNTERS; c++) {
+        if (p->fds[c] >= 0) {
+            ioctl(p->fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(p->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/**
+ * Disable performance counters and read their values.
+ *
+ * Values are scaled by enabled / running time in case the kernel had to
+ * multiplex counters.
+ *
+ * @param   p           PerfCounters structure.
+ **/
+void perf_stop(PerfCounters *p) {
+    for (int c = 0; c < PERF_NCOUNTERS; c++) {
+        p->values[c] = 0;
+        if (p->fds[c] < 0) {
+            continue;
+        }
+
+        ioctl(p->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+
+        uint64_t data[3];   // value, time_enabled, time_running
+        if (read(p->fds[c], data, sizeof(data)) != sizeof(data)) {
+            continue;
+        }
+
+        if (data[2] && data[2] < data[1]) {
+            p->values[c] = (uint64_t)((double)data[0] * data[1] / data[2]);
+        } else {
+            p->values[c] = data[0];
+        }
+    }
+}
+
+/**
+ * Returns whether or not counter is available.
+ * @param   p           PerfCounters structure.
+ * @param   c           Counter.
+ **/
+bool perf_available(const PerfCounters *p, PerfCounter c) {
+    return p->fds[c] >= 0;
+}
+
+/**
+ * Returns name of counter.
+ * @param   c           Counter.
+ **/
+const char *perf_name(PerfCounter c) {
+    return PerfEvents[c].name;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
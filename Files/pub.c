@@ -0,0 +1,308 @@
+/* pub.c
+ * smq-pub: Publish records read from standard input or files to a topic.
+ *
+ * Input is read in large blocks and split into records in place: one per
+ * line, or, with -l, each preceded by its length as a 4-byte big-endian
+ * integer (so records may contain newlines).  Records are published in
+ * batches (see smq_publish_batch), one request per batch, as fast as they are
+ * read; at most a window of requests may be queued or in flight, so memory
+ * stays bounded however long the input.
+ *
+ * Empty records (blank lines) are published as empty messages, which the
+ * broker keeps and delivers like any other.  Records containing NUL bytes are
+ * skipped and counted.  A record longer than the maximum (-m) ends the file
+ * with an error, so a corrupt length prefix cannot grow the buffer unbounded.
+ *
+ * At exit, outstanding publishes are given time to drain and throughput is
+ * reported on standard error.
+ **/
+
+#include "smq/client.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BLOCK       (1<<20)     // Bytes read at a time (and initial buffer size)
+#define HEADER      4           // Bytes of length prefix (-l)
+#define BATCH_BYTES (256<<10)   // Bytes of records per batch (at most)
+#define MAX_RECORD  (4<<20)     // Default bytes per record (at most)
+
+/* Globals */
+
+char   *Host      = "localhost";
+char   *Port      = "9620";
+char   *Name      = NULL;       // Queue name (default: pub-PID)
+char   *Topic     = NULL;
+bool    Lengths   = false;      // Records are length-prefixed instead of lines
+size_t  BatchSize = 64;         // Records per batch (at most)
+size_t  MaxRecord = MAX_RECORD; // Bytes per record (at most)
+size_t  Window    = 256;        // Maximum requests queued or in flight
+double  Drain     = 10.0;       // Seconds to wait for outstanding publishes
+
+size_t  Records   = 0;          // Records published
+size_t  Bytes     = 0;          // Bytes of records published
+size_t  Skipped   = 0;          // Records containing NUL bytes (not published)
+
+const char **Batch  = NULL;     // Records of current batch (NUL-terminated in input buffer)
+size_t  Batched   = 0;          // Records in current batch
+size_t  BatchLength = 0;        // Bytes in current batch
+
+void usage(int status) {
+    fprintf(stderr, "Usage: ./smq-pub [options] topic [file ...]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -s        host (default: %s)\n", Host);
+    fprintf(stderr, "    -p        port (default: %s)\n", Port);
+    fprintf(stderr, "    -n        Queue name (default: pub-PID)\n");
+    fprintf(stderr, "    -l        Records are length-prefixed (4-byte big-endian) instead of lines\n");
+    fprintf(stderr, "    -B        Records per batch (default: %zu, 1 = no batching)\n", BatchSize);
+    fprintf(stderr, "    -m        Maximum bytes per record (default: %zu)\n", MaxRecord);
+    fprintf(stderr, "    -w        Maximum requests queued or in flight (default: %zu)\n", Window);
+    fprintf(stderr, "    -t        Seconds to wait for outstanding publishes (default: %.0f)\n", Drain);
+    fprintf(stderr, "With no file, or when file is -, read standard input.\n");
+    exit(status);
+}
+
+/* Functions */
+
+/**
+ * Publish current batch, waiting for room in the window first.
+ **/
+void publish_batch(SMQ *smq) {
+    if (!Batched) {
+        return;
+    }
+
+    smq_wait_pending(smq, Window, -1);
+    smq_publish_batch(smq, Topic, Batch, Batched);
+    Records    += Batched;
+    Bytes      += BatchLength;
+    Batched     = 0;
+    BatchLength = 0;
+}
+
+/**
+ * Add record (NUL-terminated at data[length]) to current batch, publishing
+ * the batch once full.
+ **/
+void publish_record(SMQ *smq, const char *data, size_t length) {
+    if (memchr(data, 0, length)) {
+        Skipped++;
+        return;
+    }
+
+    Batch[Batched++] = data;
+    BatchLength     += length;
+    if (Batched == BatchSize || BatchLength >= BATCH_BYTES) {
+        publish_batch(smq);
+    }
+}
+
+/**
+ * Publish the complete records at the start of buffer (records are
+ * terminated in place, so the batch is published before returning).
+ * @return  Number of bytes used (the rest is a partial record, or a record
+ *          longer than MaxRecord if oversized is set).
+ **/
+size_t publish_records(SMQ *smq, char *buffer, size_t length, bool eof, bool *oversized) {
+    size_t used = 0;
+
+    while (used < length) {
+        char  *record = buffer + used;
+        size_t left   = length - used;
+        size_t size;
+
+        if (Lengths) {
+            if (left < HEADER) {
+                break;
+            }
+            unsigned char *header = (unsigned char *)record;
+            size = (size_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+            if (size > MaxRecord) {
+                *oversized = true;
+                break;
+            }
+            if (left - HEADER < size) {
+                break;
+            }
+            // Move record over its header to make room for the terminator
+            memmove(record, record + HEADER, size);
+            used += HEADER + size;
+        } else {
+            char *newline = memchr(record, '\n', min(left - 1, MaxRecord) + 1);
+            size = newline ? (size_t)(newline - record) : left;
+            if (size > MaxRecord) {
+                *oversized = true;
+                break;
+            }
+            if (!newline && !eof) {
+                break;
+            }
+            used += newline ? size + 1 : size;
+        }
+
+        // Terminate record in place (over its newline, within its header,
+        // or in the spare byte past the data)
+        record[size] = 0;
+        publish_record(smq, record, size);
+    }
+    publish_batch(smq);
+    return used;
+}
+
+/**
+ * Publish all records of file (NULL or "-" = standard input).
+ * @return  Whether the whole file was read.
+ **/
+bool publish_file(SMQ *smq, const char *path) {
+    int fd = STDIN_FILENO;
+    if (path && !streq(path, "-") && (fd = open(path, O_RDONLY)) < 0) {
+        error("Unable to open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    size_t capacity = BLOCK;
+    size_t length   = 0;
+    char  *buffer   = malloc(capacity + 1);     // Spare byte to terminate last record
+    bool   success  = buffer != NULL;
+
+    while (success && smq_running(smq)) {
+        // Grow for records longer than the buffer
+        if (capacity - length < BLOCK / 2) {
+            char *grown = realloc(buffer, 2 * capacity + 1);
+            if (!grown) {
+                success = false;
+                break;
+            }
+            buffer    = grown;
+            capacity *= 2;
+        }
+
+        ssize_t nread = read(fd, buffer + length, capacity - length);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0) {
+            error("Unable to read %s: %s", path ? path : "-", strerror(errno));
+            success = false;
+            break;
+        }
+        length += nread;
+
+        bool   oversized = false;
+        size_t used      = publish_records(smq, buffer, length, nread == 0, &oversized);
+        memmove(buffer, buffer + used, length - used);
+        length -= used;
+
+        if (oversized) {
+            error("Record too large in %s (more than %zu bytes, see -m)", path ? path : "-", MaxRecord);
+            success = false;
+            break;
+        }
+
+        if (nread == 0) {
+            if (length) {
+                error("Truncated record at end of %s (%zu bytes)", path ? path : "-", length);
+                success = false;
+            }
+            break;
+        }
+    }
+
+    free(buffer);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return success;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (streq(arg, "-l")) {
+            Lengths = true;
+        } else if (argind == argc) {
+            usage(EXIT_FAILURE);
+        } else if (streq(arg, "-s")) {
+            Host = argv[argind++];
+        } else if (streq(arg, "-p")) {
+            Port = argv[argind++];
+        } else if (streq(arg, "-n")) {
+            Name = argv[argind++];
+        } else if (streq(arg, "-B")) {
+            BatchSize = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-m")) {
+            MaxRecord = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-w")) {
+            Window = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-t")) {
+            Drain = strtod(argv[argind++], NULL);
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (argind == argc || Window == 0 || BatchSize == 0) {
+        usage(EXIT_FAILURE);
+    }
+    Topic = argv[argind++];
+
+    if (!(Batch = calloc(BatchSize, sizeof(char *)))) {
+        return EXIT_FAILURE;
+    }
+
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "pub-%d", getpid());
+
+    SMQ *smq = smq_create(Name ? Name : name, Host, Port);
+    if (!smq) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t started = monotonic_ns();
+    bool     success = true;
+    if (argind == argc) {
+        success = publish_file(smq, NULL);
+    }
+    for (; argind < argc; argind++) {
+        success = publish_file(smq, argv[argind]) && success;
+    }
+    uint64_t consumed = monotonic_ns();
+
+    size_t   undelivered = smq_shutdown_drain(smq, (time_t)(Drain * 1000));
+    uint64_t finished    = monotonic_ns();
+
+    SMQStats stats;
+    smq_stats(smq, &stats);
+    smq_delete(smq);
+    free(Batch);
+
+    /* Report */
+    double elapsed = (finished - started) / 1e9;
+    fprintf(stderr, "published   %zu records (%zu bytes) in %.3f s (read in %.3f s)\n",
+        Records, Bytes, elapsed, (consumed - started) / 1e9);
+    fprintf(stderr, "throughput  %.1f records/s  %.2f MB/s\n",
+        Records / elapsed, Bytes / elapsed / 1e6);
+    fprintf(stderr, "failed      %zu undelivered  %lu dead letters  %lu retries\n",
+        undelivered, (unsigned long)stats.counters[STATS_DEAD_LETTERS], (unsigned long)stats.counters[STATS_RETRIES]);
+    if (Skipped) {
+        fprintf(stderr, "skipped     %zu records containing NUL bytes\n", Skipped);
+    }
+
+    return success && !undelivered && !stats.counters[STATS_DEAD_LETTERS] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
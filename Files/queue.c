@@ -1,6 +1,7 @@
 /* queue.c: Concurrent Queue of Requests */
 
 #include "smq/queue.h"
+#include "smq/alloc.h"
 #include "smq/utils.h"
 #include <time.h>
 
@@ -9,10 +10,10 @@
  * @return  Newly allocated queue structure.
  **/
 Queue * queue_create() {
-    Queue *q = calloc(1, sizeof(Queue));
+    Queue *q = smq_calloc(1, sizeof(Queue));
     // Continue only if the queue was created successfully
     if (q) {
-        q->running = true;
+        atomic_init(&q->state, QUEUE_RUNNING);
         q->size = 0;
         q->head = NULL;
         q->tail = NULL;
@@ -26,6 +27,22 @@ Queue * queue_create() {
     return NULL;
 }
 
+/**
+ * Create queue structure whose requests are stored in a segmented arena (see
+ * queue_request).
+ * @param   segment     Arena segment size (bytes, 0 = ARENA_SEGMENT_SIZE).
+ * @param   huge        Whether to back segments with huge pages.
+ * @return  Newly allocated queue structure.
+ **/
+Queue * queue_create_arena(size_t segment, bool huge) {
+    Queue *q = queue_create();
+    if (q && !(q->arena = arena_create(segment, huge))) {
+        queue_delete(q);
+        return NULL;
+    }
+    return q;
+}
+
 /**
  * Delete queue structure.
  * @param   q       Queue structure.
@@ -33,7 +50,7 @@ Queue * queue_create() {
 void queue_delete(Queue *q) {
     if (q) {
         mutex_lock(&q->lock);
-        q->running = false;
+        atomic_store(&q->state, QUEUE_STOPPED);
 
         // Free remaining requests in the queue
         while (q->head) {
@@ -46,38 +63,61 @@ void queue_delete(Queue *q) {
         // Don't destroy mutex or condition variables
         // They will just "disappear" when the program ends
         mutex_unlock(&(q->lock));
-        free(q);
+        arena_delete(q->arena);
+        smq_free(q);
     }
 }
 
 /**
- * Shutdown queue.
+ * Create request to be pushed on queue (in the queue's arena, if any).
  * @param   q       Queue structure.
+ * @param   method  Request method string.
+ * @param   url     Request url string.
+ * @param   body    Request body string.
+ * @return  Newly allocated Request structure.
  **/
-void queue_shutdown(Queue *q) {
-    mutex_lock(&q->lock);
-    if (q) {
-        q->running = false;
+Request * queue_request(Queue *q, const char *method, const char *url, const char *body) {
+    return request_create_in(q->arena, method, url, body);
+}
 
-        mutex_unlock(&q->lock);
+/**
+ * Create request for received message to be pushed on queue.
+ * @param   q       Queue structure.
+ * @param   body    Message data (need not be NUL-terminated).
+ * @param   length  Length of message data.
+ * @return  Newly allocated Request structure.
+ **/
+Request * queue_message(Queue *q, const char *body, size_t length) {
+    return request_create_message(q->arena, body, length);
+}
+
+/**
+ * Shutdown queue: reject further pushes and wake up any waiting consumers.
+ * @param   q       Queue structure.
+ **/
+void queue_shutdown(Queue *q) {
+    if (!q) {
         return;
     }
-    mutex_unlock(&q->lock);
-    return;
 
+    mutex_lock(&q->lock);
+    atomic_store(&q->state, QUEUE_STOPPED);
+    cond_broadcast(&q->produced);
+    mutex_unlock(&q->lock);
 }
 
 /**
  * Push message to the back of queue.
  * @param   q       Queue structure.
  * @param   r       Request structure.
+ * @return  Whether or not the request was queued (caller keeps it if not).
  **/
-void queue_push(Queue *q, Request *r) {
+bool queue_push(Queue *q, Request *r) {
     mutex_lock(&q->lock);
 
-    if (!q->running) {
+    if (atomic_load_explicit(&q->state, memory_order_relaxed) != QUEUE_RUNNING) {
         mutex_unlock(&q->lock);
-        return;
+        return false;
     }
 
     r->next = NULL;
@@ -98,27 +138,31 @@ void queue_push(Queue *q, Request *r) {
 
     mutex_unlock(&q->lock);
 
-    return;
-    
+    return true;
 }
 
 /**
  * Pop message from the front of queue (block until there is something to return).
  * @param   q       Queue structure.
  * @param   timeout How long to wait before re-checking condition (ms).
- * @return  Request structure.
+ * @return  Request structure (NULL on timeout, or if stopped and empty).
  **/
 Request * queue_pop(Queue *q, time_t timeout) {
-    mutex_lock(&q->lock);
     if (!q) {
         return NULL;
     }
+    mutex_lock(&q->lock);
 
     struct timespec ts;
     compute_stoptime(ts, timeout);
 
     // Wait for an item to be produced or for a shutdown, with a timeout
     while (q->size == 0) {
+        if (atomic_load_explicit(&q->state, memory_order_relaxed) == QUEUE_STOPPED) {
+            mutex_unlock(&q->lock);
+            return NULL;
+        }
+
         int ret = pthread_cond_timedwait(&q->produced, &q->lock, &ts);
 
         if (ret == ETIMEDOUT) {
@@ -148,4 +192,16 @@ Request * queue_pop(Queue *q, time_t timeout) {
     return r;  // Return the popped request
 }
 
+/**
+ * Return number of requests in queue.
+ * @param   q       Queue structure.
+ * @return  Number of requests currently in the queue.
+ **/
+size_t queue_size(Queue *q) {
+    mutex_lock(&q->lock);
+    size_t size = q->size;
+    mutex_unlock(&q->lock);
+    return size;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
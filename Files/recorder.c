@@ -0,0 +1,146 @@
+/* recorder.c: Flight recorder (ring of recent client events)
+ *
+ * Each recorder has one ring per kind of thread (see RecorderRingId), so the
+ * library threads record without contending with each other or with the
+ * application; dumps merge the rings by time.
+ **/
+
+#include "smq/recorder.h"
+#include "smq/alloc.h"
+#include "smq/deadletter.h"
+#include "smq/utils.h"
+
+/* Internal Constants */
+
+static const char *RecorderNames[RECORDER_NTYPES] = {
+    [RECORDER_ENQUEUE]       = "ENQUEUE",
+    [RECORDER_DEQUEUE]       = "DEQUEUE",
+    [RECORDER_REQUEST_START] = "REQUEST_START",
+    [RECORDER_REQUEST_END]   = "REQUEST_END",
+    [RECORDER_RETRY]         = "RETRY",
+    [RECORDER_DEPTH]         = "DEPTH",
+    [RECORDER_DEAD_LETTER]   = "DEAD_LETTER",
+};
+
+static const char *RecorderQueues[] = {"outgoing", "incoming"};
+
+/* Internal Functions */
+
+static int recorder_compare(const void *a, const void *b) {
+    uint64_t x = ((const RecorderSlot *)a)->time;
+    uint64_t y = ((const RecorderSlot *)b)->time;
+    return (x > y) - (x < y);
+}
+
+/* Functions */
+
+/**
+ * Create flight recorder.
+ * @param   capacity    Number of events to keep in each ring (rounded up to
+ *                      power of two).
+ * @return  Newly allocated Recorder structure.
+ **/
+Recorder * recorder_create(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    Recorder *r = smq_aligned_alloc(64, sizeof(Recorder) + RECORDER_NRINGS * size * sizeof(RecorderSlot));
+    if (r) {
+        memset(r, 0, sizeof(Recorder) + RECORDER_NRINGS * size * sizeof(RecorderSlot));
+        r->mask  = size - 1;
+        r->ticks = recorder_clock();
+        r->ns    = monotonic_ns();
+    }
+    return r;
+}
+
+/**
+ * Delete flight recorder.
+ * @param   r           Recorder structure.
+ **/
+void recorder_delete(Recorder *r) {
+    smq_free(r);
+}
+
+/**
+ * Dump recorded events (oldest first, all rings merged) with their age
+ * relative to now.
+ *
+ * Events are stamped once their action is done, so an event may be listed
+ * just after one it caused on another thread (e.g. an incoming ENQUEUE after
+ * the application's DEQUEUE).  Events being overwritten while dumping are
+ * skipped.
+ *
+ * @param   r           Recorder structure.
+ * @param   stream      Stream to write to.
+ **/
+void recorder_dump(Recorder *r, FILE *stream) {
+    uint64_t ticks    = recorder_clock();
+    uint64_t now      = monotonic_ns();
+    double   scale    = ticks > r->ticks && now > r->ns ? (double)(now - r->ns) / (ticks - r->ticks) : 1.0;
+    uint64_t capacity = r->mask + 1;
+
+    RecorderSlot *events = smq_malloc(RECORDER_NRINGS * capacity * sizeof(RecorderSlot));
+    if (!events) {
+        fprintf(stream, "Flight recorder: unable to allocate dump\n");
+        return;
+    }
+
+    // Copy the consistent events of every ring, then order them by time
+    uint64_t total = 0;
+    size_t   count = 0;
+    for (int ring = 0; ring < RECORDER_NRINGS; ring++) {
+        uint64_t next  = atomic_load_explicit(&r->rings[ring].next, memory_order_acquire);
+        uint64_t first = next > capacity ? next - capacity : 0;
+        total += next;
+
+        for (uint64_t seq = first; seq < next; seq++) {
+            RecorderSlot *slot = &r->slots[ring * capacity + (seq & r->mask)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq + 1) {
+                continue;
+            }
+
+            RecorderSlot event = {.time = slot->time, .type = slot->type, .a = slot->a, .b = slot->b};
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq + 1 || event.type >= RECORDER_NTYPES) {
+                continue;
+            }
+            events[count++] = event;
+        }
+    }
+    qsort(events, count, sizeof(RecorderSlot), recorder_compare);
+
+    fprintf(stream, "Flight recorder: %lu events (%zu shown)\n", (unsigned long)total, count);
+    for (size_t i = 0; i < count; i++) {
+        RecorderSlot *event = &events[i];
+        double age = ticks > event->time ? (ticks - event->time) * scale / 1e9 : 0.0;
+        fprintf(stream, "  -%.6fs %-14s", age, RecorderNames[event->type]);
+
+        switch (event->type) {
+            case RECORDER_ENQUEUE:
+            case RECORDER_DEQUEUE:
+            case RECORDER_RETRY:
+                fprintf(stream, " %s", RecorderQueues[event->a & 1]);
+                break;
+            case RECORDER_REQUEST_START:
+                fprintf(stream, " %s", event->a == 'G' ? "GET" : event->a == 'P' ? "PUT" : "DELETE");
+                break;
+            case RECORDER_REQUEST_END:
+                fprintf(stream, " %s %.3fms", event->a ? "ok" : "failed", event->b / 1e6);
+                break;
+            case RECORDER_DEPTH:
+                fprintf(stream, " outgoing=%u incoming=%lu", event->a, (unsigned long)event->b);
+                break;
+            case RECORDER_DEAD_LETTER:
+                fprintf(stream, " %s status=%lu", deadletter_reason_name(event->a), (unsigned long)event->b);
+                break;
+        }
+        fputc('\n', stream);
+    }
+    fflush(stream);
+    smq_free(events);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,354 @@
+/* render.c: Terminal renderer (single writer for shell output)
+ *
+ * Lines and input-line edits from any thread are collected under a lock; one
+ * thread draws them with render_frame, at most once per frame interval.  A
+ * frame writes all pending lines with one writev, followed by the prompt and
+ * input line; when there are no new lines, only the changed tail of the input
+ * line is redrawn.  Lines beyond the per-frame budget are not written but
+ * counted, and the frame ends with a summary ("+3,214 messages") instead.
+ * An optional status line sits between the lines and the input line.
+ *
+ * The prompt and input line are kept to one terminal line (see
+ * render_columns): when the input is too long, only its tail is shown.
+ **/
+
+#include "smq/render.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define RENDER_CLEAR    "\r\033[K"      // Return to column 0 and erase line
+#define RENDER_ERASE    "\033[K"        // Erase to end of line
+#define RENDER_UP       "\033[1A\r\033[K"  // Erase line above (and move there)
+#define RENDER_SAVE     "\0337\033[1A\r\033[K" // Save cursor, then erase line above
+#define RENDER_RESTORE  "\0338"         // Restore cursor
+#define RENDER_NEWLINE  "\n"
+
+/* Internal Functions */
+
+/**
+ * Write all of iov (retrying partial writes and interruptions).
+ **/
+static bool render_writev(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return false;
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base  = (char *)iov->iov_base + written;
+            iov->iov_len  -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Format overflow summary with thousands separators ("+3,214 messages").
+ **/
+static size_t render_summary(char *buffer, size_t size, uint64_t overflow) {
+    char   digits[32];
+    int    n      = snprintf(digits, sizeof(digits), "%lu", (unsigned long)overflow);
+    size_t length = 0;
+
+    buffer[length++] = '+';
+    for (int i = 0; i < n && length < size - 1; i++) {
+        if (i > 0 && (n - i) % 3 == 0) {
+            buffer[length++] = ',';
+        }
+        buffer[length++] = digits[i];
+    }
+    length += snprintf(buffer + length, size - length, " %s\n", overflow == 1 ? "message" : "messages");
+    return min(length, size - 1);
+}
+
+/* Functions */
+
+/**
+ * Create renderer.
+ * @param   fd          Terminal to write to.
+ * @param   prompt      Prompt shown before input line.
+ * @param   fps         Maximum frames per second (0 = RENDER_FPS).
+ * @param   budget      Maximum bytes of lines per frame (0 = RENDER_BUDGET).
+ * @return  Newly allocated Renderer structure (NULL on failure).
+ **/
+Renderer * render_create(int fd, const char *prompt, unsigned fps, size_t budget) {
+    Renderer *r = smq_calloc(1, sizeof(Renderer));
+    if (!r) {
+        return NULL;
+    }
+
+    r->capacity = budget ? budget : RENDER_BUDGET;
+    r->pending  = smq_malloc(r->capacity);
+    r->spare    = smq_malloc(r->capacity);
+    if (!r->pending || !r->spare) {
+        render_delete(r);
+        return NULL;
+    }
+
+    r->fd       = fd;
+    r->interval = 1000000000ULL / (fps ? fps : RENDER_FPS);
+    r->dirty    = true;     // Draw prompt in first frame (see prompted)
+    snprintf(r->prompt, sizeof(r->prompt), "%s", prompt);
+    mutex_init(&r->lock, NULL);
+    return r;
+}
+
+/**
+ * Delete renderer (without drawing what is pending).
+ * @param   r           Renderer structure.
+ **/
+void render_delete(Renderer *r) {
+    if (!r) {
+        return;
+    }
+
+    smq_free(r->pending);
+    smq_free(r->spare);
+    smq_free(r);
+}
+
+/**
+ * Queue one line of output for the next frame (any thread).
+ * @param   r           Renderer structure.
+ * @param   format      printf format of line (without newline).
+ **/
+void render_line(Renderer *r, const char *format, ...) {
+    mutex_lock(&r->lock);
+
+    // Once a line did not fit, later ones are only counted (to keep order)
+    size_t available = r->capacity - r->length;
+    int    n         = -1;
+    if (!r->overflow) {
+        va_list args;
+        va_start(args, format);
+        n = vsnprintf(r->pending + r->length, available, format, args);
+        va_end(args);
+    }
+
+    if (n >= 0 && (size_t)n + 1 < available) {
+        r->length += n;
+        r->pending[r->length++] = '\n';
+    } else {
+        r->overflow++;
+    }
+
+    r->dirty = true;
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Set input line shown after the prompt (any thread).
+ * @param   r           Renderer structure.
+ * @param   input       Input line.
+ * @param   length      Length of input line.
+ **/
+void render_input(Renderer *r, const char *input, size_t length) {
+    mutex_lock(&r->lock);
+    r->input_length = min(length, RENDER_INPUT - 1);
+    memcpy(r->input, input, r->input_length);
+    r->dirty = true;
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Replace prompt shown before the input line (any thread).
+ * @param   r           Renderer structure.
+ * @param   prompt      New prompt.
+ **/
+void render_prompt(Renderer *r, const char *prompt) {
+    mutex_lock(&r->lock);
+    if (!streq(r->prompt, prompt)) {
+        snprintf(r->prompt, sizeof(r->prompt), "%s", prompt);
+        r->reprompt = true;
+        r->dirty    = true;
+    }
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Set status line shown above the prompt (any thread).
+ *
+ * The status line must fit on one terminal line; changing it alone redraws
+ * only that line and leaves the cursor in the input line.
+ *
+ * @param   r           Renderer structure.
+ * @param   status      Status line (NULL or empty = none).
+ **/
+void render_status(Renderer *r, const char *status) {
+    mutex_lock(&r->lock);
+    if (!streq(r->status, status ? status : "")) {
+        snprintf(r->status, sizeof(r->status), "%s", status ? status : "");
+        r->restatus = true;
+        r->dirty    = true;
+    }
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Set terminal width, so the prompt and input line stay on one terminal line
+ * (any thread).
+ * @param   r           Renderer structure.
+ * @param   columns     Terminal width (0 = unknown).
+ **/
+void render_columns(Renderer *r, size_t columns) {
+    mutex_lock(&r->lock);
+    if (r->columns != columns) {
+        r->columns  = columns;
+        r->recolumn = true;
+        r->dirty    = true;
+    }
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Time until the next frame may be drawn.
+ * @param   r           Renderer structure.
+ * @return  Milliseconds until render_frame should be called (0 = now, -1 =
+ *          nothing to draw).
+ **/
+long render_timeout(Renderer *r) {
+    mutex_lock(&r->lock);
+    bool     dirty = r->dirty;
+    uint64_t due   = r->drawn + r->interval;
+    mutex_unlock(&r->lock);
+
+    uint64_t now = monotonic_ns();
+    if (!dirty) {
+        return -1;
+    }
+    return due > now ? (long)((due - now + 999999) / 1000000) : 0;
+}
+
+/**
+ * Draw one frame (writer thread only).
+ * @param   r           Renderer structure.
+ * @return  Whether anything was drawn.
+ **/
+bool render_frame(Renderer *r) {
+    char     input[RENDER_INPUT];
+    size_t   input_length;
+    char     prompt[RENDER_PROMPT];
+    bool     reprompt;
+    char     status[RENDER_STATUS];
+    bool     restatus;
+    size_t   columns;
+    bool     recolumn;
+    size_t   lines;
+    uint64_t overflow;
+
+    // Take pending lines and input line, so others are not held up by the terminal
+    mutex_lock(&r->lock);
+    if (!r->dirty) {
+        mutex_unlock(&r->lock);
+        return false;
+    }
+    char *pending = r->pending;
+    r->pending    = r->spare;
+    r->spare      = pending;
+    lines         = r->length;
+    overflow      = r->overflow;
+    input_length  = r->input_length;
+    memcpy(input, r->input, input_length);
+    memcpy(prompt, r->prompt, sizeof(prompt));
+    reprompt      = r->reprompt;
+    r->reprompt   = false;
+    memcpy(status, r->status, sizeof(status));
+    restatus      = r->restatus;
+    r->restatus   = false;
+    columns       = r->columns;
+    recolumn      = r->recolumn;
+    r->recolumn   = false;
+    r->length     = 0;
+    r->overflow   = 0;
+    r->dirty      = false;
+    r->drawn      = monotonic_ns();
+    mutex_unlock(&r->lock);
+
+    struct iovec iov[10];
+    int          count = 0;
+    char         summary[64];
+    char         move[32];
+    size_t       status_length = strlen(status);
+    size_t       prompt_length = strlen(prompt);
+
+    // Keep prompt and input off the last column, so the terminal does not
+    // wrap them: show only the tail of a long input
+    char *shown = input;
+    if (columns) {
+        prompt_length = min(prompt_length, columns / 2);
+        size_t room   = columns - 1 - prompt_length;
+        if (input_length > room) {
+            shown        = input + input_length - room;
+            input_length = room;
+        }
+    }
+
+    // Adding or removing the status line moves the input line
+    bool full = lines || overflow || reprompt || recolumn || !r->prompted || (restatus && (status_length > 0) != r->status_shown);
+
+    if (full) {
+        // Lines go above the status and input lines: erase them, write
+        // lines, redraw them
+        iov[count++] = (struct iovec){RENDER_CLEAR, sizeof(RENDER_CLEAR) - 1};
+        if (r->status_shown) {
+            iov[count++] = (struct iovec){RENDER_UP, sizeof(RENDER_UP) - 1};
+        }
+        if (lines) {
+            iov[count++] = (struct iovec){r->spare, lines};
+        }
+        if (overflow) {
+            iov[count++] = (struct iovec){summary, render_summary(summary, sizeof(summary), overflow)};
+        }
+        if (status_length) {
+            iov[count++] = (struct iovec){status, status_length};
+            iov[count++] = (struct iovec){RENDER_NEWLINE, sizeof(RENDER_NEWLINE) - 1};
+        }
+        iov[count++] = (struct iovec){prompt, prompt_length};
+        iov[count++] = (struct iovec){shown, input_length};
+        r->status_shown = status_length > 0;
+    } else {
+        // Only status changed: rewrite it without moving the cursor for good
+        if (restatus) {
+            iov[count++] = (struct iovec){RENDER_SAVE, sizeof(RENDER_SAVE) - 1};
+            iov[count++] = (struct iovec){status, status_length};
+            iov[count++] = (struct iovec){RENDER_RESTORE, sizeof(RENDER_RESTORE) - 1};
+        }
+
+        // Only input changed: back up to the first difference and rewrite the rest
+        size_t common = 0;
+        while (common < input_length && common < r->shown_length && shown[common] == r->shown[common]) {
+            common++;
+        }
+        if (r->shown_length > common) {
+            iov[count++] = (struct iovec){move, snprintf(move, sizeof(move), "\033[%zuD", r->shown_length - common)};
+        }
+        if (input_length > common) {
+            iov[count++] = (struct iovec){shown + common, input_length - common};
+        }
+        if (r->shown_length > input_length) {
+            iov[count++] = (struct iovec){RENDER_ERASE, sizeof(RENDER_ERASE) - 1};
+        }
+    }
+
+    memcpy(r->shown, shown, input_length);
+    r->shown_length = input_length;
+    r->prompted     = true;
+    return render_writev(r->fd, iov, count);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
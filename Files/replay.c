@@ -0,0 +1,312 @@
+/* replay.c
+ * smq-replay: Replay a capture (see smq_record) against a broker at the
+ * recorded speed, a multiple of it, or as fast as possible.
+ *
+ * The replay queue subscribes to every topic in the capture, so each
+ * published message comes back to it; latency is measured from smq_publish
+ * to smq_retrieve of the matching body.
+ **/
+
+#include "smq/capture.h"
+#include "smq/client.h"
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Structures */
+
+typedef struct Pending Pending;
+struct Pending {
+    uint64_t    hash;       // Hash of published body
+    uint64_t    sent;       // Monotonic time of smq_publish (ns)
+    Pending    *next;
+};
+
+/* Globals */
+
+char  *Host    = "localhost";
+char  *Port    = "9620";
+double Speed   = 1.0;       // Replay speed multiplier (0 = as fast as possible)
+double Drain   = 10.0;      // Seconds to wait for outstanding messages
+bool   Hedged  = false;     // Hedge slow publishes (see SMQOptions.hedge)
+
+Pending  *Head = NULL;
+Pending  *Tail = NULL;
+Mutex     Lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t *Latencies  = NULL;
+size_t    NLatencies = 0;
+size_t    Published  = 0;
+bool      Publishing = true;
+
+void usage(int status) {
+    fprintf(stderr, "Usage: ./smq-replay [options] capture\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -s        host (default: %s)\n", Host);
+    fprintf(stderr, "    -p        port (default: %s)\n", Port);
+    fprintf(stderr, "    -x        Speed multiplier (default: 1, 0 = maximum)\n");
+    fprintf(stderr, "    -t        Seconds to wait for outstanding messages (default: %.0f)\n", Drain);
+    fprintf(stderr, "    -H        Hedge slow publishes on a second connection\n");
+    exit(status);
+}
+
+/* Functions */
+
+uint64_t hash_body(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double p) {
+    if (NLatencies == 0) {
+        return 0;
+    }
+    size_t index = (size_t)(p * (NLatencies - 1));
+    return Latencies[index] / 1e6;
+}
+
+/* Threads */
+
+void *receiver_thread(void *arg) {
+    SMQ     *smq      = (SMQ *)arg;
+    size_t   capacity = 0;
+    uint64_t deadline = 0;
+
+    while (smq_running(smq)) {
+        mutex_lock(&Lock);
+        bool done = !Publishing && NLatencies == Published;
+        if (!Publishing && !deadline) {
+            deadline = monotonic_ns() + (uint64_t)(Drain * 1e9);
+        }
+        mutex_unlock(&Lock);
+
+        if (done || (deadline && monotonic_ns() > deadline)) {
+            break;
+        }
+
+        char *message = smq_retrieve(smq);
+        if (!message) {
+            continue;
+        }
+
+        uint64_t now  = monotonic_ns();
+        uint64_t hash = hash_body(message);
+        smq_free(message);
+
+        mutex_lock(&Lock);
+        Pending *previous = NULL;
+        for (Pending *p = Head; p; previous = p, p = p->next) {
+            if (p->hash != hash) {
+                continue;
+            }
+
+            if (previous) {
+                previous->next = p->next;
+            } else {
+                Head = p->next;
+            }
+            if (Tail == p) {
+                Tail = previous;
+            }
+
+            if (NLatencies == capacity) {
+                capacity  = capacity ? capacity * 2 : 1024;
+                Latencies = realloc(Latencies, capacity * sizeof(uint64_t));
+            }
+            Latencies[NLatencies++] = now - p->sent;
+            free(p);
+            break;
+        }
+        mutex_unlock(&Lock);
+    }
+
+    return NULL;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (streq(arg, "-H")) {
+            Hedged = true;
+        } else if (argind == argc) {
+            usage(EXIT_FAILURE);
+        } else if (streq(arg, "-s")) {
+            Host = argv[argind++];
+        } else if (streq(arg, "-p")) {
+            Port = argv[argind++];
+        } else if (streq(arg, "-x")) {
+            Speed = strtod(argv[argind++], NULL);
+        } else if (streq(arg, "-t")) {
+            Drain = strtod(argv[argind++], NULL);
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (argind + 1 != argc || Speed < 0) {
+        usage(EXIT_FAILURE);
+    }
+    char *path = argv[argind];
+
+    /* First pass: collect topics and recorded duration */
+    Capture *capture = capture_open(path);
+    if (!capture) {
+        return EXIT_FAILURE;
+    }
+
+    char        **topics   = NULL;
+    size_t        ntopics  = 0;
+    size_t        expected = 0;
+    uint64_t      duration = 0;
+    CaptureRecord record;
+
+    while (capture_next(capture, &record)) {
+        if (record.topic && (record.type == CAPTURE_PUBLISH || record.type == CAPTURE_SUBSCRIBE)) {
+            bool found = false;
+            for (size_t t = 0; t < ntopics && !found; t++) {
+                found = streq(topics[t], record.topic);
+            }
+            if (!found) {
+                topics = realloc(topics, (ntopics + 1) * sizeof(char *));
+                topics[ntopics++] = strdup(record.topic);
+            }
+        }
+        if (record.type == CAPTURE_PUBLISH && record.body) {
+            expected++;
+        }
+        duration = record.timestamp;
+        capture_record_clear(&record);
+    }
+    capture_close(capture);
+
+    if (Speed > 0) {
+        info("Replaying %zu publishes over %zu topics (recorded %.3f s) at %.2fx",
+            expected, ntopics, duration / 1e9, Speed);
+    } else {
+        info("Replaying %zu publishes over %zu topics (recorded %.3f s) at maximum speed",
+            expected, ntopics, duration / 1e9);
+    }
+
+    /* Second pass: publish at recorded pace */
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "replay-%d", getpid());
+
+    SMQOptions options;
+    smq_options_init(&options);
+    options.hedge = Hedged;
+
+    SMQ *smq = smq_create_with(name, Host, Port, &options);
+    if (!smq) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t t = 0; t < ntopics; t++) {
+        smq_subscribe(smq, topics[t]);
+        free(topics[t]);
+    }
+    free(topics);
+
+    Thread receiver;
+    thread_create(&receiver, NULL, receiver_thread, smq);
+
+    capture = capture_open(path);
+    if (!capture) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t started = monotonic_ns();
+    while (capture_next(capture, &record)) {
+        if (record.type != CAPTURE_PUBLISH || !record.body) {
+            capture_record_clear(&record);
+            continue;
+        }
+
+        if (Speed > 0) {
+            uint64_t target = started + (uint64_t)(record.timestamp / Speed);
+            uint64_t now    = monotonic_ns();
+            if (target > now) {
+                struct timespec ts = {(target - now) / 1000000000, (target - now) % 1000000000};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        Pending *p = calloc(1, sizeof(Pending));
+        p->hash = hash_body(record.body);
+        p->sent = monotonic_ns();
+
+        mutex_lock(&Lock);
+        if (Tail) {
+            Tail->next = p;
+        } else {
+            Head = p;
+        }
+        Tail = p;
+        Published++;
+        mutex_unlock(&Lock);
+
+        smq_publish(smq, record.topic, record.body);
+        capture_record_clear(&record);
+    }
+    capture_close(capture);
+
+    uint64_t published = monotonic_ns();
+    mutex_lock(&Lock);
+    Publishing = false;
+    mutex_unlock(&Lock);
+
+    thread_join(receiver, NULL);
+    uint64_t finished = monotonic_ns();
+
+    SMQStats stats;
+    smq_stats(smq, &stats);
+
+    smq_shutdown(smq);
+    smq_delete(smq);
+
+    /* Report */
+    qsort(Latencies, NLatencies, sizeof(uint64_t), compare_latency);
+
+    double elapsed = (finished - started) / 1e9;
+    printf("published   %zu messages in %.3f s (%.1f msg/s offered)\n",
+        Published, (published - started) / 1e9, Published / ((published - started) / 1e9));
+    printf("received    %zu messages in %.3f s (%.1f msg/s achieved)\n",
+        NLatencies, elapsed, NLatencies / elapsed);
+    printf("lost        %zu messages\n", Published - NLatencies);
+    printf("latency ms  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+        percentile(0.50), percentile(0.90), percentile(0.99), percentile(0.999), percentile(1.0));
+    if (Hedged) {
+        printf("hedged      %lu requests (%lu won by the duplicate)\n",
+            (unsigned long)stats.counters[STATS_HEDGES], (unsigned long)stats.counters[STATS_HEDGE_WINS]);
+    }
+
+    while (Head) {
+        Pending *p = Head;
+        Head = p->next;
+        free(p);
+    }
+    free(Latencies);
+    return NLatencies == Published ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,10 +1,14 @@
 /* Request.c: Request structure */
 
+#include "smq/alloc.h"
+#include "smq/connection.h"
 #include "smq/request.h"
 #include "smq/utils.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <curl/curl.h>
 
@@ -36,9 +40,9 @@ size_t  request_writer(char *ptr, size_t size, size_t nmemb, void *userdata) {
     Response *r = (Response *)userdata;
     
     // Reallocate memory for response data
-    char *ptr2 = realloc(r->data, r->size + realsize + 1);
+    char *ptr2 = smq_realloc(r->data, r->size + realsize + 1);
     if(!ptr2) {
-        free(r->data);
+        smq_free(r->data);
         return 0;  /* out of memory! */
     }
     r->data = ptr2;
@@ -82,6 +86,75 @@ size_t  request_reader(char *ptr, size_t size, size_t nmemb, void *userdata) {
     return res;
 }
 
+/**
+ * Writer function: Feed data to frame parser (userdata).
+ **/
+static size_t request_frames(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    return frame_feed((FrameParser *)userdata, ptr, size * nmemb) ? size * nmemb : 0;
+}
+
+/**
+ * Return value of header line if it has the given name (NULL otherwise).
+ **/
+static const char * request_header_value(const char *line, size_t length, const char *header) {
+    size_t name = strlen(header);
+    if (length <= name + 1 || strncasecmp(line, header, name) != 0 || line[name] != ':') {
+        return NULL;
+    }
+
+    const char *value = line + name + 1;
+    while (*value == ' ') {
+        value++;
+    }
+    return value;
+}
+
+/**
+ * Header function: Switch frame parser (userdata) to framed mode if the
+ * response announces it, and note the trace id of a traced message.
+ **/
+static size_t request_header(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    FrameParser *parser = (FrameParser *)userdata;
+    size_t       length = size * nmemb;
+    const char  *value;
+
+    if ((value = request_header_value(ptr, length, FRAME_HEADER))) {
+        parser->framed = strncmp(value, FRAME_HEADER_VALUE, strlen(FRAME_HEADER_VALUE)) == 0;
+    } else if ((value = request_header_value(ptr, length, REQUEST_TRACE_HEADER))) {
+        parser->trace = strtoull(value, NULL, 16);
+    }
+    return length;
+}
+
+/**
+ * Allocate Request with room for strings of given lengths behind it.
+ **/
+static Request * request_pack(Arena *arena, const char *strings[3], const size_t lengths[3]) {
+    size_t total = sizeof(Request);
+    for (int i = 0; i < 3; i++) {
+        total += strings[i] ? lengths[i] + 1 : 0;
+    }
+
+    Request *r = arena_alloc(arena, total);
+    if (!r) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(Request));
+    r->packed = true;
+
+    char  *next     = (char *)(r + 1);
+    char **fields[] = {&r->method, &r->url, &r->body};
+    for (int i = 0; i < 3; i++) {
+        if (strings[i]) {
+            memcpy(next, strings[i], lengths[i]);
+            next[lengths[i]] = 0;
+            *fields[i] = next;
+            next      += lengths[i] + 1;
+        }
+    }
+    return r;
+}
+
 /* Functions */
 
 /**
@@ -92,7 +165,7 @@ size_t  request_reader(char *ptr, size_t size, size_t nmemb, void *userdata) {
  * @return  Newly allocated Request structure.
  **/
 Request * request_create(const char *method, const char *url, const char *body) {
-    Request *r = (Request *)calloc(1, sizeof(Request));
+    Request *r = (Request *)smq_calloc(1, sizeof(Request));
 
     // Check for NULL
     if (!r) {
@@ -101,21 +174,66 @@ Request * request_create(const char *method, const char *url, const char *body)
 
     // Copy method, url, and body if they exist
     if (method) {
-        r->method = strdup(method);
+        r->method = smq_strdup(method);
     }
     
     if (url) {
-        r->url = strdup(url);
+        r->url = smq_strdup(url);
     }
 
     if (body) {
-        r->body = strdup(body);
+        r->body = smq_strdup(body);
     }
 
     return r;
         
 }
 
+/**
+ * Create Request structure with its strings packed behind it in one arena
+ * allocation (the strings must not be replaced or freed individually).
+ * @param   arena       Arena to allocate from (NULL = request_create).
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   body        Request body string.
+ * @return  Newly allocated Request structure.
+ **/
+Request * request_create_in(Arena *arena, const char *method, const char *url, const char *body) {
+    if (!arena) {
+        return request_create(method, url, body);
+    }
+
+    const char *strings[] = {method, url, body};
+    size_t      lengths[3];
+    for (int i = 0; i < 3; i++) {
+        lengths[i] = strings[i] ? strlen(strings[i]) : 0;
+    }
+    return request_pack(arena, strings, lengths);
+}
+
+/**
+ * Create Request structure for a received message (body is a view that is
+ * copied and NUL-terminated).
+ * @param   arena       Arena to allocate from (NULL = heap).
+ * @param   body        Message data.
+ * @param   length      Length of message data.
+ * @return  Newly allocated Request structure.
+ **/
+Request * request_create_message(Arena *arena, const char *body, size_t length) {
+    if (arena) {
+        const char  *strings[] = {NULL, NULL, body};
+        const size_t lengths[] = {0, 0, length};
+        return request_pack(arena, strings, lengths);
+    }
+
+    Request *r = request_create(NULL, NULL, NULL);
+    if (r && (r->body = smq_malloc(length + 1))) {
+        memcpy(r->body, body, length);
+        r->body[length] = 0;
+    }
+    return r;
+}
+
 /**
  * Delete Request structure.
  * @param   r           Request structure.
@@ -126,19 +244,74 @@ void request_delete(Request *r) {
         return;
     }
 
+    smq_free(r->trace);
+    if (r->packed) {
+        arena_release(r);
+        return;
+    }
+
     if (r->method != NULL) {
-        free(r->method);
+        smq_free(r->method);
     }
 
     if (r->url != NULL) {
-        free(r->url);
+        smq_free(r->url);
     }
 
     if (r->body != NULL) {
-        free(r->body);
+        smq_free(r->body);
     }
 
-    free(r);
+    smq_free(r);
+}
+
+/**
+ * Set options common to all requests: URL, timeout, method (with body),
+ * deduplication tag and trace id.
+ * @return  Header list to free once the request is finished (may be NULL).
+ **/
+static struct curl_slist * request_setup(CURL *curl, Request *r, long timeout, Payload *payload) {
+    struct curl_slist *headers = NULL;
+
+    curl_easy_setopt(curl, CURLOPT_URL, r->url);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+
+    if (r->sequence) {
+        char producer[64], sequence[64];
+        snprintf(producer, sizeof(producer), "%s: %016lx", REQUEST_PRODUCER_HEADER, (unsigned long)r->producer);
+        snprintf(sequence, sizeof(sequence), "%s: %lu", REQUEST_SEQUENCE_HEADER, (unsigned long)r->sequence);
+        headers = curl_slist_append(headers, producer);
+        headers = curl_slist_append(headers, sequence);
+    }
+    if (r->trace && !r->trace->incoming) {
+        char trace[64];
+        snprintf(trace, sizeof(trace), "%s: %016lx", REQUEST_TRACE_HEADER, (unsigned long)r->trace->id);
+        headers = curl_slist_append(headers, trace);
+    }
+    if (headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
+
+    if (streq(r->method, "PUT")) {
+        // Perform PUT request
+        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
+        if (r->body == NULL)
+        {
+            curl_easy_setopt(curl, CURLOPT_INFILESIZE, 0);
+        }
+        else
+        {
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, request_reader);
+            curl_easy_setopt(curl, CURLOPT_READDATA, payload);
+            curl_easy_setopt(curl, CURLOPT_INFILESIZE, (curl_off_t)strlen(r->body));
+        }
+
+    } else if (streq(r->method, "DELETE")) {
+        // Perform DELETE request
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    }
+    return headers;
 }
 
 /**
@@ -154,11 +327,13 @@ void request_delete(Request *r) {
  *
  * @param   r           Request structure.
  * @param   timeout     Maximum total HTTP transaction time (in milliseconds).
- * @return  Body of HTTP response (NULL if error or timeout).
+ * @param   c           Connection to reuse (NULL = new connection).
+ * @return  Body of HTTP response (NULL if error or timeout, free with smq_free;
+ *          r->status holds the HTTP status either way).
  **/
-char * request_perform(Request *r, long timeout) {
+char * request_perform(Request *r, long timeout, Connection *c) {
     // Initialize CURL client
-    CURL *curl = curl_easy_init();  // Initialize a curl session
+    CURL *curl = connection_acquire(c);
     
     if (!curl) {
         return NULL;
@@ -168,44 +343,25 @@ char * request_perform(Request *r, long timeout) {
     Response response = {0};
     Payload  payload  = {.data = r->body, .offset = 0};
 
-    char * url = r->url;
-
     // Set CURL options
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+    struct curl_slist *headers = request_setup(curl, r, timeout, &payload);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, request_writer);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
-    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-
-    if (streq(r->method, "PUT")) {
-        // Perform PUT request
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-        if (r->body == NULL)
-        {
-            curl_easy_setopt(curl, CURLOPT_INFILESIZE, 0);
-        }
-        else
-        {
-            curl_easy_setopt(curl, CURLOPT_READFUNCTION, request_reader);
-            curl_easy_setopt(curl, CURLOPT_READDATA, &payload);
-            curl_easy_setopt(curl, CURLOPT_INFILESIZE, (curl_off_t)strlen(r->body));
-        }
-
-    } else if (streq(r->method, "DELETE")) {
-        // Perform DELETE request
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    }
 
     // Perform CURL
-    if (curl_easy_perform(curl) != CURLE_OK) {
+    CURLcode status = curl_easy_perform(curl);
+    r->status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r->status);
+    curl_slist_free_all(headers);
+    if (status != CURLE_OK) {
         // Cleanup CURL
-        curl_easy_cleanup(curl);
-        free(response.data);
+        connection_release(c, curl);
+        smq_free(response.data);
         return NULL;
     }
 
     // Cleanup CURL
-    curl_easy_cleanup(curl);
+    connection_release(c, curl);
 
     // Return response data
     if (response.data == NULL) {
@@ -215,4 +371,140 @@ char * request_perform(Request *r, long timeout) {
     return response.data;
 }
 
+/**
+ * Perform HTTP request, passing the response to a frame parser as it
+ * arrives (each complete message is emitted through the parser's callback).
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Maximum total HTTP transaction time (in milliseconds).
+ * @param   parser      Frame parser (reset before the request).
+ * @param   c           Connection to reuse (NULL = new connection).
+ * @return  Whether or not the request succeeded.
+ **/
+bool request_stream(Request *r, long timeout, FrameParser *parser, Connection *c) {
+    CURL *curl = connection_acquire(c);
+    if (!curl) {
+        return false;
+    }
+
+    Payload payload = {.data = r->body, .offset = 0};
+    frame_reset(parser);
+
+    struct curl_slist *headers = request_setup(curl, r, timeout, &payload);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, request_frames);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, parser);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, request_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, parser);
+
+    // Long-polls are idle until a message arrives; only the timeout applies
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L);
+
+    CURLcode status = curl_easy_perform(curl);
+    r->status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r->status);
+    curl_slist_free_all(headers);
+    connection_release(c, curl);
+
+    if (status != CURLE_OK) {
+        frame_reset(parser);
+        return false;
+    }
+    return frame_finish(parser);
+}
+
+/**
+ * Perform HTTP request, sending a duplicate on the spare connection of the
+ * hedge if the first attempt is slower than the hedge delay (and the budget
+ * allows it).  The first attempt to succeed wins and the other is aborted,
+ * so the request must be safe to repeat (see Request.sequence).
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Maximum total HTTP transaction time of each attempt (in milliseconds).
+ * @param   h           Hedge structure.
+ * @param   outcome     Whether a duplicate was sent and which attempt won.
+ * @return  Body of winning HTTP response (NULL if both failed, free with
+ *          smq_free; r->status holds the HTTP status either way).
+ **/
+char * request_hedge(Request *r, long timeout, Hedge *h, HedgeOutcome *outcome) {
+    Connection        *connections[2] = {h->primary, h->spare};
+    CURL              *handles[2]     = {NULL, NULL};
+    struct curl_slist *headers[2]     = {NULL, NULL};
+    Response           responses[2]   = {{0}};
+    Payload            payloads[2]    = {{r->body, 0}, {r->body, 0}};
+    long               statuses[2]    = {0, 0};
+    int                started        = 0;
+    int                active         = 0;
+    int                winner         = -1;
+    bool               declined       = false;
+    uint64_t           due            = monotonic_ns() + (uint64_t)hedge_delay(h) * 1000000;
+
+    while (true) {
+        // Start the first attempt at once and the duplicate when it is due
+        uint64_t now = monotonic_ns();
+        if (started == 0 || (started == 1 && active == 1 && hedge_delay(h) && !declined && now >= due)) {
+            if (started == 1 && !hedge_take(h)) {
+                declined = true;
+            } else if ((handles[started] = connection_acquire(connections[started]))) {
+                headers[started] = request_setup(handles[started], r, timeout, &payloads[started]);
+                curl_easy_setopt(handles[started], CURLOPT_WRITEFUNCTION, request_writer);
+                curl_easy_setopt(handles[started], CURLOPT_WRITEDATA, &responses[started]);
+                curl_easy_setopt(handles[started], CURLOPT_PRIVATE, (void *)(intptr_t)started);
+                curl_multi_add_handle(h->multi, handles[started]);
+                started++;
+                active++;
+            } else if (started == 0) {
+                return NULL;
+            } else {
+                declined = true;
+            }
+        }
+
+        int running = 0;
+        curl_multi_perform(h->multi, &running);
+
+        CURLMsg *message;
+        int      left;
+        while ((message = curl_multi_info_read(h->multi, &left))) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            char *attempt = NULL;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &attempt);
+            int i = (int)(intptr_t)attempt;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE, &statuses[i]);
+            active--;
+            if (message->data.result == CURLE_OK && winner < 0) {
+                winner = i;
+            }
+        }
+
+        if (winner >= 0 || active == 0) {
+            break;
+        }
+
+        // Sleep until there is activity or the duplicate is due
+        int wait = 1000;
+        if (started == 1 && hedge_delay(h) && !declined) {
+            now  = monotonic_ns();
+            wait = now >= due ? 0 : (int)min((due - now + 999999) / 1000000, 1000);
+        }
+        curl_multi_poll(h->multi, NULL, 0, wait, NULL);
+    }
+
+    // Abort the loser (if still running) and return the winner's response
+    for (int i = 0; i < started; i++) {
+        curl_multi_remove_handle(h->multi, handles[i]);
+        curl_slist_free_all(headers[i]);
+        connection_release(connections[i], handles[i]);
+        if (i != winner) {
+            smq_free(responses[i].data);
+        }
+    }
+
+    r->status = winner >= 0 ? statuses[winner] : (statuses[0] ? statuses[0] : statuses[1]);
+    *outcome  = started < 2 ? HEDGE_NONE : (winner == 1 ? HEDGE_WON : HEDGE_LOST);
+    return winner >= 0 ? responses[winner].data : NULL;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,83 @@
+/* rtt.c: Round-trip time estimator (request timeouts)
+ *
+ * Follows RFC 6298: the timeout is the smoothed round-trip time plus four
+ * times its variation, doubled after each timeout until a new sample is
+ * taken.  Only one thread updates an estimator; others may read it.
+ **/
+
+#include "smq/rtt.h"
+
+/* Internal Functions */
+
+static void rtt_store(atomic_uint_fast64_t *field, uint64_t value) {
+    atomic_store_explicit(field, value, memory_order_relaxed);
+}
+
+static uint64_t rtt_load(atomic_uint_fast64_t *field) {
+    return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+static uint64_t rtt_clamp(RTTEstimator *e, uint64_t rto) {
+    return rto < e->min ? e->min : (rto > e->max ? e->max : rto);
+}
+
+/* Functions */
+
+/**
+ * Initialize estimator.
+ * @param   e           RTTEstimator structure.
+ * @param   initial     Timeout before the first sample (milliseconds).
+ * @param   min         Lower bound of timeout (milliseconds).
+ * @param   max         Upper bound of timeout (milliseconds).
+ **/
+void rtt_init(RTTEstimator *e, long initial, long min, long max) {
+    e->min = (uint64_t)min * 1000000;
+    e->max = (uint64_t)max * 1000000;
+    rtt_store(&e->srtt, 0);
+    rtt_store(&e->rttvar, 0);
+    rtt_store(&e->rto, rtt_clamp(e, (uint64_t)initial * 1000000));
+}
+
+/**
+ * Update estimator with round-trip time of a request that succeeded on its
+ * first attempt (samples of retried requests are ambiguous, see Karn).
+ * @param   e           RTTEstimator structure.
+ * @param   sample      Round-trip time (ns).
+ **/
+void rtt_observe(RTTEstimator *e, uint64_t sample) {
+    uint64_t srtt   = rtt_load(&e->srtt);
+    uint64_t rttvar = rtt_load(&e->rttvar);
+
+    if (srtt == 0) {
+        srtt   = sample;
+        rttvar = sample / 2;
+    } else {
+        uint64_t delta = srtt > sample ? srtt - sample : sample - srtt;
+        rttvar = rttvar - rttvar / 4 + delta / 4;
+        srtt   = srtt - srtt / 8 + sample / 8;
+    }
+
+    uint64_t spread = 4 * rttvar > RTT_GRANULARITY ? 4 * rttvar : RTT_GRANULARITY;
+    rtt_store(&e->srtt, srtt ? srtt : 1);
+    rtt_store(&e->rttvar, rttvar);
+    rtt_store(&e->rto, rtt_clamp(e, srtt + spread));
+}
+
+/**
+ * Double timeout after a request timed out.
+ * @param   e           RTTEstimator structure.
+ **/
+void rtt_backoff(RTTEstimator *e) {
+    rtt_store(&e->rto, rtt_clamp(e, 2 * rtt_load(&e->rto)));
+}
+
+/**
+ * Return current timeout.
+ * @param   e           RTTEstimator structure.
+ * @return  Timeout (milliseconds, rounded up).
+ **/
+long rtt_timeout(RTTEstimator *e) {
+    return (long)((rtt_load(&e->rto) + 999999) / 1000000);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,293 @@
+/* scrollback.c: Bounded message history with incremental search
+ *
+ * Message text is packed back to back in a byte ring; a second ring of
+ * (offset, length) records indexes it by sequence number.  Offsets are
+ * logical (they only grow), a message never wraps around the end of the ring,
+ * and the oldest messages are dropped once either ring is full.
+ *
+ * With a backing file the byte ring is a shared mapping of that file, so the
+ * kernel can write cold history back to disk instead of keeping it in memory
+ * and the capacity may exceed RAM.  The file holds the raw ring (not a
+ * readable transcript), so it must not exist beforehand and is removed when
+ * the scrollback is deleted.
+ *
+ * Searches are incremental: every candidate message remembers the longest
+ * prefix of the query it contains, so typing or deleting a character only
+ * re-examines candidates (and messages that arrived since), never the whole
+ * history.
+ **/
+
+#define _GNU_SOURCE
+
+#include "smq/scrollback.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+/* Internal Functions */
+
+/**
+ * Length of the longest prefix of query (beyond known) contained in text.
+ **/
+static size_t scrollback_depth(const char *text, size_t length, const char *query, size_t known, size_t limit) {
+    size_t depth = known;
+    while (depth < limit && memmem(text, length, query, depth + 1)) {
+        depth++;
+    }
+    return depth;
+}
+
+/**
+ * Add candidate to search (growing the candidate array as needed).
+ **/
+static bool scrollback_candidate(ScrollbackSearch *q, uint64_t sequence, size_t depth) {
+    if (q->count == q->allocated) {
+        size_t allocated = q->allocated ? 2 * q->allocated : 64;
+        ScrollbackCandidate *candidates = smq_realloc(q->candidates, allocated * sizeof(ScrollbackCandidate));
+        if (!candidates) {
+            return false;
+        }
+        q->candidates = candidates;
+        q->allocated  = allocated;
+    }
+    q->candidates[q->count++] = (ScrollbackCandidate){sequence, depth};
+    return true;
+}
+
+/* Functions */
+
+/**
+ * Create scrollback.
+ * @param   capacity    Bytes of message text to keep (0 = SCROLLBACK_CAPACITY).
+ * @param   limit       Number of messages to keep (0 = SCROLLBACK_LIMIT).
+ * @param   path        File backing the text (NULL = memory only); must not
+ *                      exist yet.
+ * @return  Newly allocated Scrollback structure (NULL on failure).
+ **/
+Scrollback * scrollback_create(size_t capacity, size_t limit, const char *path) {
+    Scrollback *s = smq_calloc(1, sizeof(Scrollback));
+    if (!s) {
+        return NULL;
+    }
+
+    s->capacity = capacity ? capacity : SCROLLBACK_CAPACITY;
+    s->limit    = limit ? limit : SCROLLBACK_LIMIT;
+    s->fd       = -1;
+    s->entries  = smq_calloc(s->limit, sizeof(ScrollbackEntry));
+    if (!s->entries) {
+        scrollback_delete(s);
+        return NULL;
+    }
+
+    if (!path) {
+        s->data = smq_malloc(s->capacity);
+    } else if ((s->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+        error("Unable to create backing file %s: %s", path, strerror(errno));
+    } else if (!(s->path = smq_strdup(path)) || ftruncate(s->fd, s->capacity) < 0) {
+        error("Unable to size backing file %s: %s", path, strerror(errno));
+    } else if ((s->data = mmap(NULL, s->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0)) == MAP_FAILED) {
+        error("Unable to map backing file %s: %s", path, strerror(errno));
+        s->data = NULL;
+    }
+
+    if (!s->data) {
+        if (s->fd >= 0 && !s->path) {
+            unlink(path);
+        }
+        scrollback_delete(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Delete scrollback (and remove its backing file).
+ * @param   s           Scrollback structure.
+ **/
+void scrollback_delete(Scrollback *s) {
+    if (!s) {
+        return;
+    }
+
+    if (s->fd >= 0) {
+        if (s->data) {
+            munmap(s->data, s->capacity);
+        }
+        close(s->fd);
+        if (s->path) {
+            unlink(s->path);
+        }
+    } else {
+        smq_free(s->data);
+    }
+    smq_free(s->entries);
+    smq_free(s->path);
+    smq_free(s);
+}
+
+/**
+ * Append message (dropping the oldest ones to make room).
+ * @param   s           Scrollback structure.
+ * @param   text        Message text.
+ * @param   length      Length of message text (truncated to the capacity).
+ * @return  Sequence number of message.
+ **/
+uint64_t scrollback_append(Scrollback *s, const char *text, size_t length) {
+    length = min(length, min(s->capacity, (size_t)UINT32_MAX));
+
+    // Start at the beginning of the ring rather than wrap around its end
+    uint64_t offset   = s->end;
+    size_t   physical = offset % s->capacity;
+    if (physical + length > s->capacity) {
+        offset  += s->capacity - physical;
+        physical = 0;
+    }
+    uint64_t end = offset + length;
+
+    // Drop messages outside the last capacity bytes (whose text would be
+    // overwritten) or whose record would be reused
+    while (s->first < s->next) {
+        ScrollbackEntry *oldest = &s->entries[s->first % s->limit];
+        if (s->next - s->first < s->limit && (end <= s->capacity || oldest->offset >= end - s->capacity)) {
+            break;
+        }
+        s->first++;
+    }
+
+    memcpy(s->data + physical, text, length);
+    s->entries[s->next % s->limit] = (ScrollbackEntry){offset, length};
+    s->end = end;
+    return s->next++;
+}
+
+/**
+ * Look up message.
+ * @param   s           Scrollback structure.
+ * @param   sequence    Sequence number of message.
+ * @param   length      Set to length of message text.
+ * @return  Message text (not NUL-terminated, valid until the next append;
+ *          NULL if the message is no longer kept).
+ **/
+const char * scrollback_get(Scrollback *s, uint64_t sequence, size_t *length) {
+    if (sequence < s->first || sequence >= s->next) {
+        return NULL;
+    }
+
+    ScrollbackEntry *entry = &s->entries[sequence % s->limit];
+    *length = entry->length;
+    return s->data + entry->offset % s->capacity;
+}
+
+/**
+ * Initialize search (with an empty query).
+ * @param   q           ScrollbackSearch structure.
+ **/
+void scrollback_search_init(ScrollbackSearch *q) {
+    memset(q, 0, sizeof(ScrollbackSearch));
+}
+
+/**
+ * Release memory of search.
+ * @param   q           ScrollbackSearch structure.
+ **/
+void scrollback_search_clear(ScrollbackSearch *q) {
+    smq_free(q->candidates);
+    scrollback_search_init(q);
+}
+
+/**
+ * Update search to query and to the messages currently kept.
+ *
+ * Messages that do not contain the first character of the query are never
+ * examined again while it stays the same; the others are examined only when
+ * the query grows past the prefix they are known to contain.
+ *
+ * @param   s           Scrollback structure.
+ * @param   q           ScrollbackSearch structure.
+ * @param   query       Substring to search for.
+ * @param   length      Length of query (truncated to SCROLLBACK_QUERY).
+ * @return  Number of messages containing query.
+ **/
+size_t scrollback_search(Scrollback *s, ScrollbackSearch *q, const char *query, size_t length) {
+    length = min(length, SCROLLBACK_QUERY);
+
+    // Forget candidates that were dropped from the scrollback
+    size_t dropped = 0;
+    while (dropped < q->count && q->candidates[dropped].sequence < s->first) {
+        dropped++;
+    }
+    memmove(q->candidates, q->candidates + dropped, (q->count - dropped) * sizeof(ScrollbackCandidate));
+    q->count -= dropped;
+
+    // Candidates only hold for the same first character
+    size_t common = 0;
+    while (common < length && common < q->length && query[common] == q->query[common]) {
+        common++;
+    }
+    if (common == 0) {
+        q->count   = 0;
+        q->scanned = s->first;
+    }
+    memcpy(q->query, query, length);
+    q->length = length;
+    if (length == 0) {
+        q->matches = 0;
+        return 0;
+    }
+
+    // Examine candidates that contained the longest common prefix
+    q->matches = 0;
+    for (size_t i = 0; i < q->count; i++) {
+        ScrollbackCandidate *candidate = &q->candidates[i];
+        candidate->depth = min(candidate->depth, common);
+        if (candidate->depth == common && common < length) {
+            size_t      size = 0;
+            const char *text = scrollback_get(s, candidate->sequence, &size);
+            candidate->depth = scrollback_depth(text, size, query, common, length);
+        }
+        q->matches += candidate->depth == length;
+    }
+
+    // Examine messages that arrived since the last search
+    for (uint64_t sequence = q->scanned > s->first ? q->scanned : s->first; sequence < s->next; sequence++) {
+        size_t      size = 0;
+        const char *text  = scrollback_get(s, sequence, &size);
+        size_t      depth = scrollback_depth(text, size, query, 0, length);
+        if (depth && scrollback_candidate(q, sequence, depth)) {
+            q->matches += depth == length;
+        }
+    }
+    q->scanned = s->next;
+    return q->matches;
+}
+
+/**
+ * List matches of last search, newest first.
+ * @param   q           ScrollbackSearch structure.
+ * @param   skip        Number of newest matches to skip (for paging).
+ * @param   sequences   Array to fill with sequence numbers.
+ * @param   n           Size of sequences.
+ * @return  Number of sequence numbers filled in.
+ **/
+size_t scrollback_matches(const ScrollbackSearch *q, size_t skip, uint64_t *sequences, size_t n) {
+    size_t filled = 0;
+    for (size_t i = q->count; i > 0 && filled < n && q->length; i--) {
+        if (q->candidates[i - 1].depth != q->length) {
+            continue;
+        }
+        if (skip) {
+            skip--;
+        } else {
+            sequences[filled++] = q->candidates[i - 1].sequence;
+        }
+    }
+    return filled;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
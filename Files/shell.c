@@ -1,44 +1,94 @@
 /* shell.c
- * Demonstration of multiplexing I/O with a background thread also printing.
+ * Demonstration of multiplexing I/O with a single event loop.
+ *
+ * One thread polls the terminal and the SMQ's notification descriptor (see
+ * smq_fd): typed or pasted input is read in bulk, incoming messages are taken
+ * without blocking, and output is drawn at a limited frame rate (see
+ * render.h).
+ *
+ * Received messages are also kept in a bounded scrollback (see scrollback.h):
+ * PageUp and PageDown page through it, Ctrl-R searches it as you type.
+ *
+ * /stats shows the SMQ's rates, latencies, queue depths and retries; with -S
+ * (or /status) a one-line summary of them stays above the input line,
+ * refreshed once per STATUS_INTERVAL.
  **/
 
-#include "smq/thread.h"
 #include "smq/client.h"
+#include "smq/render.h"
+#include "smq/scrollback.h"
 #include "smq/utils.h"
-#include "smq/queue.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
-#include <semaphore.h>
 
+#include <sys/ioctl.h>
 #include <termios.h>
-#include <unistd.h>
 
 /* Constants */
-sem_t Shutdown;
-const size_t NMESSAGES = 1<<16;
 #define BACKSPACE   127
+#define ESCAPE      27
+#define CTRL_R      18
+#define NREADS      1024        // Messages taken per wakeup (keeps input responsive)
+#define NPAGE       256         // Maximum lines per page of scrollback
+#define STATUS_INTERVAL 1000    // Milliseconds between status line refreshes
+#define MESSAGE_POLL    50      // Milliseconds between message checks without smq_fd
 
 char *host = "student12.cse.nd.edu"; // default values
 char *port = "9002";
 char *name = "Tester";
+unsigned fps = RENDER_FPS;
+size_t history = SCROLLBACK_CAPACITY;
+char *backing = NULL;
+bool statusbar = false;
 
 void usage(int status) {
     fprintf(stderr, "Usage: ./shell [options]\n");
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "    -h		   Show help and usage\n");
-	fprintf(stderr, "    -s        host\n");
-	fprintf(stderr, "    -p        port\n");
-	fprintf(stderr, "    -n        name\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -s        host\n");
+    fprintf(stderr, "    -p        port\n");
+    fprintf(stderr, "    -n        name\n");
+    fprintf(stderr, "    -t        transport profile (default, low-latency, bulk, wan)\n");
+    fprintf(stderr, "    -f        maximum frames per second (default: %u)\n", fps);
+    fprintf(stderr, "    -b        scrollback size in bytes (default: %zu)\n", history);
+    fprintf(stderr, "    -T        back scrollback with new file, removed at exit (allows sizes beyond RAM)\n");
+    fprintf(stderr, "    -S        show status line with live statistics\n");
     exit(status);
-
 }
 
+/* Structures */
+
+typedef struct {
+    SMQStats  stats;                // Statistics at time of sample
+    uint64_t  time;                 // Monotonic time of sample (ns)
+} ShellSample;
+
+typedef struct {
+    SMQ      *smq;
+    Renderer *terminal;
+    char      input[RENDER_INPUT];  // Line being typed
+    size_t    length;
+    bool      done;                 // Whether the user asked to quit
+
+    Scrollback      *history;       // Messages received
+    ScrollbackSearch search;        // Current search (Ctrl-R or /search)
+    bool      searching;            // Whether input line edits the search query
+    char      query[SCROLLBACK_QUERY];
+    size_t    query_length;
+    size_t    page;                 // Pages back from the newest shown by PageUp
+
+    bool      status;               // Whether the status line is shown
+    ShellSample status_sample;      // Last status line refresh (for rates)
+    ShellSample stats_sample;       // Last /stats (for rates)
+} Shell;
+
 /* Functions
  * https://viewsourcecode.org/snaptoken/kilo/02.enteringRawMode.html
  */
@@ -48,126 +98,453 @@ void toggle_raw_mode() {
     static bool enabled = false;
 
     if (enabled) {
-    	tcsetattr(STDIN_FILENO, TCSAFLUSH, &OriginalTermios);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &OriginalTermios);
     } else {
-	tcgetattr(STDIN_FILENO, &OriginalTermios);
+        tcgetattr(STDIN_FILENO, &OriginalTermios);
+
+        atexit(toggle_raw_mode);
+
+        struct termios raw = OriginalTermios;
+        raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+        enabled = true;
+    }
+}
+
+/**
+ * Number of lines that fit on the terminal (less header and prompt).
+ **/
+size_t shell_page_size(void) {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_row < 8) {
+        return 22;
+    }
+    return min(size.ws_row - 2, NPAGE);
+}
+
+/**
+ * Width of the terminal (for the status and input lines).
+ **/
+size_t shell_columns(void) {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_col < 20) {
+        return 80;
+    }
+    return min(size.ws_col, RENDER_STATUS);
+}
+
+/**
+ * Sample statistics of the SMQ and compute what changed since the previous
+ * sample (counters and latency buckets), which it then replaces.
+ * @return  Seconds since the previous sample.
+ **/
+double shell_sample(Shell *shell, ShellSample *sample, SMQStats *now, SMQStats *delta) {
+    uint64_t time = monotonic_ns();
+
+    smq_stats(shell->smq, now);
+    *delta = *now;
+    for (int c = 0; c < STATS_NCOUNTERS; c++) {
+        delta->counters[c] -= sample->stats.counters[c];
+    }
+    for (int h = 0; h < STATS_NHISTOGRAMS; h++) {
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            delta->buckets[h][b] -= sample->stats.buckets[h][b];
+        }
+        delta->sums[h] -= sample->stats.sums[h];
+    }
 
-	atexit(toggle_raw_mode);
+    double seconds = (time - sample->time) / 1e9;
+    sample->stats  = *now;
+    sample->time   = time;
+    return seconds > 0 ? seconds : 1e-9;
+}
 
-	struct termios raw = OriginalTermios;
-	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
-	raw.c_cc[VMIN] = 1;
-	raw.c_cc[VTIME] = 0;
+/**
+ * Format latency percentile of push histogram in milliseconds ("-" if no
+ * requests completed).
+ **/
+const char * shell_percentile(const SMQStats *s, double p, char *buffer, size_t size) {
+    double ms = stats_percentile(s, STATS_LATENCY_PUSH, p);
+    if (ms == 0) {
+        return "-";
+    }
+    snprintf(buffer, size, "%.1f", ms);
+    return buffer;
+}
 
-	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
-    enabled = true;
+/**
+ * Refresh the status line (or remove it if the status line is off).
+ **/
+void shell_status(Shell *shell) {
+    if (!shell->status) {
+        render_status(shell->terminal, NULL);
+        return;
     }
+
+    SMQStats now, delta;
+    double   seconds = shell_sample(shell, &shell->status_sample, &now, &delta);
+    char     status[RENDER_STATUS];
+    char     p50[16], p99[16];
+
+    snprintf(status, sizeof(status),
+        "pub %.0f/s recv %.0f/s | rtt %.1f p50 %s p99 %s ms | out %lu in %lu | retry %lu dead %lu",
+        delta.counters[STATS_PUBLISHED] / seconds, delta.counters[STATS_RECEIVED] / seconds, now.srtt / 1e6,
+        shell_percentile(&delta, 0.50, p50, sizeof(p50)), shell_percentile(&delta, 0.99, p99, sizeof(p99)),
+        (unsigned long)now.outgoing, (unsigned long)now.incoming,
+        (unsigned long)now.counters[STATS_RETRIES], (unsigned long)now.counters[STATS_DEAD_LETTERS]);
+
+    // Keep it to one terminal line, so it can be redrawn in place
+    status[shell_columns() - 1] = 0;
+    render_status(shell->terminal, status);
 }
 
-/* Threads */
+/**
+ * Show statistics of the SMQ: since the previous sample and since creation.
+ **/
+void shell_stats(Shell *shell) {
+    SMQStats now, delta;
+    double   seconds = shell_sample(shell, &shell->stats_sample, &now, &delta);
+    char     p50[16], p99[16], total50[16], total99[16];
+
+    render_line(shell->terminal, "--- statistics (rates over last %.1fs) ---", seconds);
+    render_line(shell->terminal, "published  %.1f/s  %lu messages  %lu bytes",
+        delta.counters[STATS_PUBLISHED] / seconds,
+        (unsigned long)now.counters[STATS_PUBLISHED], (unsigned long)now.counters[STATS_PUBLISHED_BYTES]);
+    render_line(shell->terminal, "received   %.1f/s  %lu messages  %lu bytes",
+        delta.counters[STATS_RECEIVED] / seconds,
+        (unsigned long)now.counters[STATS_RECEIVED], (unsigned long)now.counters[STATS_RECEIVED_BYTES]);
+    render_line(shell->terminal, "latency    srtt %.2f ms  rto %.0f ms  push p50 %s p99 %s ms  (total p50 %s p99 %s ms)",
+        now.srtt / 1e6, now.rto / 1e6,
+        shell_percentile(&delta, 0.50, p50, sizeof(p50)), shell_percentile(&delta, 0.99, p99, sizeof(p99)),
+        shell_percentile(&now, 0.50, total50, sizeof(total50)), shell_percentile(&now, 0.99, total99, sizeof(total99)));
+    render_line(shell->terminal, "queues     outgoing %lu  incoming %lu  in flight %lu",
+        (unsigned long)now.outgoing, (unsigned long)now.incoming, (unsigned long)now.in_flight);
+    render_line(shell->terminal, "errors     retries %lu  failures %lu  dead letters %lu",
+        (unsigned long)now.counters[STATS_RETRIES], (unsigned long)now.counters[STATS_FAILURES],
+        (unsigned long)now.counters[STATS_DEAD_LETTERS]);
+}
 
-void *incoming_thread(void *arg) {
-    SMQ *smq = (SMQ *)arg;
-    size_t messages = 0;
+/**
+ * Milliseconds until the next frame or status refresh, whichever is first
+ * (-1 = nothing to wait for); at most MESSAGE_POLL when messages are not
+ * notified (see smq_fd).
+ **/
+long shell_timeout(Shell *shell, bool notified) {
+    long timeout = render_timeout(shell->terminal);
+    if (!notified && (timeout < 0 || timeout > MESSAGE_POLL)) {
+        timeout = MESSAGE_POLL;
+    }
+    if (!shell->status) {
+        return timeout;
+    }
+
+    uint64_t due = shell->status_sample.time + STATUS_INTERVAL * 1000000ULL;
+    uint64_t now = monotonic_ns();
+    long     left = due > now ? (long)((due - now + 999999) / 1000000) : 0;
+    return timeout < 0 || left < timeout ? left : timeout;
+}
 
-    while (smq_running(smq)) {
-        char *message = smq_retrieve(smq);
-        if (message) {
-			printf("\r%s > %-80s\n", smq->name, message);
-            free(message);
-            messages++;
+/**
+ * Show page of scrollback (or of search matches), page pages back from the
+ * newest.
+ **/
+void shell_page(Shell *shell, size_t page) {
+    Scrollback *h    = shell->history;
+    size_t      rows = shell_page_size();
+    uint64_t    sequences[NPAGE];
+    size_t      n    = 0;
+    size_t      total;
+
+    if (shell->search.length) {
+        total = shell->search.matches;
+        n     = scrollback_matches(&shell->search, page * rows, sequences, rows);
+    } else {
+        total = scrollback_count(h);
+        for (uint64_t last = h->next - min(page * rows, total); n < rows && last > h->first; last--) {
+            sequences[n++] = last - 1;
         }
+    }
+    if (!n) {
+        render_line(shell->terminal, "--- no %s ---", page ? "older messages" : "messages");
+        return;
+    }
+    shell->page = page;
+
+    // Sequences are newest first; show oldest first like the live view
+    render_line(shell->terminal, "--- %zu-%zu of %zu%s%.*s%s ---", page * rows + 1, page * rows + n, total,
+        shell->search.length ? " matching '" : "", (int)shell->search.length, shell->search.query,
+        shell->search.length ? "'" : "");
+    for (size_t i = n; i > 0; i--) {
+        size_t      length;
+        const char *text = scrollback_get(h, sequences[i - 1], &length);
+        if (text) {
+            render_line(shell->terminal, "%s > %.*s", shell->smq->name, (int)length, text);
+        }
+    }
+}
 
-        if (messages == NMESSAGES) {
-            sem_post(&Shutdown);
+/**
+ * Show the input line being edited: the message, or the query while
+ * searching (with the number of matches in the prompt).
+ **/
+void shell_show_input(Shell *shell) {
+    char prompt[RENDER_PROMPT];
+
+    render_columns(shell->terminal, shell_columns());
+    if (shell->searching) {
+        snprintf(prompt, sizeof(prompt), "search [%zu] > ", shell->search.matches);
+        render_prompt(shell->terminal, prompt);
+        render_input(shell->terminal, shell->query, shell->query_length);
+    } else {
+        snprintf(prompt, sizeof(prompt), "%s > ", name);
+        render_prompt(shell->terminal, prompt);
+        render_input(shell->terminal, shell->input, shell->length);
+    }
+}
+
+/**
+ * Start (or leave) searching the scrollback as the query is typed.
+ **/
+void shell_searching(Shell *shell, bool searching) {
+    shell->searching    = searching;
+    shell->query_length = 0;
+    shell->page         = 0;
+    scrollback_search(shell->history, &shell->search, "", 0);
+}
+
+/**
+ * Handle one complete input line (command or message).
+ **/
+void shell_command(Shell *shell) {
+    if (shell->searching) {
+        shell_page(shell, 0);
+        return;
+    }
+
+    if (streq(shell->input, "/quit") || streq(shell->input, "/exit")) {
+        shell->done = true;
+    } else if (streq(shell->input, "/history")) {
+        scrollback_search(shell->history, &shell->search, "", 0);
+        shell_page(shell, 0);
+    } else if (strncmp(shell->input, "/search ", 8) == 0) {
+        scrollback_search(shell->history, &shell->search, shell->input + 8, shell->length - 8);
+        shell_page(shell, 0);
+    } else if (streq(shell->input, "/stats")) {
+        shell_stats(shell);
+    } else if (streq(shell->input, "/status")) {
+        shell->status = !shell->status;
+        shell_status(shell);
+    } else if (shell->length > 0) {
+        smq_publish(shell->smq, "shell", shell->input);
+    }
+    shell->length   = 0;
+    shell->input[0] = 0;
+}
+
+/**
+ * Handle escape sequence at the start of buffer (PageUp, PageDown, or a lone
+ * Escape, which leaves search).
+ * @return  Number of bytes used.
+ **/
+size_t shell_escape(Shell *shell, const char *buffer, size_t length) {
+    if (length < 2 || buffer[1] != '[') {
+        if (shell->searching) {
+            shell_searching(shell, false);
         }
+        return 1;
     }
 
-    return NULL;
+    size_t end = 2;
+    while (end < length && (buffer[end] < 0x40 || buffer[end] > 0x7e)) {
+        end++;
+    }
+    if (end == length) {
+        return length;      // Incomplete sequence
+    }
+    if (end - 2 == 1 && buffer[end] == '~' && buffer[2] == '5') {
+        shell_page(shell, shell->page + 1);
+    } else if (end - 2 == 1 && buffer[end] == '~' && buffer[2] == '6' && shell->page > 0) {
+        shell_page(shell, shell->page - 1);
+    }
+    return end + 1;
 }
 
-void * outgoing_thread(void *arg)
-{
-    SMQ *smq = (SMQ *)arg;
-    char input_buffer[BUFSIZ] = "";
-    size_t input_index = 0;
+/**
+ * Read whatever is available on the terminal and apply it to the input line
+ * (pasted text arrives in one read).
+ **/
+void shell_read_input(Shell *shell) {
+    char    buffer[BUFSIZ];
+    ssize_t nread = read(STDIN_FILENO, buffer, sizeof(buffer));
 
-    while (smq_running(smq)) {
-        char input_char = 0;
-        
-        read(STDIN_FILENO, &input_char, 1);
+    if (nread <= 0) {
+        shell->done = nread == 0 || (errno != EINTR && errno != EAGAIN);
+        return;
+    }
 
-        if (input_char == '\n') {
-            if (strcmp(input_buffer, "/quit") == 0 || strcmp(input_buffer, "/exit") == 0) {
-                smq_shutdown(smq);
-                break;
-            } else if (strlen(input_buffer) > 0) {
-                smq_publish(smq, "shell", input_buffer);
-                printf("\r%s > %-80s", name, input_buffer);  // Print the message locally, then move to the next line
-                input_index = 0;
-                input_buffer[0] = 0;
+    for (ssize_t i = 0; i < nread && !shell->done; i++) {
+        unsigned char c      = buffer[i];
+        char         *line   = shell->searching ? shell->query : shell->input;
+        size_t       *length = shell->searching ? &shell->query_length : &shell->length;
+        size_t        limit  = shell->searching ? SCROLLBACK_QUERY : RENDER_INPUT - 1;
+
+        if (c == ESCAPE) {
+            i += shell_escape(shell, buffer + i, nread - i) - 1;
+        } else if (c == CTRL_R) {
+            shell_searching(shell, !shell->searching);
+        } else if (c == '\n') {
+            shell_command(shell);
+        } else if (c == BACKSPACE && *length > 0) {
+            line[--*length] = 0;
+        } else if (!iscntrl(c) && *length < limit) {
+            line[(*length)++] = c;
+            if (*length < limit) {
+                line[*length] = 0;
             }
+        }
+    }
+
+    // Search once per read, however much was typed or pasted
+    if (shell->searching) {
+        scrollback_search(shell->history, &shell->search, shell->query, shell->query_length);
+    }
+    shell_show_input(shell);
+}
 
-        } else if (input_char == BACKSPACE && input_index > 0) {
-            input_index--;
-            input_buffer[input_index] = '\0';
-            // Move cursor back, overwrite the character, and erase the rest of the line
-            printf("\r%s > %s \r", name, input_buffer);
-            fflush(stdout);
-        } else if (!iscntrl(input_char) && input_index < BUFSIZ - 1) {
-            input_buffer[input_index++] = input_char;
-            input_buffer[input_index] = '\0';
-            printf("\r%s > %s", name, input_buffer);  // Reprint the input line without a newline
-            fflush(stdout);
+/**
+ * Take the messages waiting in the SMQ (at most NREADS per call).
+ **/
+void shell_read_messages(Shell *shell) {
+    for (size_t n = 0; n < NREADS; n++) {
+        char *message = smq_retrieve_timeout(shell->smq, 0);
+        if (!message) {
+            break;
         }
+        render_line(shell->terminal, "%s > %s", shell->smq->name, message);
+        scrollback_append(shell->history, message, strlen(message));
+        smq_free(message);
+    }
+
+    // Keep the match count current (examines only the new messages)
+    if (shell->searching) {
+        scrollback_search(shell->history, &shell->search, shell->query, shell->query_length);
+        shell_show_input(shell);
     }
-    return NULL;
 }
 
 /* Main Execution */
 
 int main(int argc, char *argv[]) {
-    toggle_raw_mode();
+    SMQOptions options;
+    smq_options_init(&options);
+
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (streq(arg, "-S")) {
+            statusbar = true;
+        } else if (argind == argc) {
+            usage(EXIT_FAILURE);
+        } else if (streq(arg, "-s")) {
+            host = argv[argind++];
+        } else if (streq(arg, "-p")) {
+            port = argv[argind++];
+        } else if (streq(arg, "-n")) {
+            name = argv[argind++];
+        } else if (streq(arg, "-t")) {
+            if (!(options.transport = connection_profile(argv[argind++]))) {
+                usage(EXIT_FAILURE);
+            }
+        } else if (streq(arg, "-f")) {
+            fps = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-b")) {
+            history = strtoull(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-T")) {
+            backing = argv[argind++];
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
 
-	int argind = 1;
-	while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
-		char *arg = argv[argind++];
-		if (streq(arg, "-h")) {
-			usage(EXIT_SUCCESS);
-		} else if (streq(arg, "-s")) {
-			host = argv[argind++];
-		} else if (streq(arg, "-p")) {
-			port = argv[argind++];
-		} else if (streq(arg, "-n")) {
-			name = argv[argind++];
-		} else {
-			usage(EXIT_FAILURE);
-		}
-	}
-
-    /* Initialize semaphore */
-    sem_init(&Shutdown, 0, 0);
-
-	/* Create and start message queue */
-    SMQ *smq = smq_create(name, host, port);
+    Shell shell = {0};
+    char  prompt[RENDER_PROMPT];
+    snprintf(prompt, sizeof(prompt), "%s > ", name);
+    if (!(shell.terminal = render_create(STDOUT_FILENO, prompt, fps, 0))) {
+        return EXIT_FAILURE;
+    }
+    render_columns(shell.terminal, shell_columns());
+    if (!(shell.history = scrollback_create(history, 0, backing))) {
+        render_delete(shell.terminal);
+        return EXIT_FAILURE;
+    }
+    scrollback_search_init(&shell.search);
 
-    // Subscribe to the shell topic
-    smq_subscribe(smq, "shell");
+    /* Create and start message queue */
+    if (!(shell.smq = smq_create_with(name, host, port, &options))) {
+        scrollback_delete(shell.history);
+        render_delete(shell.terminal);
+        return EXIT_FAILURE;
+    }
+    toggle_raw_mode();
 
-    /* Background Thread */
-	Thread incoming;
-    Thread outgoing;
-    thread_create(&incoming, NULL, incoming_thread, smq);
-    thread_create(&outgoing, NULL, outgoing_thread, smq);
+    // Subscribe to the shell topic
+    smq_subscribe(shell.smq, "shell");
 
     // Welcome message
-	printf("Welcome to the Simple Message Queue (SMQ) Shell, %s!\n", name);
-	printf("You are connected to Server: %s:%s\n", host, port);
+    render_line(shell.terminal, "Welcome to the Simple Message Queue (SMQ) Shell, %s!", name);
+    render_line(shell.terminal, "You are connected to Server: %s:%s", host, port);
+
+    shell.status_sample.time = shell.stats_sample.time = monotonic_ns();
+    shell.status = statusbar;
+    shell_status(&shell);
+
+    /* Event Loop */
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO,        .events = POLLIN},
+        {.fd = smq_fd(shell.smq),   .events = POLLIN},
+    };
+
+    // Without a notification descriptor (poll skips it), check for messages
+    // every MESSAGE_POLL milliseconds instead
+    bool notified = fds[1].fd >= 0;
+    if (!notified) {
+        render_line(shell.terminal, "No message notification: checking every %d ms", MESSAGE_POLL);
+    }
 
-    // Join the threads
-    thread_join(incoming, NULL);
-    smq_delete(smq);
-    thread_join(outgoing, NULL);
+    while (!shell.done && smq_running(shell.smq)) {
+        if (poll(fds, 2, shell_timeout(&shell, notified)) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents) {
+            shell_read_input(&shell);
+        }
+        if (fds[1].revents || !notified) {
+            shell_read_messages(&shell);
+        }
+        if (shell.status && monotonic_ns() >= shell.status_sample.time + STATUS_INTERVAL * 1000000ULL) {
+            shell_status(&shell);
+        }
+        if (render_timeout(shell.terminal) == 0) {
+            render_frame(shell.terminal);
+        }
+    }
 
-	return 0;
+    render_status(shell.terminal, NULL);
+    render_input(shell.terminal, "", 0);
+    render_frame(shell.terminal);
+    write(STDOUT_FILENO, "\n", 1);
+
+    smq_shutdown(shell.smq);
+    smq_delete(shell.smq);
+    scrollback_search_clear(&shell.search);
+    scrollback_delete(shell.history);
+    render_delete(shell.terminal);
+    return 0;
 }
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
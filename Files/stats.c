@@ -0,0 +1,205 @@
+/* stats.c: Client statistics (sharded counters and latency histograms) */
+
+#include "smq/stats.h"
+#include "smq/utils.h"
+
+/* Internal Constants */
+
+static const struct {
+    const char *name;
+    const char *help;
+} StatsCounters[STATS_NCOUNTERS] = {
+    [STATS_PUBLISHED]       = {"smq_published_messages_total", "Messages published."},
+    [STATS_PUBLISHED_BYTES] = {"smq_published_bytes_total",    "Message bytes published."},
+    [STATS_RECEIVED]        = {"smq_received_messages_total",  "Messages retrieved."},
+    [STATS_RECEIVED_BYTES]  = {"smq_received_bytes_total",     "Message bytes retrieved."},
+    [STATS_REQUESTS]        = {"smq_requests_total",           "HTTP requests started."},
+    [STATS_COMPLETED]       = {"smq_requests_completed_total", "HTTP requests finished."},
+    [STATS_FAILURES]        = {"smq_request_failures_total",   "HTTP requests that failed."},
+    [STATS_RETRIES]         = {"smq_retries_total",            "Outgoing requests retried."},
+    [STATS_HEDGES]          = {"smq_hedged_requests_total",    "Outgoing requests duplicated after the hedge delay."},
+    [STATS_HEDGE_WINS]      = {"smq_hedge_wins_total",         "Hedged requests won by the duplicate."},
+    [STATS_DEAD_LETTERS]    = {"smq_dead_letters_total",       "Outgoing requests given up on."},
+};
+
+static const char *StatsThreads[STATS_NSHARDS] = {
+    [STATS_SHARD_APP]    = "app",
+    [STATS_SHARD_PUSHER] = "pusher",
+    [STATS_SHARD_PULLER] = "puller",
+};
+
+static const char *StatsPhases[STATS_NPHASES] = {
+    [STATS_PHASE_RESOLVE]   = "resolve",
+    [STATS_PHASE_CONNECT]   = "connect",
+    [STATS_PHASE_TLS]       = "tls",
+    [STATS_PHASE_SUBSCRIBE] = "subscribe",
+    [STATS_PHASE_READY]     = "ready",
+};
+
+static const char *StatsHistograms[STATS_NHISTOGRAMS] = {
+    [STATS_LATENCY_PUSH] = "push",
+    [STATS_LATENCY_PULL] = "pull",
+};
+
+/* Internal Functions */
+
+/**
+ * Escape label value as the Prometheus text format requires (backslash,
+ * double quote and newline), truncating to size.
+ **/
+static const char * stats_escape(const char *value, char *buffer, size_t size) {
+    size_t length = 0;
+    for (; *value && length + 2 < size; value++) {
+        if (*value == '\\' || *value == '"') {
+            buffer[length++] = '\\';
+            buffer[length++] = *value;
+        } else if (*value == '\n') {
+            buffer[length++] = '\\';
+            buffer[length++] = 'n';
+        } else {
+            buffer[length++] = *value;
+        }
+    }
+    buffer[length] = 0;
+    return buffer;
+}
+
+/* Functions */
+
+/**
+ * Aggregate all shards into a snapshot.
+ *
+ * Queue depths, round-trip times and the long-poll wait are not part of Stats
+ * and are left for the caller to fill in.
+ *
+ * @param   s           Stats structure.
+ * @param   out         Snapshot to fill in.
+ **/
+void stats_collect(Stats *s, SMQStats *out) {
+    memset(out, 0, sizeof(SMQStats));
+
+    for (int shard = 0; shard < STATS_NSHARDS; shard++) {
+        StatsShard *sh = &s->shards[shard];
+
+        for (int c = 0; c < STATS_NCOUNTERS; c++) {
+            out->counters[c] += atomic_load_explicit(&sh->counters[c], memory_order_relaxed);
+        }
+
+        for (int h = 0; h < STATS_NHISTOGRAMS; h++) {
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                out->buckets[h][b] += atomic_load_explicit(&sh->buckets[h][b], memory_order_relaxed);
+            }
+            out->sums[h] += atomic_load_explicit(&sh->sums[h], memory_order_relaxed);
+        }
+
+        out->cpu[shard] = atomic_load_explicit(&sh->cpu, memory_order_relaxed);
+    }
+
+    for (int p = 0; p < STATS_NPHASES; p++) {
+        out->phases[p] = atomic_load_explicit(&s->phases[p], memory_order_relaxed);
+    }
+
+    if (out->counters[STATS_REQUESTS] > out->counters[STATS_COMPLETED]) {
+        out->in_flight = out->counters[STATS_REQUESTS] - out->counters[STATS_COMPLETED];
+    }
+}
+
+/**
+ * Estimate latency percentile from histogram (upper bound of bucket, or lower
+ * bound of the overflow bucket).
+ * @param   s           Stats snapshot.
+ * @param   h           Histogram.
+ * @param   p           Percentile (0.0 - 1.0).
+ * @return  Latency in milliseconds (0 if no observations).
+ **/
+double stats_percentile(const SMQStats *s, StatsHistogram h, double p) {
+    uint64_t count = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        count += s->buckets[h][b];
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * count);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_OVERFLOW; b++) {
+        seen += s->buckets[h][b];
+        if (seen > rank) {
+            return (double)(1ULL << b) / 1000.0;
+        }
+    }
+    return (double)(1ULL << (STATS_OVERFLOW - 1)) / 1000.0;
+}
+
+/**
+ * Write snapshot in Prometheus text exposition format.
+ * @param   s           Stats snapshot.
+ * @param   label       Name of SMQ (used as the queue label).
+ * @param   stream      Stream to write to.
+ **/
+void stats_format(const SMQStats *s, const char *label, FILE *stream) {
+    char name[BUFSIZ];
+    stats_escape(label, name, sizeof(name));
+
+    for (int c = 0; c < STATS_NCOUNTERS; c++) {
+        fprintf(stream, "# HELP %s %s\n", StatsCounters[c].name, StatsCounters[c].help);
+        fprintf(stream, "# TYPE %s counter\n", StatsCounters[c].name);
+        fprintf(stream, "%s{queue=\"%s\"} %lu\n", StatsCounters[c].name, name, (unsigned long)s->counters[c]);
+    }
+
+    fprintf(stream, "# HELP smq_in_flight_requests HTTP requests in progress.\n");
+    fprintf(stream, "# TYPE smq_in_flight_requests gauge\n");
+    fprintf(stream, "smq_in_flight_requests{queue=\"%s\"} %lu\n", name, (unsigned long)s->in_flight);
+
+    fprintf(stream, "# HELP smq_rtt_seconds Smoothed round-trip time of outgoing requests.\n");
+    fprintf(stream, "# TYPE smq_rtt_seconds gauge\n");
+    fprintf(stream, "smq_rtt_seconds{queue=\"%s\"} %.9f\n", name, s->srtt / 1e9);
+
+    fprintf(stream, "# HELP smq_request_timeout_seconds Current timeout of outgoing requests.\n");
+    fprintf(stream, "# TYPE smq_request_timeout_seconds gauge\n");
+    fprintf(stream, "smq_request_timeout_seconds{queue=\"%s\"} %.9f\n", name, s->rto / 1e9);
+
+    fprintf(stream, "# HELP smq_poll_wait_seconds Server-side wait of current long-poll.\n");
+    fprintf(stream, "# TYPE smq_poll_wait_seconds gauge\n");
+    fprintf(stream, "smq_poll_wait_seconds{queue=\"%s\"} %.9f\n", name, s->poll_wait / 1e9);
+
+    fprintf(stream, "# HELP smq_queue_depth Requests waiting in client queues.\n");
+    fprintf(stream, "# TYPE smq_queue_depth gauge\n");
+    fprintf(stream, "smq_queue_depth{queue=\"%s\",direction=\"outgoing\"} %lu\n", name, (unsigned long)s->outgoing);
+    fprintf(stream, "smq_queue_depth{queue=\"%s\",direction=\"incoming\"} %lu\n", name, (unsigned long)s->incoming);
+
+    fprintf(stream, "# HELP smq_thread_cpu_seconds_total CPU time used by library threads.\n");
+    fprintf(stream, "# TYPE smq_thread_cpu_seconds_total counter\n");
+    for (int shard = STATS_SHARD_PUSHER; shard < STATS_NSHARDS; shard++) {
+        fprintf(stream, "smq_thread_cpu_seconds_total{queue=\"%s\",thread=\"%s\"} %.9f\n",
+            name, StatsThreads[shard], s->cpu[shard] / 1e9);
+    }
+
+    fprintf(stream, "# HELP smq_startup_seconds Time spent in each startup phase.\n");
+    fprintf(stream, "# TYPE smq_startup_seconds gauge\n");
+    for (int p = 0; p < STATS_NPHASES; p++) {
+        fprintf(stream, "smq_startup_seconds{queue=\"%s\",phase=\"%s\"} %.9f\n", name, StatsPhases[p], s->phases[p] / 1e9);
+    }
+
+    fprintf(stream, "# HELP smq_request_duration_seconds HTTP request duration.\n");
+    fprintf(stream, "# TYPE smq_request_duration_seconds histogram\n");
+    for (int h = 0; h < STATS_NHISTOGRAMS; h++) {
+        // Overflowed latencies have no finite bound: they only count in +Inf
+        uint64_t cumulative = 0;
+        for (int b = 0; b < STATS_OVERFLOW; b++) {
+            cumulative += s->buckets[h][b];
+            fprintf(stream, "smq_request_duration_seconds_bucket{queue=\"%s\",direction=\"%s\",le=\"%g\"} %lu\n",
+                name, StatsHistograms[h], (double)(1ULL << b) / 1e6, (unsigned long)cumulative);
+        }
+        cumulative += s->buckets[h][STATS_OVERFLOW];
+        fprintf(stream, "smq_request_duration_seconds_bucket{queue=\"%s\",direction=\"%s\",le=\"+Inf\"} %lu\n",
+            name, StatsHistograms[h], (unsigned long)cumulative);
+        fprintf(stream, "smq_request_duration_seconds_sum{queue=\"%s\",direction=\"%s\"} %.9f\n",
+            name, StatsHistograms[h], s->sums[h] / 1e9);
+        fprintf(stream, "smq_request_duration_seconds_count{queue=\"%s\",direction=\"%s\"} %lu\n",
+            name, StatsHistograms[h], (unsigned long)cumulative);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,193 @@
+/* sub.c
+ * smq-sub: Stream messages of one or more topics to standard output.
+ *
+ * Messages are written through a large stdio buffer, which is flushed only
+ * when no more messages are waiting, so a busy stream costs one write per
+ * buffer rather than one per message.  Each message is written as a line,
+ * or, with -l, preceded by its length as a 4-byte big-endian integer (the
+ * format smq-pub -l reads).
+ *
+ * The stream ends after a number of messages (-c), after a period without
+ * any (-i), on SIGINT or SIGTERM, or when standard output is closed; then
+ * throughput is reported on standard error.
+ **/
+
+#include "smq/client.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BLOCK       (1<<20)     // Size of output buffer
+#define WAIT        100         // Milliseconds to wait for a message between checks
+
+/* Globals */
+
+char   *Host      = "localhost";
+char   *Port      = "9620";
+char   *Name      = NULL;       // Queue name (default: sub-PID)
+bool    Lengths   = false;      // Write length-prefixed records instead of lines
+size_t  Batch     = SMQ_BATCH;  // Messages per long-poll response
+size_t  Count     = 0;          // Stop after this many messages (0 = never)
+double  Idle      = 0;          // Stop after this many seconds without messages (0 = never)
+
+size_t  Received  = 0;          // Messages written
+size_t  Bytes     = 0;          // Bytes of messages written
+
+volatile sig_atomic_t Stop = 0;
+
+void usage(int status) {
+    fprintf(stderr, "Usage: ./smq-sub [options] topic [topic ...]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h        Show help and usage\n");
+    fprintf(stderr, "    -s        host (default: %s)\n", Host);
+    fprintf(stderr, "    -p        port (default: %s)\n", Port);
+    fprintf(stderr, "    -n        Queue name (default: sub-PID)\n");
+    fprintf(stderr, "    -l        Write length-prefixed (4-byte big-endian) records instead of lines\n");
+    fprintf(stderr, "    -b        Messages per long-poll response (default: %zu)\n", Batch);
+    fprintf(stderr, "    -c        Stop after this many messages\n");
+    fprintf(stderr, "    -i        Stop after this many seconds without messages\n");
+    exit(status);
+}
+
+/* Functions */
+
+void stop_handler(int signum) {
+    Stop = 1;
+}
+
+/**
+ * Write message to standard output (buffered).
+ * @return  Whether it was written.
+ **/
+bool write_message(const char *message) {
+    size_t length = strlen(message);
+
+    if (Lengths) {
+        unsigned char header[4] = {length >> 24, length >> 16, length >> 8, length};
+        if (fwrite(header, sizeof(header), 1, stdout) != 1) {
+            return false;
+        }
+    }
+    if (fwrite(message, 1, length, stdout) != length || (!Lengths && putchar('\n') == EOF)) {
+        return false;
+    }
+
+    Received++;
+    Bytes += length;
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(EXIT_SUCCESS);
+        } else if (streq(arg, "-l")) {
+            Lengths = true;
+        } else if (argind == argc) {
+            usage(EXIT_FAILURE);
+        } else if (streq(arg, "-s")) {
+            Host = argv[argind++];
+        } else if (streq(arg, "-p")) {
+            Port = argv[argind++];
+        } else if (streq(arg, "-n")) {
+            Name = argv[argind++];
+        } else if (streq(arg, "-b")) {
+            Batch = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-c")) {
+            Count = strtoul(argv[argind++], NULL, 10);
+        } else if (streq(arg, "-i")) {
+            Idle = strtod(argv[argind++], NULL);
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (argind == argc || Batch == 0) {
+        usage(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    signal(SIGPIPE, SIG_IGN);       // A closed pipe ends the stream (EPIPE)
+    setvbuf(stdout, NULL, _IOFBF, BLOCK);
+
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "sub-%d", getpid());
+
+    // Subscribe before returning, so nothing published afterwards is missed
+    // (argv is NULL-terminated, as topics must be)
+    SMQOptions options;
+    smq_options_init(&options);
+    options.batch  = Batch;
+    options.topics = (const char * const *)&argv[argind];
+    options.eager  = true;
+
+    SMQ *smq = smq_create_with(Name ? Name : name, Host, Port, &options);
+    if (!smq) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t started = monotonic_ns();
+    uint64_t first   = 0;
+    uint64_t last    = started;
+    bool     success = true;
+
+    while (!Stop && smq_running(smq) && (!Count || Received < Count)) {
+        // Flush only once caught up with the messages waiting
+        char *message = smq_retrieve_timeout(smq, 0);
+        if (!message) {
+            if (fflush(stdout) == EOF) {
+                success = errno == EPIPE;
+                break;
+            }
+            message = smq_retrieve_timeout(smq, WAIT);
+        }
+        if (!message) {
+            if (Idle > 0 && monotonic_ns() - last > (uint64_t)(Idle * 1e9)) {
+                break;
+            }
+            continue;
+        }
+
+        last  = monotonic_ns();
+        first = first ? first : last;
+        bool written = write_message(message);
+        smq_free(message);
+        if (!written) {
+            success = errno == EPIPE;
+            break;
+        }
+    }
+    if (fflush(stdout) == EOF && errno != EPIPE) {
+        success = false;
+    }
+    uint64_t finished = monotonic_ns();
+
+    smq_shutdown(smq);
+    smq_delete(smq);
+
+    /* Report */
+    double elapsed = (finished - started) / 1e9;
+    double active  = first && last > first ? (last - first) / 1e9 : 0;
+    fprintf(stderr, "received    %zu messages (%zu bytes) in %.3f s\n", Received, Bytes, elapsed);
+    if (active > 0) {
+        fprintf(stderr, "throughput  %.1f messages/s  %.2f MB/s (first to last message, %.3f s)\n",
+            Received / active, Bytes / active / 1e6, active);
+    }
+
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,189 @@
+/* trace.c: Sampled per-message tracing
+ *
+ * A traced publish sends its trace id along (see REQUEST_TRACE_HEADER) and
+ * the broker hands it back with the message, so the subscriber traces that
+ * delivery under the same id (see tracer_continue).  Ids start from a random
+ * base, so those of different processes do not collide.
+ **/
+
+#include "smq/trace.h"
+#include "smq/alloc.h"
+#include "smq/utils.h"
+
+#include <unistd.h>
+
+#include <sys/random.h>
+
+/* Internal Constants */
+
+static const struct {
+    const char *name;
+    TraceStage  from;
+    TraceStage  to;
+} TraceSpans[] = {
+    {"publish",         TRACE_PUBLISH,  TRACE_ENQUEUE},
+    {"outgoing-queue",  TRACE_ENQUEUE,  TRACE_DEQUEUE},
+    {"dispatch",        TRACE_DEQUEUE,  TRACE_SEND},
+    {"request",         TRACE_SEND,     TRACE_ACK},
+    {"long-poll",       TRACE_POLL,     TRACE_RESPONSE},
+    {"deliver",         TRACE_RESPONSE, TRACE_DELIVER},
+    {"incoming-queue",  TRACE_DELIVER,  TRACE_RETRIEVE},
+    {NULL, 0, 0},
+};
+
+/* Internal Functions */
+
+static void tracer_event(Tracer *t, const char *name, char phase, uint64_t id, uint64_t stamp, const Trace *trace) {
+    fprintf(t->stream, "%s\n{\"name\":\"%s\",\"cat\":\"smq\",\"ph\":\"%c\",\"id\":\"0x%016lx\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+        t->first ? "" : ",", name, phase, (unsigned long)id, getpid(), trace->incoming ? 2 : 1,
+        (stamp - t->started) / 1000.0);
+    if (phase == 'b' && streq(name, "message")) {
+        fprintf(t->stream, ",\"args\":{\"attempts\":%u}", trace->attempts);
+    }
+    fputc('}', t->stream);
+    t->first = false;
+}
+
+static void tracer_write(Tracer *t, const Trace *trace) {
+    uint64_t first = 0;
+    uint64_t last  = 0;
+    for (int s = 0; s < TRACE_NSTAGES; s++) {
+        if (trace->stamps[s]) {
+            first = first ? min(first, trace->stamps[s]) : trace->stamps[s];
+            last  = trace->stamps[s] > last ? trace->stamps[s] : last;
+        }
+    }
+    if (!first) {
+        return;
+    }
+
+    mutex_lock(&t->lock);
+    tracer_event(t, "message", 'b', trace->id, first, trace);
+    for (size_t s = 0; TraceSpans[s].name; s++) {
+        uint64_t from = trace->stamps[TraceSpans[s].from];
+        uint64_t to   = trace->stamps[TraceSpans[s].to];
+        if (from && to && to >= from) {
+            tracer_event(t, TraceSpans[s].name, 'b', trace->id, from, trace);
+            tracer_event(t, TraceSpans[s].name, 'e', trace->id, to, trace);
+        }
+    }
+    tracer_event(t, "message", 'e', trace->id, last, trace);
+    mutex_unlock(&t->lock);
+}
+
+/* Functions */
+
+/**
+ * Create tracer.
+ * @param   period      Trace one in every period messages (1 = all).
+ * @param   path        Path of Chrome trace-event JSON file (NULL for none).
+ * @param   callback    Function called with each finished trace (NULL for none).
+ * @param   user        User data passed to callback.
+ * @return  Newly allocated Tracer structure (NULL on failure).
+ **/
+Tracer * tracer_create(unsigned period, const char *path, TraceCallback callback, void *user) {
+    Tracer *t = smq_calloc(1, sizeof(Tracer));
+    if (!t) {
+        return NULL;
+    }
+
+    if (path && !(t->stream = fopen(path, "w"))) {
+        error("Unable to open trace %s: %s", path, strerror(errno));
+        smq_free(t);
+        return NULL;
+    }
+    if (t->stream) {
+        fputc('[', t->stream);
+    }
+
+    t->period   = period ? period : 1;
+    t->callback = callback;
+    t->user     = user;
+    t->first    = true;
+    t->started  = monotonic_ns();
+    mutex_init(&t->lock, NULL);
+
+    uint64_t base;
+    if (getrandom(&base, sizeof(base), 0) != sizeof(base)) {
+        base = t->started ^ ((uint64_t)getpid() << 32);
+    }
+    atomic_init(&t->next, base);
+    return t;
+}
+
+/**
+ * Delete tracer (closing the JSON array of the output).
+ * @param   t           Tracer structure.
+ **/
+void tracer_delete(Tracer *t) {
+    if (!t) {
+        return;
+    }
+
+    if (t->stream) {
+        fputs("\n]\n", t->stream);
+        fclose(t->stream);
+    }
+    smq_free(t);
+}
+
+/**
+ * Decide whether to trace the next message.
+ * @param   t           Tracer structure (may be NULL).
+ * @param   incoming    Whether message is incoming (or outgoing).
+ * @return  Newly allocated Trace structure if sampled (NULL otherwise).
+ **/
+Trace * tracer_sample(Tracer *t, bool incoming) {
+    if (!t || atomic_fetch_add_explicit(&t->counter, 1, memory_order_relaxed) % t->period) {
+        return NULL;
+    }
+
+    Trace *trace = smq_calloc(1, sizeof(Trace));
+    if (trace) {
+        // Zero means no trace (see tracer_continue)
+        while (!(trace->id = atomic_fetch_add_explicit(&t->next, 1, memory_order_relaxed) + 1));
+        trace->incoming = incoming;
+    }
+    return trace;
+}
+
+/**
+ * Trace delivery of a message whose publish was traced (regardless of
+ * sampling).
+ * @param   t           Tracer structure (may be NULL).
+ * @param   id          Trace identifier of publish.
+ * @return  Newly allocated incoming Trace structure (NULL if not tracing).
+ **/
+Trace * tracer_continue(Tracer *t, uint64_t id) {
+    if (!t) {
+        return NULL;
+    }
+
+    Trace *trace = smq_calloc(1, sizeof(Trace));
+    if (trace) {
+        trace->id       = id;
+        trace->incoming = true;
+    }
+    return trace;
+}
+
+/**
+ * Report finished trace to callback and output, then free it.
+ * @param   t           Tracer structure.
+ * @param   trace       Trace structure.
+ **/
+void tracer_finish(Tracer *t, Trace *trace) {
+    if (!trace) {
+        return;
+    }
+
+    if (t->callback) {
+        t->callback(trace, t->user);
+    }
+    if (t->stream) {
+        tracer_write(t, trace);
+    }
+    smq_free(trace);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,55 @@
+/* alloc.h: SMQ Allocator hooks and allocation accounting */
+
+#ifndef SMQ_ALLOC_H
+#define SMQ_ALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+typedef enum {
+    ALLOC_PATH_OTHER,           // Creation, shutdown and anything else
+    ALLOC_PATH_PUBLISH,         // smq_publish, smq_subscribe, smq_unsubscribe
+    ALLOC_PATH_RETRIEVE,        // smq_retrieve
+    ALLOC_PATH_PUSH,            // Pusher thread (including libcurl)
+    ALLOC_PATH_PULL,            // Puller thread (including libcurl)
+    ALLOC_NPATHS,
+} AllocPath;
+
+/* Structures */
+
+typedef struct {
+    void *  (*malloc)(size_t size, void *user);
+    void *  (*calloc)(size_t n, size_t size, void *user);
+    void *  (*realloc)(void *p, size_t size, void *user);
+    void *  (*aligned_alloc)(size_t alignment, size_t size, void *user);
+    void    (*free)(void *p, void *user);
+    void    *user;              // Passed to every hook (e.g. arena or pool)
+} SMQAllocator;
+
+typedef struct {
+    uint64_t allocs[ALLOC_NPATHS];  // malloc, calloc, realloc, aligned_alloc and strdup calls
+    uint64_t frees[ALLOC_NPATHS];   // free calls (of non-NULL pointers)
+    uint64_t bytes[ALLOC_NPATHS];   // Bytes requested
+} SMQAllocStats;
+
+/* Functions */
+
+void    smq_set_allocator(const SMQAllocator *allocator);
+void    smq_alloc_accounting(bool enabled);
+void    smq_alloc_stats(SMQAllocStats *out);
+
+void *  smq_malloc(size_t size);
+void *  smq_calloc(size_t n, size_t size);
+void *  smq_realloc(void *p, size_t size);
+void *  smq_aligned_alloc(size_t alignment, size_t size);
+char *  smq_strdup(const char *s);
+void    smq_free(void *p);
+
+AllocPath   alloc_path(AllocPath path);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,53 @@
+/* arena.h: SMQ Segmented arena for queued messages */
+
+#ifndef SMQ_ARENA_H
+#define SMQ_ARENA_H
+
+#include "smq/thread.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Constants */
+
+#define ARENA_SEGMENT_SIZE  (1<<20)     // Default segment size (bytes)
+#define ARENA_SPARES        2           // Empty segments kept for reuse
+#define ARENA_ALIGN         16          // Alignment of allocations
+
+/* Structures */
+
+typedef struct Arena Arena;
+typedef struct ArenaSegment ArenaSegment;
+
+struct ArenaSegment {
+    Arena          *arena;      // Arena segment belongs to
+    ArenaSegment   *next;       // Next spare segment
+    atomic_size_t   live;       // Allocations not yet released (+1 while current)
+    size_t          used;       // Bytes handed out (bump offset into data)
+    size_t          size;       // Bytes available in data
+    size_t          mapped;     // Bytes mapped (including this header)
+    char            data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct Arena {
+    ArenaSegment   *current;    // Segment allocations are bumped from
+    ArenaSegment   *spares;     // Empty segments ready for reuse
+    size_t          nspares;    // Number of spare segments
+    size_t          segment;    // Size of a regular segment (bytes mapped)
+    bool            huge;       // Whether segments are huge-page backed
+    atomic_size_t   segments;   // Segments currently mapped
+    Mutex           lock;       // Protects current and spares
+};
+
+/* Functions */
+
+Arena * arena_create(size_t segment, bool huge);
+void    arena_delete(Arena *a);
+
+void *  arena_alloc(Arena *a, size_t size);
+void    arena_release(void *p);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
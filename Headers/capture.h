@@ -0,0 +1,56 @@
+/* capture.h: SMQ Traffic capture (compact binary trace of client operations) */
+
+#ifndef SMQ_CAPTURE_H
+#define SMQ_CAPTURE_H
+
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define CAPTURE_MAGIC   "SMQCAP1"
+
+typedef enum {
+    CAPTURE_PUBLISH     = 1,    // smq_publish(topic, body)
+    CAPTURE_RETRIEVE    = 2,    // smq_retrieve() returned body
+    CAPTURE_SUBSCRIBE   = 3,    // smq_subscribe(topic)
+    CAPTURE_UNSUBSCRIBE = 4,    // smq_unsubscribe(topic)
+} CaptureType;
+
+/* Structures */
+
+typedef struct {
+    CaptureType type;           // Type of operation
+    uint64_t    timestamp;      // Time since start of capture (nanoseconds)
+    char       *topic;          // Topic string (NULL if none)
+    char       *body;           // Body string (NULL if none)
+} CaptureRecord;
+
+typedef struct {
+    FILE       *stream;         // Trace file
+    uint64_t    started;        // Monotonic time of first record (nanoseconds)
+    uint64_t    last;           // Timestamp of previous record (nanoseconds)
+    Mutex       lock;           // Serializes records from multiple threads
+} Capture;
+
+/* Functions */
+
+Capture *   capture_create(const char *path);
+Capture *   capture_open(const char *path);
+void        capture_close(Capture *c);
+
+void        capture_record(Capture *c, CaptureType type, const char *topic, const char *body);
+bool        capture_next(Capture *c, CaptureRecord *record);
+void        capture_record_clear(CaptureRecord *record);
+
+void        capture_write_varint(FILE *fs, uint64_t value);
+bool        capture_read_varint(FILE *fs, uint64_t *value);
+void        capture_write_string(FILE *fs, const char *s);
+bool        capture_read_string(FILE *fs, char **s);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,46 +3,162 @@
 #ifndef SMQ_CLIENT_H
 #define SMQ_CLIENT_H
 
+#include "smq/alloc.h"
+#include "smq/capture.h"
+#include "smq/connection.h"
+#include "smq/deadletter.h"
 #include "smq/queue.h"
+#include "smq/recorder.h"
+#include "smq/rtt.h"
+#include "smq/stats.h"
+#include "smq/trace.h"
 
 #include <netdb.h>
 #include <stdbool.h>
 #include <time.h>
 
+/* Constants */
+
+typedef enum {
+    SMQ_STARTING,       // Created, threads not yet released
+    SMQ_RUNNING,        // Accepting publishes, pushing and pulling
+    SMQ_DRAINING,       // Rejecting publishes, still pushing and pulling
+    SMQ_STOPPED,        // Shutdown
+    SMQ_FAILED,         // Shutdown because queues or threads could not be started
+} SMQState;
+
+#define SMQ_BATCH            32              // Default messages per long-poll response
+#define SMQ_POLL_WAIT        2000            // Default server-side wait of long-polls (milliseconds)
+#define SMQ_POLL_WAIT_MAX    60000           // Default longest wait of idle long-polls (milliseconds)
+#define SMQ_RTO_INITIAL      1000            // Publish timeout before the first RTT sample (milliseconds)
+#define SMQ_RTO_MIN          1000            // Lower bound of publish timeout (milliseconds, RFC 6298)
+#define SMQ_RTO_MAX          60000           // Upper bound of publish timeout after backoff (milliseconds)
+#define SMQ_RTO_RATE         256             // Bytes of request body allowed per extra millisecond of timeout
+#define SMQ_HEDGE_PERCENTILE 0.95            // Default latency percentile after which requests are hedged
+#define SMQ_HEDGE_BUDGET     0.05            // Default fraction of requests that may be hedged
+#define SMQ_COMPACT_STACK    (128 * 1024)    // Thread stack size in compact mode (bytes)
+#define SMQ_COMPACT_EVENTS   64              // Flight recorder capacity in compact mode
+#define SMQ_COMPACT_SEGMENT  (16 * 1024)     // Queue arena segment size in compact mode (bytes)
+
 /* Structures */
 
 typedef struct {
-    char    name[1<<8];         // Name of message queue
-    char    server_url[1<<8];   // URL of server
+    const char *cpus;           // CPU list for affinity, e.g. "2-3,6" (NULL = inherit)
+    const char *cgroup;         // cgroup v2 directory to move threads into (NULL = none)
+    int         policy;         // SCHED_OTHER, SCHED_FIFO or SCHED_RR (-1 = inherit)
+    int         priority;       // Real-time priority (SCHED_FIFO, SCHED_RR)
+    int         nice;           // Nice value (0 = inherit)
+} SMQThreadOptions;
 
-    time_t  timeout;            // Socket timeout (milliseconds)
-    bool    running;            // Whether or not SMQ is running (active)
+typedef struct {
+    SMQThreadOptions threads;   // Applied to library threads of the SMQ (not the shared log writer)
+    size_t  stack_size;         // Stack size of library threads (0 = pthread default)
+    size_t  recorder_events;    // Flight recorder capacity (0 = RECORDER_EVENTS)
+    size_t  segment_size;       // Queue arena segment size (0 = ARENA_SEGMENT_SIZE)
+    bool    huge_pages;         // Back queue arena segments with huge pages
+    size_t  batch;              // Messages per long-poll response (1 = unframed)
+    time_t  poll_wait;          // Server-side wait of long-polls (milliseconds, 0 = SMQ_POLL_WAIT)
+    time_t  poll_wait_max;      // Wait doubles while idle up to this (milliseconds, 0 = SMQ_POLL_WAIT_MAX)
+    const char * const *topics; // Subscriptions made before ready (NULL-terminated, may be NULL)
+    bool    eager;              // smq_create_with waits until ready (see smq_ready)
+    time_t  connect_timeout;    // Maximum wait of eager create (milliseconds, 0 = timeout)
+    bool    lazy;               // Start threads and create queues on first use (no signal dumps until then)
+    const ConnectionProfile *transport; // Socket tuning (NULL = default, see connection_profile)
+    bool    hedge;              // Duplicate slow outgoing requests on a second connection
+    double  hedge_percentile;   // Hedge requests slower than this percentile of recent ones
+    double  hedge_budget;       // Fraction of requests that may be hedged
+    const char *dead_letter;    // Append undeliverable requests to this file (NULL = log and drop)
+    unsigned    max_attempts;   // Give up on requests after this many failures (0 = retry transient failures forever)
+} SMQOptions;
 
-    Queue*  outgoing;           // Requests to be sent to server
-    Queue*  incoming;           // Requests received from server
+typedef struct {
+    char   *name;               // Name of message queue
+    char   *server_url;         // URL of server
+
+    time_t  timeout;            // Socket timeout (milliseconds)
+    RTTEstimator rtt;           // Round-trip times of outgoing requests (publish timeout)
+    atomic_long poll_wait;      // Server-side wait of current long-poll (milliseconds)
+    atomic_int state;           // SMQState (written under lock, read without it)
+    atomic_size_t pending;      // Outgoing requests queued or in flight
+    atomic_uint pending_waiters; // Threads in smq_wait_pending
+
+    Queue*  outgoing;           // Requests to be sent to server (NULL until pusher started)
+    Queue*  incoming;           // Requests received from server (NULL until puller started)
+    atomic_int started;         // Internal threads started (SMQ_PUSHER, SMQ_PULLER)
+    atomic_int ready;           // Internal threads connected (SMQ_PUSHER, SMQ_PULLER)
+    uint64_t   created;         // Monotonic time of creation (ns)
+
+    Connection *push_connection;    // Connection reused by pusher
+    Connection *pull_connection;    // Connection reused by puller
+    ConnectionProfile transport;    // Transport profile of connections
+    Hedge      *hedge;              // Connections of hedged requests (NULL unless options.hedge)
+
+    uint64_t    producer;           // Random identifier tagging publishes (for deduplication)
+    atomic_uint_fast64_t sequence;  // Sequence number of last publish
 
     // TODO: Add any necessary thread and synchromization primitives
     
     Thread  pusher;             // Pusher thread (outgoing)
     Thread  puller;             // Puller thread (incoming)
-    Mutex   lock;               // Lock for shutdown
+    Mutex   lock;               // Lock for state transitions
     
-    Cond    cond;               // Client 2
+    Cond    cond;               // Signalled on state transitions
+
+    Capture    *capture;        // Traffic capture (NULL if not recording)
+    Recorder   *recorder;       // Flight recorder of recent events
+    atomic_uint dumped;         // Last dump request handled (see smq_dump_on_signal)
+
+    Stats      *stats;          // Per-thread counters and histograms
+    Thread      exporter;       // Exporter thread (see smq_stats_serve)
+    int         exporter_fd;    // Exporter socket (-1 if not serving)
+    char       *exporter_path;  // Exporter socket path
+
+    Tracer     *tracer;         // Per-message tracing (NULL if not tracing)
+    DeadLetters *dead_letters;  // Undeliverable requests (NULL if options.dead_letter is not set)
+
+    atomic_int  notify_fd;      // eventfd readable while messages wait (-1 until smq_fd)
+    atomic_bool notified;       // Whether notify_fd was signaled since last emptied
+
+    SMQOptions  options;        // Creation options (strings are owned copies)
 
 
 } SMQ;
 
+void    smq_options_init(SMQOptions *options);
+void    smq_options_compact(SMQOptions *options);
+
 SMQ *   smq_create(const char *name, const char *host, const char *port);
+SMQ *   smq_create_with(const char *name, const char *host, const char *port, const SMQOptions *options);
 void    smq_delete(SMQ *smq);
 
 void    smq_publish(SMQ *smq, const char *topic, const char *body);
+void    smq_publish_batch(SMQ *smq, const char *topic, const char * const *bodies, size_t n);
 char *  smq_retrieve(SMQ *smq);
+char *  smq_retrieve_timeout(SMQ *smq, time_t timeout);
+int     smq_fd(SMQ *smq);
 
 void    smq_subscribe(SMQ *smq, const char *topic);
 void    smq_unsubscribe(SMQ *smq, const char *topic);
 
 bool    smq_running(SMQ *smq);
 void    smq_shutdown(SMQ *smq);
+size_t  smq_shutdown_drain(SMQ *smq, time_t deadline);
+
+SMQState smq_state(SMQ *smq);
+bool    smq_wait(SMQ *smq, SMQState state, time_t timeout);
+bool    smq_ready(SMQ *smq, time_t timeout);
+bool    smq_wait_pending(SMQ *smq, size_t limit, time_t timeout);
+
+bool    smq_record(SMQ *smq, const char *path);
+
+void    smq_dump(SMQ *smq, FILE *stream);
+void    smq_dump_on_signal(int signum);
+
+void    smq_stats(SMQ *smq, SMQStats *out);
+bool    smq_stats_write(SMQ *smq, const char *path);
+bool    smq_stats_serve(SMQ *smq, const char *path);
+
+bool    smq_trace(SMQ *smq, unsigned period, const char *path, TraceCallback callback, void *user);
 
 #endif
 
@@ -0,0 +1,69 @@
+/* connection.h: SMQ Persistent HTTP connection (reused curl handle) */
+
+#ifndef SMQ_CONNECTION_H
+#define SMQ_CONNECTION_H
+
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <curl/curl.h>
+
+/* Constants */
+
+#define CONNECTION_DEFAULT      "default"       // Name of profile used when none is selected
+
+/* Structures */
+
+typedef struct {
+    bool        nodelay;        // Disable Nagle's algorithm (TCP_NODELAY)
+    int         sndbuf;         // Socket send buffer (bytes, 0 = system default)
+    int         rcvbuf;         // Socket receive buffer (bytes, 0 = system default)
+    long        keepidle;       // Idle time before keepalive probes (seconds, 0 = no keepalive)
+    long        keepintvl;      // Interval between keepalive probes (seconds)
+    long        connect_timeout;    // Connect timeout (milliseconds, 0 = transfer timeout)
+    long        low_speed_limit;    // Abort transfers slower than this (bytes/second, 0 = never)
+    long        low_speed_time;     // ... for this long (seconds)
+    int         busy_poll;      // Busy-poll receive queue (microseconds, 0 = off, SO_BUSY_POLL)
+} ConnectionProfile;
+
+typedef struct {
+    uint64_t    resolve;        // Name lookup (ns)
+    uint64_t    connect;        // TCP connect, after lookup (ns)
+    uint64_t    tls;            // TLS handshake, after connect (ns, 0 without TLS)
+    uint64_t    total;          // Whole warm-up request (ns)
+} ConnectionTiming;
+
+typedef bool (*ConnectionCancel)(void *user);
+
+typedef struct {
+    CURL       *curl;           // Easy handle (keeps connection and DNS cache alive)
+    ConnectionProfile profile;  // Socket and transfer tuning applied to every request
+    ConnectionCancel cancel;    // Polled during requests, aborts them when true (may be NULL)
+    void       *cancel_user;    // User data for cancel
+    curl_socket_t socket;       // Socket of cancelable connection (CURL_SOCKET_BAD if none)
+    Mutex       lock;           // Protects socket (see connection_interrupt)
+    uint64_t    requests;       // Requests performed
+    uint64_t    connects;       // New connections opened
+} Connection;
+
+/* Functions */
+
+const ConnectionProfile *   connection_profile(const char *name);
+const char *    connection_profile_name(size_t index);
+
+Connection *    connection_create(const ConnectionProfile *profile);
+void            connection_delete(Connection *c);
+void            connection_cancel_on(Connection *c, ConnectionCancel cancel, void *user);
+void            connection_interrupt(Connection *c);
+
+CURL *          connection_acquire(Connection *c);
+void            connection_release(Connection *c, CURL *curl);
+
+bool            connection_warm(Connection *c, const char *url, long timeout, ConnectionTiming *timing);
+void            connection_timing(CURL *curl, ConnectionTiming *timing);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
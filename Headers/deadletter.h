@@ -0,0 +1,65 @@
+/* deadletter.h: SMQ Dead-letter file (undeliverable requests with reasons) */
+
+#ifndef SMQ_DEADLETTER_H
+#define SMQ_DEADLETTER_H
+
+#include "smq/request.h"
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define DEADLETTER_MAGIC    "SMQDLQ3"
+
+typedef enum {
+    DEADLETTER_REJECTED  = 1,   // Broker refused request (4xx other than 408 and 429)
+    DEADLETTER_EXHAUSTED = 2,   // Failed SMQOptions.max_attempts times
+    DEADLETTER_SHUTDOWN  = 3,   // Still undelivered when the SMQ was deleted
+    DEADLETTER_CLOSED    = 4,   // Published after the SMQ stopped accepting publishes
+    DEADLETTER_NREASONS,
+} DeadLetterReason;
+
+/* Structures */
+
+typedef struct {
+    DeadLetterReason reason;    // Why request was not delivered
+    uint64_t    time;           // Wall-clock time it was given up on (ns since epoch)
+    long        status;         // HTTP status of last attempt (0 = no response)
+    unsigned    attempts;       // Attempts made
+    uint64_t    producer;       // Producer tag of publish (see Request.sequence)
+    uint64_t    sequence;       // Sequence tag of publish (0 = untagged)
+    char       *method;         // Request method
+    char       *url;            // Request URL
+    char       *body;           // Request body (NULL if none)
+} DeadLetter;
+
+typedef struct {
+    FILE       *stream;         // Dead-letter file
+    uint64_t    written;        // Records appended since opened
+    uint64_t    damaged;        // Torn or corrupt records skipped by deadletter_next
+    bool        deferred;       // Records are synced by deadletter_sync, not one by one
+    Mutex       lock;           // Serializes records from multiple threads
+} DeadLetters;
+
+/* Functions */
+
+DeadLetters *   deadletter_create(const char *path);
+DeadLetters *   deadletter_open(const char *path);
+void            deadletter_close(DeadLetters *d);
+
+bool            deadletter_write(DeadLetters *d, DeadLetterReason reason, const Request *r);
+bool            deadletter_append(DeadLetters *d, const DeadLetter *letter);
+bool            deadletter_next(DeadLetters *d, DeadLetter *letter);
+void            deadletter_defer(DeadLetters *d);
+bool            deadletter_sync(DeadLetters *d);
+void            deadletter_clear(DeadLetter *letter);
+
+const char *    deadletter_reason_name(DeadLetterReason reason);
+DeadLetterReason deadletter_reason(const char *name);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,50 @@
+/* frame.h: SMQ Incremental parser for framed multi-message responses */
+
+#ifndef SMQ_FRAME_H
+#define SMQ_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define FRAME_DELIMITER     0x1E            // ASCII record separator ends each frame
+#define FRAME_HEADER        "X-SMQ-Framing" // Response header announcing framing
+#define FRAME_HEADER_VALUE  "rs"
+
+/* Structures */
+
+/**
+ * Called with each complete frame.  The view is only valid during the call
+ * and is not NUL-terminated.
+ **/
+typedef void (*FrameCallback)(const char *data, size_t length, void *user);
+
+typedef struct {
+    FrameCallback   callback;   // Receives each frame
+    void           *user;       // User data for callback
+    bool            framed;     // Response is delimited (otherwise it is one message)
+    uint64_t        trace;      // Trace id announced by response for its message (0 = none)
+    char           *carry;      // Partial frame spanning chunks
+    size_t          length;     // Bytes in carry
+    size_t          capacity;   // Allocated bytes of carry
+    size_t          frames;     // Frames emitted (since frame_reset)
+} FrameParser;
+
+/* Functions */
+
+void        frame_init(FrameParser *p, FrameCallback callback, void *user);
+void        frame_free(FrameParser *p);
+void        frame_reset(FrameParser *p);
+
+bool        frame_feed(FrameParser *p, const char *data, size_t n);
+bool        frame_finish(FrameParser *p);
+
+size_t      frame_scan(const char *data, size_t n);
+const char *frame_scanner(void);
+bool        frame_use(const char *name);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
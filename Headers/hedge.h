@@ -0,0 +1,53 @@
+/* hedge.h: SMQ Hedged requests (duplicate slow requests on a spare connection) */
+
+#ifndef SMQ_HEDGE_H
+#define SMQ_HEDGE_H
+
+#include "smq/connection.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <curl/curl.h>
+
+/* Constants */
+
+#define HEDGE_WINDOW    256         // Recent latencies the hedge delay is computed from
+#define HEDGE_SAMPLES   32          // Latencies needed before hedging starts
+#define HEDGE_BURST     10.0        // Most hedges that may be saved up from the budget
+
+typedef enum {
+    HEDGE_NONE,                 // Only the first attempt was sent
+    HEDGE_LOST,                 // Duplicate was sent, first attempt answered first
+    HEDGE_WON,                  // Duplicate was sent and answered first
+} HedgeOutcome;
+
+/* Structures */
+
+typedef struct {
+    CURLM      *multi;                  // Runs both attempts (one shared connection pool)
+    Connection *primary;                // Connection of first attempt
+    Connection *spare;                  // Connection of duplicate attempt
+    double      percentile;             // Hedge requests slower than this (0.0 - 1.0)
+    double      budget;                 // Fraction of requests that may be hedged
+    double      tokens;                 // Hedges currently allowed
+    uint64_t    window[HEDGE_WINDOW];   // Recent latencies (ns, ring)
+    size_t      samples;                // Latencies observed
+    uint64_t    delay;                  // Hedge after this long (ns, 0 = not yet)
+} Hedge;
+
+/* Functions */
+
+Hedge *     hedge_create(const ConnectionProfile *profile, double percentile, double budget);
+void        hedge_delete(Hedge *h);
+
+void        hedge_observe(Hedge *h, uint64_t latency);
+long        hedge_delay(Hedge *h);
+bool        hedge_take(Hedge *h);
+
+bool        hedge_warm(Hedge *h, const char *url, long timeout, ConnectionTiming *timing);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,72 @@
+/* log.h: SMQ Asynchronous logging */
+
+#ifndef SMQ_LOG_H
+#define SMQ_LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define LOG_DEBUG           0
+#define LOG_INFO            1
+#define LOG_ERROR           2
+#define LOG_NONE            3
+
+#ifndef SMQ_LOG_LEVEL           // Messages below this level are compiled out
+#ifdef NDEBUG
+#define SMQ_LOG_LEVEL       LOG_INFO
+#else
+#define SMQ_LOG_LEVEL       LOG_DEBUG
+#endif
+#endif
+
+#ifndef SMQ_LOG_RATE            // Messages per second per call site
+#define SMQ_LOG_RATE        100
+#endif
+
+typedef enum {
+    LOG_FORMAT_TEXT,            // "[thread] LEVEL message" lines
+    LOG_FORMAT_BINARY,          // LogRecord headers followed by message bytes
+} LogFormat;
+
+/* Structures */
+
+typedef struct {
+    const char     *file;       // Source file of call site
+    const char     *func;       // Function of call site
+    int             line;       // Line of call site
+    int             level;      // Level of call site
+    _Atomic uint64_t window;    // Current rate limiting window (seconds)
+    atomic_uint     count;      // Messages logged in current window
+    atomic_uint     suppressed; // Messages suppressed since last logged message
+} LogSite;
+
+typedef struct {
+    uint64_t    timestamp;      // Realtime of message (nanoseconds since epoch)
+    uint64_t    thread;         // pthread_self() of logging thread
+    uint32_t    level;          // Level of message
+    uint32_t    line;           // Line of call site
+    uint32_t    suppressed;     // Messages suppressed at this site before this one
+    uint32_t    length;         // Length of message that follows
+} LogRecord;
+
+/* Macros */
+
+#define log_at(L, M, ...) \
+    do { \
+        if ((L) >= SMQ_LOG_LEVEL) { \
+            static LogSite _log_site = {.file = __FILE__, .func = __func__, .line = __LINE__, .level = L}; \
+            log_write(&_log_site, M, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/* Functions */
+
+void    log_write(LogSite *site, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void    log_flush(void);
+void    log_configure(int fd, LogFormat format);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,39 @@
+/* perf.h: SMQ Hardware performance counters (perf_event_open) */
+
+#ifndef SMQ_PERF_H
+#define SMQ_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+typedef enum {
+    PERF_CYCLES,                // CPU cycles
+    PERF_INSTRUCTIONS,          // Retired instructions
+    PERF_CACHE_MISSES,          // Last level cache misses
+    PERF_CONTEXT_SWITCHES,      // Context switches (software event)
+    PERF_NCOUNTERS,
+} PerfCounter;
+
+/* Structures */
+
+typedef struct {
+    int      fds[PERF_NCOUNTERS];       // Counter file descriptors (-1 if unavailable)
+    uint64_t values[PERF_NCOUNTERS];    // Values from last perf_stop (scaled)
+} PerfCounters;
+
+/* Functions */
+
+bool        perf_open(PerfCounters *p);
+void        perf_close(PerfCounters *p);
+
+void        perf_start(PerfCounters *p);
+void        perf_stop(PerfCounters *p);
+
+bool        perf_available(const PerfCounters *p, PerfCounter c);
+const char *perf_name(PerfCounter c);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,8 +6,16 @@
 #include "smq/request.h"
 #include "smq/thread.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
 
+/* Constants */
+
+typedef enum {
+    QUEUE_RUNNING,      // Accepting pushes and pops
+    QUEUE_STOPPED,      // Rejecting pushes; pops return what is left, then NULL
+} QueueState;
+
 /* Structures */
 
 typedef struct Queue Queue;
@@ -15,7 +23,8 @@ struct Queue {
     Request *head;      // First request in the queue.
     Request *tail;      // Last request in the queue.
     size_t   size;      // Total number of requests in the queue.
-    bool     running;   // Whether or not the queue is running (active).
+    atomic_int state;   // QueueState (written under lock, read without it).
+    Arena   *arena;     // Storage of queued requests (NULL = heap).
 
     // TODO: Add any necessary thread and synchromization primitives.
     Mutex  lock;        // Queue 1
@@ -29,12 +38,17 @@ struct Queue {
 /* Functions */
 
 Queue *     queue_create();
+Queue *     queue_create_arena(size_t segment, bool huge);
 void        queue_delete(Queue *q);
 
+Request *   queue_request(Queue *q, const char *method, const char *url, const char *body);
+Request *   queue_message(Queue *q, const char *body, size_t length);
+
 void        queue_shutdown(Queue *q);
 
-void        queue_push(Queue *q, Request *r);
+bool        queue_push(Queue *q, Request *r);
 Request *   queue_pop(Queue *q, time_t timeout);
+size_t      queue_size(Queue *q);
 
 #endif
 
@@ -0,0 +1,111 @@
+/* recorder.h: SMQ Flight recorder (ring of recent client events) */
+
+#ifndef SMQ_RECORDER_H
+#define SMQ_RECORDER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Constants */
+
+#define RECORDER_EVENTS     1024    // Default capacity of each ring (power of two)
+
+typedef enum {
+    RECORDER_ENQUEUE,               // a = queue (0 outgoing, 1 incoming)
+    RECORDER_DEQUEUE,               // a = queue (0 outgoing, 1 incoming)
+    RECORDER_REQUEST_START,         // a = method ('G', 'P', 'D')
+    RECORDER_REQUEST_END,           // a = status (1 success, 0 failure), b = duration (ns)
+    RECORDER_RETRY,                 // a = queue request was pushed back on
+    RECORDER_DEPTH,                 // a = outgoing depth, b = incoming depth
+    RECORDER_DEAD_LETTER,           // a = reason (DeadLetterReason), b = HTTP status
+    RECORDER_NTYPES,
+} RecorderEvent;
+
+typedef enum {
+    RECORDER_RING_APP,              // Application threads (shared, atomic cursor)
+    RECORDER_RING_PUSHER,           // Pusher thread only (single writer)
+    RECORDER_RING_PULLER,           // Puller thread only (single writer)
+    RECORDER_NRINGS,
+} RecorderRingId;
+
+/* Structures */
+
+typedef struct {
+    atomic_uint_fast64_t seq;       // Sequence number + 1 (0 = empty / being written)
+    uint64_t             time;      // Clock ticks (see recorder_clock)
+    uint32_t             type;      // RecorderEvent
+    uint32_t             a;         // First argument
+    uint64_t             b;         // Second argument
+} RecorderSlot;
+
+typedef struct {
+    atomic_uint_fast64_t next;      // Next sequence number of ring
+} __attribute__((aligned(64))) RecorderRing;
+
+typedef struct {
+    RecorderRing         rings[RECORDER_NRINGS];
+    uint64_t             mask;      // Capacity of each ring - 1
+    uint64_t             ticks;     // Clock ticks at creation
+    uint64_t             ns;        // Monotonic time at creation
+    RecorderSlot         slots[];   // Ring i owns slots [i * capacity, (i + 1) * capacity)
+} Recorder;
+
+/* Functions */
+
+Recorder *  recorder_create(size_t capacity);
+void        recorder_delete(Recorder *r);
+void        recorder_dump(Recorder *r, FILE *stream);
+
+/**
+ * Read event clock: the TSC on x86-64 (a few cycles), otherwise the
+ * monotonic clock.  Ticks are converted to time only when dumping.
+ **/
+static inline uint64_t recorder_clock(void) {
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Record event in ring (never blocks).
+ *
+ * Like the stats shards, the pusher and puller each own a ring and advance
+ * its cursor without an atomic read-modify-write; only the application ring,
+ * which many threads may share, pays for one.
+ *
+ * @param   r           Recorder structure.
+ * @param   ring        Ring of the calling thread.
+ * @param   type        RecorderEvent.
+ * @param   a           First argument.
+ * @param   b           Second argument.
+ **/
+static inline void recorder_record(Recorder *r, RecorderRingId ring, uint32_t type, uint32_t a, uint64_t b) {
+    atomic_uint_fast64_t *next = &r->rings[ring].next;
+    uint64_t              seq;
+
+    if (ring == RECORDER_RING_APP) {
+        seq = atomic_fetch_add_explicit(next, 1, memory_order_relaxed);
+    } else {
+        seq = atomic_load_explicit(next, memory_order_relaxed);
+        atomic_store_explicit(next, seq + 1, memory_order_relaxed);
+    }
+    RecorderSlot *slot = &r->slots[ring * (r->mask + 1) + (seq & r->mask)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->time = recorder_clock();
+    slot->type = type;
+    slot->a    = a;
+    slot->b    = b;
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,66 @@
+/* render.h: SMQ Terminal renderer (single writer for shell output) */
+
+#ifndef SMQ_RENDER_H
+#define SMQ_RENDER_H
+
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Constants */
+
+#define RENDER_FPS      30          // Default frames per second
+#define RENDER_BUDGET   (1<<16)     // Default bytes of lines written per frame
+#define RENDER_INPUT    BUFSIZ      // Maximum length of input line
+#define RENDER_PROMPT   64          // Maximum length of prompt
+#define RENDER_STATUS   256         // Maximum length of status line
+
+/* Structures */
+
+typedef struct {
+    int         fd;                         // Terminal to write to
+    uint64_t    interval;                   // Minimum time between frames (ns)
+    uint64_t    drawn;                      // Monotonic time of last frame (ns)
+
+    char       *pending;                    // Lines waiting for next frame
+    char       *spare;                      // Lines being written (swapped with pending)
+    size_t      capacity;                   // Size of pending and spare (bytes per frame)
+    size_t      length;                     // Bytes in pending
+    uint64_t    overflow;                   // Lines that did not fit in pending
+
+    char        prompt[RENDER_PROMPT];      // Prompt shown before input line
+    char        input[RENDER_INPUT];        // Input line to show
+    size_t      input_length;
+    char        shown[RENDER_INPUT];        // Input line on terminal (writer only)
+    size_t      shown_length;
+    bool        prompted;                   // Whether prompt is on terminal (writer only)
+    bool        reprompt;                   // Whether prompt changed since last frame
+    size_t      columns;                    // Terminal width (0 = unknown, input not clamped)
+    bool        recolumn;                   // Whether width changed since last frame
+    char        status[RENDER_STATUS];      // Status line shown above prompt (empty = none)
+    bool        restatus;                   // Whether status changed since last frame
+    bool        status_shown;               // Whether status line is on terminal (writer only)
+    bool        dirty;                      // Whether anything changed since last frame
+
+    Mutex       lock;                       // Protects pending, prompt, status and input
+} Renderer;
+
+/* Functions */
+
+Renderer *  render_create(int fd, const char *prompt, unsigned fps, size_t budget);
+void        render_delete(Renderer *r);
+
+void        render_line(Renderer *r, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void        render_input(Renderer *r, const char *input, size_t length);
+void        render_prompt(Renderer *r, const char *prompt);
+void        render_status(Renderer *r, const char *status);
+void        render_columns(Renderer *r, size_t columns);
+
+long        render_timeout(Renderer *r);
+bool        render_frame(Renderer *r);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,6 +3,18 @@
 #ifndef SMQ_REQUEST_H
 #define SMQ_REQUEST_H
 
+#include "smq/arena.h"
+#include "smq/connection.h"
+#include "smq/frame.h"
+#include "smq/hedge.h"
+#include "smq/trace.h"
+
+/* Constants */
+
+#define REQUEST_PRODUCER_HEADER "X-SMQ-Producer"    // Identifies publishing SMQ (for deduplication)
+#define REQUEST_SEQUENCE_HEADER "X-SMQ-Sequence"    // Orders publishes of one producer
+#define REQUEST_TRACE_HEADER    "X-SMQ-Trace"       // Trace id of traced publish (passed on with the message)
+
 /* Structures */
 
 typedef struct Request Request;
@@ -10,6 +22,12 @@ struct Request {
     char    *method;    // Method string performed by Request
     char    *url;       // URL string to send with Request
     char    *body;      // Body string to send in Request
+    Trace   *trace;     // Trace of message (NULL if not sampled)
+    bool     packed;    // Request and strings are one arena allocation
+    unsigned attempts;  // Times request was performed
+    long     status;    // HTTP status of last attempt (0 = no response)
+    uint64_t producer;  // Producer of publish (see sequence)
+    uint64_t sequence;  // Sequence number of publish (0 = untagged)
 
     Request *next;      // Pointer to next Request in sequence
 };
@@ -17,9 +35,13 @@ struct Request {
 /* Functions */
 
 Request *   request_create(const char *method, const char *url, const char *body);
+Request *   request_create_in(Arena *arena, const char *method, const char *url, const char *body);
+Request *   request_create_message(Arena *arena, const char *body, size_t length);
 void        request_delete(Request *r);
 
-char *      request_perform(Request *r, long timeout);
+char *      request_perform(Request *r, long timeout, Connection *c);
+bool        request_stream(Request *r, long timeout, FrameParser *parser, Connection *c);
+char *      request_hedge(Request *r, long timeout, Hedge *h, HedgeOutcome *outcome);
 
 #endif
 
@@ -0,0 +1,32 @@
+/* rtt.h: SMQ Round-trip time estimator (request timeouts) */
+
+#ifndef SMQ_RTT_H
+#define SMQ_RTT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define RTT_GRANULARITY     1000000     // Clock granularity G of RFC 6298 (ns)
+
+/* Structures */
+
+typedef struct {
+    atomic_uint_fast64_t srtt;      // Smoothed round-trip time (ns, 0 = no sample yet)
+    atomic_uint_fast64_t rttvar;    // Round-trip time variation (ns)
+    atomic_uint_fast64_t rto;       // Current retransmission timeout (ns)
+    uint64_t             min;       // Lower bound of timeout (ns)
+    uint64_t             max;       // Upper bound of timeout (ns)
+} RTTEstimator;
+
+/* Functions */
+
+void    rtt_init(RTTEstimator *e, long initial, long min, long max);
+void    rtt_observe(RTTEstimator *e, uint64_t sample);
+void    rtt_backoff(RTTEstimator *e);
+long    rtt_timeout(RTTEstimator *e);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,72 @@
+/* scrollback.h: SMQ Bounded message history with incremental search */
+
+#ifndef SMQ_SCROLLBACK_H
+#define SMQ_SCROLLBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define SCROLLBACK_CAPACITY (8<<20)     // Default bytes of message text kept
+#define SCROLLBACK_LIMIT    (1<<18)     // Default number of messages kept
+#define SCROLLBACK_QUERY    256         // Maximum length of search query
+
+/* Structures */
+
+typedef struct {
+    uint64_t    offset;         // Logical byte offset of text in ring (never wraps)
+    uint32_t    length;         // Length of text
+} ScrollbackEntry;
+
+typedef struct {
+    char       *data;           // Ring of packed message text
+    size_t      capacity;       // Size of data (bytes)
+    ScrollbackEntry *entries;   // Ring of records (indexed by sequence % limit)
+    size_t      limit;          // Number of entries
+    uint64_t    first;          // Sequence number of oldest message kept
+    uint64_t    next;           // Sequence number of next message
+    uint64_t    end;            // Logical byte offset after newest message
+    int         fd;             // File backing data (-1 if in memory)
+    char       *path;           // Path of backing file (removed on delete)
+} Scrollback;
+
+typedef struct {
+    uint64_t    sequence;       // Message
+    uint16_t    depth;          // Length of longest query prefix it contains
+} ScrollbackCandidate;
+
+typedef struct {
+    char        query[SCROLLBACK_QUERY];
+    size_t      length;         // Length of query
+    ScrollbackCandidate *candidates;    // Messages containing query[0] (oldest first)
+    size_t      count;          // Candidates
+    size_t      allocated;      // Allocated candidates
+    size_t      matches;        // Candidates containing the whole query
+    uint64_t    scanned;        // Sequence number of next message to examine
+} ScrollbackSearch;
+
+/* Functions */
+
+Scrollback *scrollback_create(size_t capacity, size_t limit, const char *path);
+void        scrollback_delete(Scrollback *s);
+
+uint64_t    scrollback_append(Scrollback *s, const char *text, size_t length);
+const char *scrollback_get(Scrollback *s, uint64_t sequence, size_t *length);
+
+void        scrollback_search_init(ScrollbackSearch *q);
+void        scrollback_search_clear(ScrollbackSearch *q);
+size_t      scrollback_search(Scrollback *s, ScrollbackSearch *q, const char *query, size_t length);
+size_t      scrollback_matches(const ScrollbackSearch *q, size_t skip, uint64_t *sequences, size_t n);
+
+/**
+ * Number of messages kept.
+ **/
+static inline size_t scrollback_count(const Scrollback *s) {
+    return s->next - s->first;
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,135 @@
+/* stats.h: SMQ Client statistics (sharded counters and latency histograms) */
+
+#ifndef SMQ_STATS_H
+#define SMQ_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Constants */
+
+typedef enum {
+    STATS_PUBLISHED,            // Messages published (accepted by smq_publish)
+    STATS_PUBLISHED_BYTES,      // Bytes published
+    STATS_RECEIVED,             // Messages retrieved by the application
+    STATS_RECEIVED_BYTES,       // Bytes retrieved
+    STATS_REQUESTS,             // HTTP requests started
+    STATS_COMPLETED,            // HTTP requests finished (success or failure)
+    STATS_FAILURES,             // HTTP requests that failed
+    STATS_RETRIES,              // Outgoing requests pushed back for retry
+    STATS_HEDGES,               // Outgoing requests duplicated on the spare connection
+    STATS_HEDGE_WINS,           // Hedged requests answered first on the spare connection
+    STATS_DEAD_LETTERS,         // Outgoing requests given up on (see deadletter.h)
+    STATS_NCOUNTERS,
+} StatsCounter;
+
+typedef enum {
+    STATS_LATENCY_PUSH,         // Outgoing request duration (publish, subscribe, ...)
+    STATS_LATENCY_PULL,         // Incoming long-poll duration
+    STATS_NHISTOGRAMS,
+} StatsHistogram;
+
+typedef enum {
+    STATS_SHARD_APP,            // Application threads (shared, atomic adds)
+    STATS_SHARD_PUSHER,         // Pusher thread only (single writer)
+    STATS_SHARD_PULLER,         // Puller thread only (single writer)
+    STATS_NSHARDS,
+} StatsShardId;
+
+typedef enum {
+    STATS_PHASE_RESOLVE,        // Name lookup of server
+    STATS_PHASE_CONNECT,        // TCP connect
+    STATS_PHASE_TLS,            // TLS handshake
+    STATS_PHASE_SUBSCRIBE,      // Initial subscriptions confirmed
+    STATS_PHASE_READY,          // From creation until connected and subscribed
+    STATS_NPHASES,
+} StatsPhase;
+
+#define STATS_BUCKETS   28      // Bucket i counts latencies < 2^i microseconds
+#define STATS_OVERFLOW  (STATS_BUCKETS - 1) // Except the last: >= 2^26 us (67 s, beyond any long-poll)
+
+/* Structures */
+
+typedef struct {
+    atomic_uint_fast64_t counters[STATS_NCOUNTERS];
+    atomic_uint_fast64_t buckets[STATS_NHISTOGRAMS][STATS_BUCKETS];
+    atomic_uint_fast64_t sums[STATS_NHISTOGRAMS];               // Nanoseconds
+    atomic_uint_fast64_t cpu;                                   // CPU time of owning thread (ns)
+} __attribute__((aligned(64))) StatsShard;
+
+typedef struct {
+    StatsShard shards[STATS_NSHARDS];
+    atomic_uint_fast64_t phases[STATS_NPHASES];                 // Startup phase durations (ns, written once)
+} Stats;
+
+typedef struct {
+    uint64_t counters[STATS_NCOUNTERS];
+    uint64_t buckets[STATS_NHISTOGRAMS][STATS_BUCKETS];         // Not cumulative
+    uint64_t sums[STATS_NHISTOGRAMS];                           // Nanoseconds
+    uint64_t cpu[STATS_NSHARDS];                                // Thread CPU time (ns, 0 for app)
+    uint64_t phases[STATS_NPHASES];                             // Startup phase durations (ns)
+    uint64_t in_flight;         // Requests started but not completed
+    uint64_t srtt;              // Smoothed round-trip time of outgoing requests (ns)
+    uint64_t rto;               // Current timeout of outgoing requests (ns)
+    uint64_t poll_wait;         // Server-side wait of current long-poll (ns)
+    uint64_t outgoing;          // Outgoing queue depth
+    uint64_t incoming;          // Incoming queue depth
+} SMQStats;
+
+/* Functions */
+
+void    stats_collect(Stats *s, SMQStats *out);
+double  stats_percentile(const SMQStats *s, StatsHistogram h, double p);
+void    stats_format(const SMQStats *s, const char *name, FILE *stream);
+
+/**
+ * Add n to counter in shard.
+ *
+ * Single-writer shards avoid atomic read-modify-write instructions; only the
+ * application shard, which many threads may share, pays for them.
+ *
+ * All application threads share that one shard, so threads publishing or
+ * retrieving concurrently contend on the same cache lines; it is not split
+ * per thread.
+ **/
+static inline void stats_add(Stats *s, StatsShardId shard, StatsCounter c, uint64_t n) {
+    atomic_uint_fast64_t *counter = &s->shards[shard].counters[c];
+
+    if (shard == STATS_SHARD_APP) {
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+/**
+ * Record latency (nanoseconds) in histogram of single-writer shard.
+ **/
+static inline void stats_observe(Stats *s, StatsShardId shard, StatsHistogram h, uint64_t ns) {
+    StatsShard *sh     = &s->shards[shard];
+    uint64_t    us     = ns / 1000;
+    int         bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (bucket > STATS_OVERFLOW) {
+        bucket = STATS_OVERFLOW;
+    }
+
+    atomic_store_explicit(&sh->buckets[h][bucket], atomic_load_explicit(&sh->buckets[h][bucket], memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&sh->sums[h], atomic_load_explicit(&sh->sums[h], memory_order_relaxed) + ns, memory_order_relaxed);
+}
+
+/**
+ * Publish CPU time of the calling thread in its single-writer shard.
+ **/
+static inline void stats_cpu(Stats *s, StatsShardId shard) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        atomic_store_explicit(&s->shards[shard].cpu, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec, memory_order_relaxed);
+    }
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
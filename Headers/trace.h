@@ -0,0 +1,84 @@
+/* trace.h: SMQ Sampled per-message tracing */
+
+#ifndef SMQ_TRACE_H
+#define SMQ_TRACE_H
+
+#include "smq/thread.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+typedef enum {
+    TRACE_PUBLISH,      // smq_publish called
+    TRACE_ENQUEUE,      // Pushed on outgoing queue
+    TRACE_DEQUEUE,      // Popped by pusher (last attempt)
+    TRACE_SEND,         // Request started (last attempt)
+    TRACE_ACK,          // Request accepted by broker
+    TRACE_POLL,         // Long-poll request started
+    TRACE_RESPONSE,     // Long-poll request returned message
+    TRACE_DELIVER,      // Pushed on incoming queue
+    TRACE_RETRIEVE,     // Returned by smq_retrieve
+    TRACE_NSTAGES,
+} TraceStage;
+
+/* Structures */
+
+typedef struct Trace Trace;
+struct Trace {
+    uint64_t    id;                     // Trace identifier (shared by publish and delivery)
+    bool        incoming;               // Whether message was received (or published)
+    unsigned    attempts;               // Number of requests made for message
+    uint64_t    stamps[TRACE_NSTAGES];  // Monotonic time of each stage (ns, 0 = not reached)
+};
+
+/**
+ * Called with each finished trace, which is freed when the callback returns.
+ *
+ * Outgoing traces finish on the pusher thread (when the broker accepts the
+ * request, or when it is dead-lettered); incoming traces finish on the
+ * application thread calling smq_retrieve.  Dead letters of publishes to a
+ * closed SMQ finish on the publishing thread, and requests left at
+ * smq_delete on the thread calling it.  The puller never calls it.
+ *
+ * Calls are not serialized: the callback may run concurrently on several
+ * threads and must be thread-safe.  It delays the pusher while it runs.
+ **/
+typedef void (*TraceCallback)(const Trace *trace, void *user);
+
+typedef struct {
+    unsigned        period;     // Trace one in every period messages
+    atomic_uint     counter;    // Messages seen (for sampling)
+    atomic_ulong    next;       // Next trace identifier (from a random base)
+    TraceCallback   callback;   // User callback for finished traces (may be NULL)
+    void           *user;       // User data for callback
+    FILE           *stream;     // Chrome trace-event JSON output (may be NULL)
+    uint64_t        started;    // Monotonic time of creation (ns, origin of output)
+    bool            first;      // Whether no event has been written yet
+    Mutex           lock;       // Serializes output
+} Tracer;
+
+/* Functions */
+
+Tracer *    tracer_create(unsigned period, const char *path, TraceCallback callback, void *user);
+void        tracer_delete(Tracer *t);
+
+Trace *     tracer_sample(Tracer *t, bool incoming);
+Trace *     tracer_continue(Tracer *t, uint64_t id);
+void        tracer_finish(Tracer *t, Trace *trace);
+
+/**
+ * Stamp stage of trace with current time (no-op if trace is NULL).
+ **/
+static inline void trace_stamp(Trace *trace, TraceStage stage) {
+    if (trace) {
+        trace->stamps[stage] = monotonic_ns();
+    }
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
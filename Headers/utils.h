@@ -3,25 +3,24 @@
 #ifndef SMQ_UTILS_H
 #define SMQ_UTILS_H
 
+#include "smq/log.h"
+
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-/* Logging */
-
-#ifndef NDEBUG
-#define debug(M, ...) \
-    fprintf(stderr, "[%09lu] DEBUG %s:%d:%s: " M "\n", pthread_self(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
-#else
-#define debug(M, ...)
-#endif
-
-#define info(M, ...) \
-    fprintf(stderr, "[%09lu] INFO  " M "\n", pthread_self(), ##__VA_ARGS__)
+/* Logging
+ *
+ * Messages are queued on a per-thread ring and written by a background thread
+ * (see log.h); levels below SMQ_LOG_LEVEL are compiled out.
+ */
 
-#define error(M, ...) \
-    fprintf(stderr, "[%09lu] ERROR " M "\n", pthread_self(), ##__VA_ARGS__)
+#define debug(M, ...)   log_at(LOG_DEBUG, M, ##__VA_ARGS__)
+#define info(M, ...)    log_at(LOG_INFO,  M, ##__VA_ARGS__)
+#define error(M, ...)   log_at(LOG_ERROR, M, ##__VA_ARGS__)
 
 /* Miscellaneous */
 
@@ -34,8 +33,20 @@
         clock_gettime(CLOCK_REALTIME, &ts); \
         ts.tv_sec  += (timeout / 1000); \
         ts.tv_nsec += (timeout % 1000) * 1000000; \
+        if (ts.tv_nsec >= 1000000000) { \
+            ts.tv_sec  += 1; \
+            ts.tv_nsec -= 1000000000; \
+        } \
     } while(0);
 
+/* Time */
+
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */